@@ -0,0 +1,116 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+/* Measures how many map images a renderer makes per second.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdlib.h>
+#include <gio/gio.h>
+#include "cc-timezone-renderer.h"
+#include "tz.h"
+
+/* Makes a batch of images of one size through one renderer, each with a
+ * different location pinned and its offset highlighted, the way thumbnails
+ * are made on a server. Images go through cc_timezone_renderer_write_png,
+ * which keeps the map drawn at the last size it was asked for. The map data
+ * is loaded with the renderer, and the first image draws the map at the
+ * batch's size for the rest to reuse, so both are timed on their own.
+ *
+ * Usage: bench-renderer [N_IMAGES [WIDTH HEIGHT]]
+ * Run it with the environment of make check, so it finds the map data. */
+
+#define N_IMAGES_DEFAULT 100
+#define WIDTH_DEFAULT 800
+#define HEIGHT_DEFAULT 400
+
+static gsize
+write_image (CcTimezoneRenderer *renderer, gint width, gint height)
+{
+  GOutputStream *stream = g_memory_output_stream_new_resizable ();
+  GError *error = NULL;
+  gsize size;
+
+  if (!cc_timezone_renderer_write_png (renderer, stream, width, height,
+                                       NULL, &error))
+    {
+      g_printerr ("%s\n", error->message);
+      exit (1);
+    }
+
+  g_output_stream_close (stream, NULL, NULL);
+  size = g_memory_output_stream_get_data_size (G_MEMORY_OUTPUT_STREAM (stream));
+  g_object_unref (stream);
+
+  return size;
+}
+
+int
+main (int argc, char **argv)
+{
+  gint n_images = argc > 1 ? atoi (argv[1]) : N_IMAGES_DEFAULT;
+  gint width = argc > 3 ? atoi (argv[2]) : WIDTH_DEFAULT;
+  gint height = argc > 3 ? atoi (argv[3]) : HEIGHT_DEFAULT;
+  CcTimezoneRenderer *renderer;
+  GPtrArray *locations;
+  TzDB *tzdb;
+  gint64 start, loaded, first, end;
+  gsize bytes = 0;
+  gint i;
+
+  if (n_images < 1 || width < 1 || height < 1)
+    {
+      g_printerr ("Usage: %s [N_IMAGES [WIDTH HEIGHT]]\n", argv[0]);
+      return 2;
+    }
+
+  tzdb = tz_load_db ();
+  locations = tz_get_locations (tzdb);
+
+  start = g_get_monotonic_time ();
+  renderer = cc_timezone_renderer_new ();
+  loaded = first = g_get_monotonic_time ();
+
+  for (i = 0; i < n_images; i++)
+    {
+      /* Spread the pins over the world, so the highlight changes too */
+      if (locations->len > 0)
+        cc_timezone_renderer_set_location (renderer,
+                                           g_ptr_array_index (locations,
+                                                              (i * 7919u) % locations->len));
+
+      bytes += write_image (renderer, width, height);
+
+      if (i == 0)
+        first = g_get_monotonic_time ();
+    }
+
+  end = g_get_monotonic_time ();
+
+  g_print ("%d images of %dx%d, %" G_GSIZE_FORMAT " bytes of PNG\n",
+           n_images, width, height, bytes);
+  g_print ("loading the map data: %.1f ms\n", (loaded - start) / 1000.0);
+  g_print ("first image: %.1f ms\n", (first - loaded) / 1000.0);
+  g_print ("%.1f images per second overall\n",
+           n_images * (gdouble) G_USEC_PER_SEC / MAX (1, end - loaded));
+
+  if (n_images > 1)
+    g_print ("%.1f images per second after the first\n",
+             (n_images - 1) * (gdouble) G_USEC_PER_SEC / MAX (1, end - first));
+
+  g_object_unref (renderer);
+  tz_db_free (tzdb);
+
+  return 0;
+}
@@ -27,7 +27,10 @@
 #include "cc-timezone-location.h"
 #include <math.h>
 #include "tz.h"
-#include <librsvg/rsvg.h>
+#include "tz-cache.h"
+#include "tz-geometry.h"
+#include "tz-render.h"
+#include "tz-tiles.h"
 #include <string.h>
 #include <stdlib.h>
 
@@ -36,6 +39,32 @@ G_DEFINE_TYPE (CcTimezoneMap, cc_timezone_map, GTK_TYPE_WIDGET)
 #define TIMEZONE_MAP_PRIVATE(o) \
   (G_TYPE_INSTANCE_GET_PRIVATE ((o), CC_TYPE_TIMEZONE_MAP, CcTimezoneMapPrivate))
 
+/* How long the allocation has to stay the same before the map is rendered
+ * again at the new size. Until then the previous render is scaled. */
+#define RENDER_DELAY_MS 150
+
+/* Large maps are rendered in horizontal bands, one thread per band. Bands
+ * are kept at least this tall so small maps stay on a single thread. */
+#define RENDER_BAND_MIN_HEIGHT 128
+#define RENDER_BANDS_MAX 8
+
+/* Rendered maps are kept in the user's cache directory, so that a map shown
+ * at a size seen before can be loaded without parsing the SVG */
+#define RASTER_CACHE_DIR "maps"
+#define RASTER_CACHE_MAX_SIZE (64 * 1024 * 1024)
+#define RASTER_CACHE_MAGIC "TZRASTER"
+
+#define ZOOM_MAX 32.0
+#define ZOOM_STEP 1.25
+#define TILE_CACHE_MAX_SIZE (64*1024*1024)
+
+/* Locations are bucketed on a grid over the map for hover lookups, and the
+ * nearest one within HOVER_RADIUS widget pixels of the pointer is shown */
+#define LOCATION_GRID_COLUMNS 128
+#define LOCATION_GRID_ROWS 64
+#define HOVER_RADIUS 16.0
+#define HOVER_MARKER_RADIUS 3.0
+
 
 typedef struct
 {
@@ -46,19 +75,120 @@ typedef struct
   guchar alpha;
 } CcTimezoneMapOffset;
 
-struct _CcTimezoneMapPrivate
+typedef struct
 {
-  RsvgHandle *map_svg;
+  gchar magic[8];
+  guint32 byte_order;
+  guint32 width;
+  guint32 height;
+  guint32 stride;
+  guint32 scale;
+  guint32 reserved;
+} RasterCacheHeader;
 
-  /* Cache the rendered map and highlight images as cairo patterns. The
-   * patterns only need to be re-rendered when the widget allocation changes
-   * and not on every draw. */
+struct _CcTimezoneMapPrivate
+{
+  /* The map shapes, flattened from the SVG at build time. The geometry is
+   * read-only, so every render thread draws from it directly. */
+  TzGeometry *geometry;
+
+  /* Digest of everything a render depends on besides its size */
+  gchar *raster_digest;
+
+  /* Cache the rendered map as an image. The image only needs to be
+   * re-rendered when the widget allocation changes and not on every draw.
+   * Rendering happens in a thread, so the image may be from a previous
+   * allocation and is scaled to fit until the new one is ready. */
+  cairo_surface_t *background_image;
+
+  /* The image copied into a surface similar to the widget's window, so that
+   * drawing it is a blit in the window's own format. It is made on the first
+   * draw after a render or realize, and dropped when the window goes away. */
   cairo_pattern_t *background;
+  gint background_width;
+  gint background_height;
+
+  /* The device scale of the background and the offset index. Both are
+   * rendered at the widget's scale factor, so they are only ever as large
+   * as the monitor the widget is on needs. */
+  gint background_scale;
+
+  /* The size and scale factor of the most recently requested render, and
+   * the pending timeout or running render for it */
+  gint render_width;
+  gint render_height;
+  gint render_scale;
+  guint render_timeout;
+  GCancellable *render_cancellable;
+
+  /* One byte per device pixel of the allocation, holding the position in
+   * offset_palette (plus one) of the offset covering that pixel, or 0 for the
+   * sea. Highlights and hit tests are answered from this map instead of
+   * rendering and caching a full image for every offset. */
+  guint8 *offset_index;
+  gint offset_index_width;
+  gint offset_index_height;
+
+  /* The distinct offsets used by the locations, and the palette id of each
+   * location in the tzdb location array */
+  GArray *offset_palette;
+  guint8 *location_offset_ids;
+
+  /* The projected position of each location in the tzdb location array, as
+   * x and y pairs from 0 to 1 across the map. Positions at a particular size
+   * are then just a multiplication. */
+  gdouble *location_points;
+
+  /* The projected position of the current location */
+  gdouble location_point[2];
+
+  /* The zoomed view. The map is magnified by zoom, with the point view_x,
+   * view_y (from 0 to 1 across the map) at the top left of the widget. */
+  gdouble zoom;
+  gdouble view_x;
+  gdouble view_y;
+
+  /* Tiles rendered at the zoomed size, drawn over the stretched background
+   * once they are ready. Created the first time the map is zoomed. */
+  TzTileCache *tiles;
+
+  /* Pointer state for telling clicks from drags, and the zoom when a pinch
+   * started */
+  gboolean button_down;
+  gboolean dragging;
+  gdouble press_x;
+  gdouble press_y;
+  gdouble press_view_x;
+  gdouble press_view_y;
+  GtkGesture *zoom_gesture;
+  gdouble gesture_zoom;
+
+  /* The bounding box of each offset id in offset_index, for invalidating
+   * only the area a highlight covers */
+  cairo_rectangle_int_t offset_extents[G_MAXUINT8 + 1];
+
+  /* Mask of the selected offset, built from offset_index when the selection
+   * changes */
   cairo_pattern_t *highlight;
-
-  /* Cache the highlights so they only need to be rendered once for a
-   * given size. */
-  GHashTable *highlight_table;
+  guint8 highlight_id;
+
+  /* The indices of the locations in each cell of the location grid, row by
+   * row. The locations of cell n are location_grid_items[location_grid_start[n]]
+   * up to location_grid_items[location_grid_start[n + 1]]. */
+  guint *location_grid_start;
+  guint *location_grid_items;
+
+  /* Hover tracking. Motion events only record where the pointer is, and the
+   * offset and location under it are looked up once per frame. */
+  gboolean hover_tracking;
+  guint hover_tick;
+  gboolean hover_inside;
+  gdouble hover_x;
+  gdouble hover_y;
+  guint8 hover_id;
+  gint hover_location;
+  cairo_pattern_t *hover_highlight;
+  guint8 hover_highlight_id;
 
   gdouble selected_offset;
   gboolean show_offset;
@@ -85,6 +215,7 @@ enum
 enum {
   PROP_0,
   PROP_SELECTED_OFFSET,
+  PROP_HOVER_TRACKING,
 };
 
 static guint signals[LAST_SIGNAL];
@@ -113,6 +244,9 @@ cc_timezone_map_get_property (GObject    *object,
     case PROP_SELECTED_OFFSET:
       g_value_set_double(value, map->priv->selected_offset);
       break;
+    case PROP_HOVER_TRACKING:
+      g_value_set_boolean (value, map->priv->hover_tracking);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
     }
@@ -130,6 +264,9 @@ cc_timezone_map_set_property (GObject      *object,
     case PROP_SELECTED_OFFSET:
       cc_timezone_map_set_selected_offset(map, g_value_get_double(value));
       break;
+    case PROP_HOVER_TRACKING:
+      cc_timezone_map_set_hover_tracking (map, g_value_get_boolean (value));
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
     }
@@ -140,28 +277,61 @@ cc_timezone_map_dispose (GObject *object)
 {
   CcTimezoneMapPrivate *priv = CC_TIMEZONE_MAP (object)->priv;
 
-  if (priv->map_svg)
+  if (priv->render_timeout)
     {
-      g_object_unref (priv->map_svg);
-      priv->map_svg = NULL;
+      g_source_remove (priv->render_timeout);
+      priv->render_timeout = 0;
     }
 
+  if (priv->render_cancellable)
+    {
+      g_cancellable_cancel (priv->render_cancellable);
+      g_object_unref (priv->render_cancellable);
+      priv->render_cancellable = NULL;
+    }
+
+  if (priv->tiles)
+    {
+      tz_tile_cache_free (priv->tiles);
+      priv->tiles = NULL;
+    }
+
+  g_clear_object (&priv->zoom_gesture);
+
   if (priv->background)
     {
       cairo_pattern_destroy (priv->background);
       priv->background = NULL;
     }
 
-  /* The highlight reference is held by the hash table */
+  if (priv->background_image)
+    {
+      cairo_surface_destroy (priv->background_image);
+      priv->background_image = NULL;
+    }
+
   if (priv->highlight)
     {
+      cairo_pattern_destroy (priv->highlight);
       priv->highlight = NULL;
     }
 
-  if (priv->highlight_table)
+  if (priv->hover_tick)
     {
-      g_hash_table_destroy (priv->highlight_table);
-      priv->highlight_table = NULL;
+      gtk_widget_remove_tick_callback (GTK_WIDGET (object), priv->hover_tick);
+      priv->hover_tick = 0;
+    }
+
+  if (priv->hover_highlight)
+    {
+      cairo_pattern_destroy (priv->hover_highlight);
+      priv->hover_highlight = NULL;
+    }
+
+  if (priv->offset_index)
+    {
+      g_free (priv->offset_index);
+      priv->offset_index = NULL;
     }
 
   if (priv->alias_db)
@@ -197,6 +367,31 @@ cc_timezone_map_finalize (GObject *object)
       priv->tzdb = NULL;
     }
 
+  if (priv->geometry)
+    {
+      tz_geometry_free (priv->geometry);
+      priv->geometry = NULL;
+    }
+
+  if (priv->offset_palette)
+    {
+      g_array_free (priv->offset_palette, TRUE);
+      priv->offset_palette = NULL;
+    }
+
+  g_free (priv->location_offset_ids);
+  priv->location_offset_ids = NULL;
+
+  g_free (priv->location_points);
+  priv->location_points = NULL;
+
+  g_free (priv->location_grid_start);
+  priv->location_grid_start = NULL;
+  g_free (priv->location_grid_items);
+  priv->location_grid_items = NULL;
+
+  g_free (priv->raster_digest);
+  priv->raster_digest = NULL;
 
   G_OBJECT_CLASS (cc_timezone_map_parent_class)->finalize (object);
 }
@@ -228,46 +423,443 @@ cc_timezone_map_get_preferred_height (GtkWidget *widget,
     *natural = 173;
 }
 
-/* Update the cached map patterns when the widget allocation changes */
+/* Convert a position on the map, from 0 to 1 across it, to widget
+ * coordinates in the zoomed view, and back */
 static void
-cc_timezone_map_size_allocate (GtkWidget *widget,
-                               GtkAllocation *allocation)
+map_to_widget (CcTimezoneMapPrivate *priv,
+               const GtkAllocation  *alloc,
+               gdouble               map_x,
+               gdouble               map_y,
+               gdouble              *x,
+               gdouble              *y)
 {
-  CcTimezoneMapPrivate *priv = CC_TIMEZONE_MAP (widget)->priv;
-  RsvgDimensionData svg_dimensions;
-  gdouble scale_x, scale_y;
+  *x = (map_x - priv->view_x) * priv->zoom * alloc->width;
+  *y = (map_y - priv->view_y) * priv->zoom * alloc->height;
+}
+
+static void
+widget_to_map (CcTimezoneMapPrivate *priv,
+               const GtkAllocation  *alloc,
+               gdouble               x,
+               gdouble               y,
+               gdouble              *map_x,
+               gdouble              *map_y)
+{
+  *map_x = priv->view_x + x / (priv->zoom * MAX (alloc->width, 1));
+  *map_y = priv->view_y + y / (priv->zoom * MAX (alloc->height, 1));
+}
+
+/* Everything the render thread needs, so that it never touches the widget */
+typedef struct
+{
+  const TzGeometry *geometry;
+  gchar *cache_key;
+  gint width;
+  gint height;
+  gint scale;
+  guint n_locations;
+  const gdouble *location_points;
+  const guint8 *location_offset_ids;
+} RenderJob;
+
+typedef struct
+{
+  cairo_surface_t *background;
+  guint8 *offset_index;
+  cairo_rectangle_int_t offset_extents[G_MAXUINT8 + 1];
+} RenderResult;
+
+/* One horizontal slice of the background, rendered straight into the rows of
+ * the shared image */
+typedef struct
+{
+  RenderJob *job;
+  guchar *data;
+  gint stride;
+  gint y;
+  gint height;
+} RenderBand;
+
+static cairo_user_data_key_t raster_cache_file_key;
+
+static void
+render_job_free (RenderJob *job)
+{
+  g_free (job->cache_key);
+  g_free (job);
+}
+
+static void
+render_result_free (RenderResult *result)
+{
+  cairo_surface_destroy (result->background);
+  g_free (result->offset_index);
+  g_free (result);
+}
+
+static gpointer
+render_band (gpointer user_data)
+{
+  RenderBand *band = user_data;
+  RenderJob *job = band->job;
   cairo_surface_t *surface;
   cairo_t *cr;
 
-  GTK_WIDGET_CLASS(cc_timezone_map_parent_class)->size_allocate (widget, allocation);
+  surface = cairo_image_surface_create_for_data (band->data + band->y * band->stride,
+                                                 CAIRO_FORMAT_ARGB32,
+                                                 job->width,
+                                                 band->height,
+                                                 band->stride);
+  cr = cairo_create (surface);
+  cairo_translate (cr, 0, -band->y);
+  tz_render_map (job->geometry, cr, job->width, job->height);
+  cairo_destroy (cr);
+  cairo_surface_destroy (surface);
 
-  /* Figure out the scaling factor between the SVG and the allocation */
-  rsvg_handle_get_dimensions_sub (priv->map_svg, &svg_dimensions, "#background");
-  scale_x = (double)allocation->width / svg_dimensions.width;
-  scale_y = (double)allocation->height / svg_dimensions.height;
+  return NULL;
+}
 
-  /* Create a new cairo context over an image surface the size of the
-   * allocation */
-  surface = cairo_image_surface_create (CAIRO_FORMAT_ARGB32,
-                                        allocation->width,
-                                        allocation->height);
-  cr = cairo_create (surface);
+/* Map a previous render of the same map from the raster cache */
+static RenderResult *
+load_cached_render (RenderJob *job)
+{
+  const RasterCacheHeader *header;
+  RenderResult *result;
+  GMappedFile *file;
+  const gchar *contents;
+  gsize stride, length;
+
+  file = tz_cache_open (RASTER_CACHE_DIR, job->cache_key);
+  if (!file)
+    return NULL;
+
+  contents = g_mapped_file_get_contents (file);
+  length = g_mapped_file_get_length (file);
+  header = (const RasterCacheHeader *) contents;
+  stride = cairo_format_stride_for_width (CAIRO_FORMAT_ARGB32, job->width);
+
+  if (length != sizeof (RasterCacheHeader) + stride * job->height + job->width * job->height ||
+      memcmp (header->magic, RASTER_CACHE_MAGIC, sizeof (header->magic)) != 0 ||
+      header->byte_order != G_BYTE_ORDER ||
+      header->width != job->width ||
+      header->height != job->height ||
+      header->stride != stride ||
+      header->scale != job->scale)
+    {
+      g_mapped_file_unref (file);
+      return NULL;
+    }
+
+  result = g_new0 (RenderResult, 1);
+
+  /* The surface keeps the file mapped for as long as it is used */
+  result->background = cairo_image_surface_create_for_data ((guchar *) contents + sizeof (RasterCacheHeader),
+                                                           CAIRO_FORMAT_ARGB32,
+                                                           job->width,
+                                                           job->height,
+                                                           stride);
+  cairo_surface_set_user_data (result->background, &raster_cache_file_key,
+                               file, (cairo_destroy_func_t) g_mapped_file_unref);
+
+  result->offset_index = g_malloc (job->width * job->height);
+  memcpy (result->offset_index,
+          contents + sizeof (RasterCacheHeader) + stride * job->height,
+          job->width * job->height);
+
+  return result;
+}
+
+static void
+store_cached_render (RenderJob    *job,
+                     RenderResult *result)
+{
+  RasterCacheHeader header = { RASTER_CACHE_MAGIC, };
+  GOutputStream *stream;
+  gsize stride;
+  gboolean ok;
+
+  if (!result->offset_index)
+    return;
+
+  stride = cairo_image_surface_get_stride (result->background);
+
+  /* A render bigger than the whole cache would only push everything else
+   * out, and then itself */
+  if (sizeof (header) + (stride + job->width) * (gsize) job->height > RASTER_CACHE_MAX_SIZE)
+    return;
+
+  stream = tz_cache_create (RASTER_CACHE_DIR, job->cache_key);
+  if (!stream)
+    return;
+
+  header.byte_order = G_BYTE_ORDER;
+  header.width = job->width;
+  header.height = job->height;
+  header.stride = stride;
+  header.scale = job->scale;
+
+  ok = g_output_stream_write_all (stream, &header, sizeof (header), NULL, NULL, NULL) &&
+       g_output_stream_write_all (stream, cairo_image_surface_get_data (result->background),
+                                  stride * job->height, NULL, NULL, NULL) &&
+       g_output_stream_write_all (stream, result->offset_index,
+                                  job->width * job->height, NULL, NULL, NULL);
+
+  if (ok)
+    {
+      g_output_stream_close (stream, NULL, NULL);
+    }
+  else
+    {
+      /* Closing with a cancelled cancellable drops the partial entry instead
+       * of replacing the old one with it */
+      GCancellable *cancellable = g_cancellable_new ();
+
+      g_cancellable_cancel (cancellable);
+      g_output_stream_close (stream, cancellable, NULL);
+      g_object_unref (cancellable);
+    }
+
+  g_object_unref (stream);
 
-  cairo_scale (cr, scale_x, scale_y);
-  rsvg_handle_render_cairo_sub (priv->map_svg, cr, "#background");
+  tz_cache_trim (RASTER_CACHE_DIR, job->cache_key, RASTER_CACHE_MAX_SIZE);
+}
+
+static void
+render_thread (GTask        *task,
+               gpointer      source_object,
+               gpointer      task_data,
+               GCancellable *cancellable)
+{
+  RenderJob *job = task_data;
+  RenderResult *result;
+  cairo_surface_t *surface;
+  RenderBand *bands;
+  GThread **threads;
+  gint i, n_bands;
+
+  /* A newer size may have come in while this was waiting for a thread */
+  if (g_task_return_error_if_cancelled (task))
+    return;
 
+  result = load_cached_render (job);
+  if (result)
+    {
+      tz_render_offset_extents (result->offset_index, job->width, job->height,
+                           result->offset_extents);
+      g_task_return_pointer (task, result, (GDestroyNotify) render_result_free);
+      return;
+    }
+
+  surface = cairo_image_surface_create (CAIRO_FORMAT_ARGB32,
+                                        job->width,
+                                        job->height);
   cairo_surface_flush (surface);
 
+  n_bands = MIN (g_get_num_processors (), RENDER_BANDS_MAX);
+  n_bands = CLAMP (job->height / RENDER_BAND_MIN_HEIGHT, 1, n_bands);
+
+  bands = g_new0 (RenderBand, n_bands);
+  threads = g_new0 (GThread *, n_bands);
+
+  for (i = 0; i < n_bands; i++)
+    {
+      bands[i].job = job;
+      bands[i].data = cairo_image_surface_get_data (surface);
+      bands[i].stride = cairo_image_surface_get_stride (surface);
+      bands[i].y = job->height * i / n_bands;
+      bands[i].height = job->height * (i + 1) / n_bands - bands[i].y;
+    }
+
+  /* Render the first band in this thread, and the others alongside it. If a
+   * thread can't be started its band is rendered here afterwards. */
+  for (i = 1; i < n_bands; i++)
+    threads[i] = g_thread_try_new ("map-render", render_band, &bands[i], NULL);
+
+  render_band (&bands[0]);
+
+  for (i = 1; i < n_bands; i++)
+    {
+      if (threads[i])
+        g_thread_join (threads[i]);
+      else
+        render_band (&bands[i]);
+    }
+
+  g_free (threads);
+  g_free (bands);
+
+  cairo_surface_mark_dirty (surface);
+
+  if (g_task_return_error_if_cancelled (task))
+    {
+      cairo_surface_destroy (surface);
+      return;
+    }
+
+  result = g_new0 (RenderResult, 1);
+  result->background = surface;
+  result->offset_index = tz_render_offset_index (job->n_locations,
+                                                 job->location_points,
+                                                 job->location_offset_ids,
+                                                 surface);
+  tz_render_offset_extents (result->offset_index, job->width, job->height,
+                       result->offset_extents);
+
+  store_cached_render (job, result);
+
+  g_task_return_pointer (task, result, (GDestroyNotify) render_result_free);
+}
+
+static void
+render_ready (GObject      *source_object,
+              GAsyncResult *res,
+              gpointer      user_data)
+{
+  CcTimezoneMap *map = CC_TIMEZONE_MAP (source_object);
+  CcTimezoneMapPrivate *priv = map->priv;
+  RenderJob *job = g_task_get_task_data (G_TASK (res));
+  RenderResult *result;
+
+  /* The only failure is cancellation, by a newer render or by dispose */
+  result = g_task_propagate_pointer (G_TASK (res), NULL);
+  if (!result)
+    return;
+
+  g_clear_object (&priv->render_cancellable);
+
   if (priv->background)
-    cairo_pattern_destroy (priv->background);
+    {
+      cairo_pattern_destroy (priv->background);
+      priv->background = NULL;
+    }
 
-  priv->background = cairo_pattern_create_for_surface (surface);
+  if (priv->background_image)
+    cairo_surface_destroy (priv->background_image);
 
-  cairo_surface_destroy (surface);
-  cairo_destroy (cr);
+  /* Draw the map in logical pixels, so it is composited 1:1 onto a window
+   * of the same scale */
+  cairo_surface_set_device_scale (result->background, job->scale, job->scale);
+
+  priv->background_image = cairo_surface_reference (result->background);
+  priv->background_width = job->width / job->scale;
+  priv->background_height = job->height / job->scale;
+  priv->background_scale = job->scale;
+
+  g_free (priv->offset_index);
+  priv->offset_index = result->offset_index;
+  priv->offset_index_width = job->width;
+  priv->offset_index_height = job->height;
+  result->offset_index = NULL;
+  memcpy (priv->offset_extents, result->offset_extents,
+          sizeof (priv->offset_extents));
+
+  /* Invalidate the highlights, they are rebuilt on the next draw */
+  if (priv->highlight)
+    {
+      cairo_pattern_destroy (priv->highlight);
+      priv->highlight = NULL;
+    }
+  priv->highlight_id = 0;
+
+  if (priv->hover_highlight)
+    {
+      cairo_pattern_destroy (priv->hover_highlight);
+      priv->hover_highlight = NULL;
+    }
+  priv->hover_highlight_id = 0;
+
+  render_result_free (result);
+
+  gtk_widget_queue_draw (GTK_WIDGET (map));
+}
+
+static gboolean
+start_render (gpointer user_data)
+{
+  CcTimezoneMap *map = CC_TIMEZONE_MAP (user_data);
+  CcTimezoneMapPrivate *priv = map->priv;
+  RenderJob *job;
+  GTask *task;
+
+  priv->render_timeout = 0;
+
+  if (priv->render_cancellable)
+    {
+      g_cancellable_cancel (priv->render_cancellable);
+      g_object_unref (priv->render_cancellable);
+      priv->render_cancellable = NULL;
+    }
+
+  if (!priv->geometry || priv->render_width <= 0 || priv->render_height <= 0)
+    return G_SOURCE_REMOVE;
+
+  job = g_new0 (RenderJob, 1);
+  job->geometry = priv->geometry;
+  /* Render in device pixels */
+  job->scale = priv->render_scale;
+  job->width = priv->render_width * job->scale;
+  job->height = priv->render_height * job->scale;
+  job->cache_key = g_strdup_printf ("%s-%dx%d@%d", priv->raster_digest,
+                                    job->width, job->height, job->scale);
+
+  /* The geometry and database outlive the task, since the task holds a reference on
+   * the map */
+  job->n_locations = priv->tzdb ? tz_get_locations (priv->tzdb)->len : 0;
+  job->location_points = priv->location_points;
+  job->location_offset_ids = priv->location_offset_ids;
+
+  priv->render_cancellable = g_cancellable_new ();
+
+  task = g_task_new (map, priv->render_cancellable, render_ready, NULL);
+  g_task_set_task_data (task, job, (GDestroyNotify) render_job_free);
+  g_task_run_in_thread (task, render_thread);
+  g_object_unref (task);
+
+  return G_SOURCE_REMOVE;
+}
+
+/* Update the cached map patterns when the widget allocation changes */
+static void
+cc_timezone_map_size_allocate (GtkWidget *widget,
+                               GtkAllocation *allocation)
+{
+  CcTimezoneMapPrivate *priv = CC_TIMEZONE_MAP (widget)->priv;
+  gint scale = gtk_widget_get_scale_factor (widget);
+
+  GTK_WIDGET_CLASS(cc_timezone_map_parent_class)->size_allocate (widget, allocation);
+
+  if (allocation->width == priv->render_width &&
+      allocation->height == priv->render_height &&
+      scale == priv->render_scale)
+    return;
+
+  priv->render_width = allocation->width;
+  priv->render_height = allocation->height;
+  priv->render_scale = scale;
+
+  if (priv->render_timeout)
+    g_source_remove (priv->render_timeout);
+
+  /* Render the first map straight away, and wait for resizes to settle */
+  if (!priv->background_image)
+    {
+      priv->render_timeout = 0;
+      start_render (widget);
+    }
+  else
+    {
+      priv->render_timeout = g_timeout_add (RENDER_DELAY_MS, start_render, widget);
+    }
+}
+
+/* Motion is only listened to beyond drags when hover tracking is on */
+static GdkEventMask
+get_hover_events (GtkWidget *widget)
+{
+  if (!CC_TIMEZONE_MAP (widget)->priv->hover_tracking)
+    return 0;
 
-  /* Invalidate the highlight cache and render the current one */
-  g_hash_table_remove_all (priv->highlight_table);
+  return GDK_POINTER_MOTION_MASK | GDK_LEAVE_NOTIFY_MASK;
 }
 
 static void
@@ -289,7 +881,10 @@ cc_timezone_map_realize (GtkWidget *widget)
   attr.x = allocation.x;
   attr.y = allocation.y;
   attr.event_mask = gtk_widget_get_events (widget)
-                                 | GDK_EXPOSURE_MASK | GDK_BUTTON_PRESS_MASK;
+                                 | GDK_EXPOSURE_MASK | GDK_BUTTON_PRESS_MASK
+                                 | GDK_BUTTON_RELEASE_MASK | GDK_BUTTON1_MOTION_MASK
+                                 | GDK_SCROLL_MASK | GDK_SMOOTH_SCROLL_MASK
+                                 | GDK_TOUCH_MASK | get_hover_events (widget);
 
   window = gdk_window_new (gtk_widget_get_parent_window (widget), &attr,
                            GDK_WA_X | GDK_WA_Y);
@@ -304,57 +899,254 @@ G_GNUC_END_IGNORE_DEPRECATIONS
   gtk_widget_set_window (widget, window);
 }
 
+static void
+cc_timezone_map_unrealize (GtkWidget *widget)
+{
+  CcTimezoneMapPrivate *priv = CC_TIMEZONE_MAP (widget)->priv;
+
+  /* The background surface belongs to the window's display */
+  if (priv->background)
+    {
+      cairo_pattern_destroy (priv->background);
+      priv->background = NULL;
+    }
+
+  GTK_WIDGET_CLASS (cc_timezone_map_parent_class)->unrealize (widget);
+}
+
+/* Copy the rendered map into a surface in the window's native format */
+static cairo_pattern_t *
+create_background (GtkWidget *widget)
+{
+  CcTimezoneMapPrivate *priv = CC_TIMEZONE_MAP (widget)->priv;
+  cairo_surface_t *surface;
+  cairo_pattern_t *pattern;
+  cairo_t *cr;
+
+  surface = gdk_window_create_similar_surface (gtk_widget_get_window (widget),
+                                               CAIRO_CONTENT_COLOR_ALPHA,
+                                               priv->background_width,
+                                               priv->background_height);
+
+  /* Backends without a native format give back another image, in which
+   * case the copy would only waste memory */
+  if (cairo_surface_get_type (surface) == CAIRO_SURFACE_TYPE_IMAGE)
+    {
+      cairo_surface_destroy (surface);
+      return cairo_pattern_create_for_surface (priv->background_image);
+    }
+
+  cr = cairo_create (surface);
+  cairo_set_source_surface (cr, priv->background_image, 0, 0);
+  cairo_set_operator (cr, CAIRO_OPERATOR_SOURCE);
+  cairo_paint (cr);
+  cairo_destroy (cr);
+
+  pattern = cairo_pattern_create_for_surface (surface);
+  cairo_surface_destroy (surface);
+
+  return pattern;
+}
+
+/* The pin icon is shared by every map, and converted to a surface once for
+ * each scale factor it is drawn at */
+static GdkPixbuf *pin_pixbuf;
+static GHashTable *pin_surfaces;
+
+static GdkPixbuf *
+get_pin_pixbuf (void)
+{
+  if (!pin_surfaces)
+    {
+      GError *err = NULL;
+      gchar *file;
+
+      pin_surfaces = g_hash_table_new_full (NULL, NULL, NULL,
+                                            (GDestroyNotify) cairo_surface_destroy);
+
+      file = g_strdup_printf ("%s/pin.png", get_datadir ());
+      pin_pixbuf = gdk_pixbuf_new_from_file (file, &err);
+      g_free (file);
+
+      if (!pin_pixbuf)
+        {
+          g_warning ("Could not load pin icon: %s", err->message);
+          g_clear_error (&err);
+        }
+    }
+
+  return pin_pixbuf;
+}
+
+static cairo_surface_t *
+get_pin_surface (gint scale)
+{
+  cairo_surface_t *surface;
+
+  if (!get_pin_pixbuf ())
+    return NULL;
+
+  surface = g_hash_table_lookup (pin_surfaces, GINT_TO_POINTER (scale));
+  if (!surface)
+    {
+      GdkPixbuf *pixbuf;
+
+      /* There is only the one size of icon, so upscale it for HiDPI rather
+       * than leave it to be resampled on every draw */
+      if (scale > 1)
+        pixbuf = gdk_pixbuf_scale_simple (pin_pixbuf,
+                                          gdk_pixbuf_get_width (pin_pixbuf) * scale,
+                                          gdk_pixbuf_get_height (pin_pixbuf) * scale,
+                                          GDK_INTERP_BILINEAR);
+      else
+        pixbuf = g_object_ref (pin_pixbuf);
+
+      surface = gdk_cairo_surface_create_from_pixbuf (pixbuf, scale, NULL);
+      g_object_unref (pixbuf);
+
+      g_hash_table_insert (pin_surfaces, GINT_TO_POINTER (scale), surface);
+    }
+
+  return surface;
+}
+
+/* Where the pin for the current location points to, in widget coordinates */
+static void
+get_pin_point (CcTimezoneMap       *map,
+               const GtkAllocation *alloc,
+               gdouble             *x,
+               gdouble             *y)
+{
+  CcTimezoneMapPrivate *priv = map->priv;
 
-static gdouble
-convert_longtitude_to_x (gdouble longitude, gint map_width)
+  map_to_widget (priv, alloc,
+                 priv->location_point[0],
+                 MIN (priv->location_point[1], 1.0),
+                 x, y);
+}
+
+/* Draw the tiles covering the zoomed view, in the coordinates of the
+ * unzoomed map. Tiles which aren't ready yet leave the stretched background
+ * showing through, and are drawn once they arrive. */
+static void
+draw_tiles (CcTimezoneMap       *map,
+            cairo_t             *cr,
+            const GtkAllocation *alloc,
+            gdouble              alpha)
 {
-  const gdouble xdeg_offset = -6;
-  gdouble x;
+  CcTimezoneMapPrivate *priv = map->priv;
+  gint scale = gtk_widget_get_scale_factor (GTK_WIDGET (map));
+  gint map_width, map_height, x1, y1, x2, y2, x, y;
+  guint level;
 
-  x = (map_width * (180.0 + longitude) / 360.0)
-    + (map_width * xdeg_offset / 180.0);
+  if (!priv->geometry)
+    return;
 
-  /* If x is negative, wrap back to the beginning */
-  if (x < 0)
-      x = (gdouble) map_width + x;
+  if (!priv->tiles)
+    priv->tiles = tz_tile_cache_new (priv->geometry, TILE_CACHE_MAX_SIZE,
+                                     (TzTileReadyFunc) gtk_widget_queue_draw,
+                                     map);
 
-  return x;
+  level = tz_tile_cache_pick_level (priv->tiles,
+                                    alloc->width * priv->zoom * scale);
+  tz_tile_cache_get_level_size (priv->tiles, level, &map_width, &map_height);
+
+  /* The tiles in view */
+  x1 = floor (priv->view_x * map_width / TZ_TILE_SIZE);
+  y1 = floor (priv->view_y * map_height / TZ_TILE_SIZE);
+  x2 = ceil ((priv->view_x + 1.0 / priv->zoom) * map_width / TZ_TILE_SIZE);
+  y2 = ceil ((priv->view_y + 1.0 / priv->zoom) * map_height / TZ_TILE_SIZE);
+
+  x1 = MAX (x1, 0);
+  y1 = MAX (y1, 0);
+  x2 = MIN (x2, (map_width + TZ_TILE_SIZE - 1) / TZ_TILE_SIZE);
+  y2 = MIN (y2, (map_height + TZ_TILE_SIZE - 1) / TZ_TILE_SIZE);
+
+  tz_tile_cache_set_visible (priv->tiles, level, x1, y1, x2, y2);
+
+  cairo_save (cr);
+  cairo_scale (cr,
+               (gdouble) alloc->width / map_width,
+               (gdouble) alloc->height / map_height);
+
+  for (y = y1; y < y2; y++)
+    {
+      for (x = x1; x < x2; x++)
+        {
+          cairo_surface_t *tile = tz_tile_cache_lookup (priv->tiles, level, x, y);
+
+          if (!tile)
+            continue;
+
+          /* Pad the edges, so neighbouring tiles don't fade into each other
+           * when scaled */
+          cairo_save (cr);
+          cairo_rectangle (cr, x * TZ_TILE_SIZE, y * TZ_TILE_SIZE,
+                           TZ_TILE_SIZE, TZ_TILE_SIZE);
+          cairo_clip (cr);
+          cairo_set_source_surface (cr, tile, x * TZ_TILE_SIZE, y * TZ_TILE_SIZE);
+          cairo_pattern_set_extend (cairo_get_source (cr), CAIRO_EXTEND_PAD);
+          cairo_paint_with_alpha (cr, alpha);
+          cairo_restore (cr);
+        }
+    }
+
+  cairo_restore (cr);
 }
 
-static gdouble
-radians (gdouble degrees)
+/* The offset id whose highlight is currently drawn, or 0 for none */
+static guint8
+get_highlight_id (CcTimezoneMapPrivate *priv)
 {
-  return (degrees / 360.0) * G_PI * 2;
+  if (!priv->show_offset || !priv->offset_index)
+    return 0;
+
+  return tz_offsets_find (priv->offset_palette, priv->selected_offset);
 }
 
-static gdouble
-convert_latitude_to_y (gdouble latitude, gdouble map_height)
+/* The offset id whose hover highlight is currently drawn, or 0 for none.
+ * The selected offset is already highlighted, so hovering over it shows
+ * nothing more. */
+static guint8
+get_hover_id (CcTimezoneMapPrivate *priv)
 {
-  gdouble bottom_lat = -59;
-  gdouble top_lat = 81;
-  gdouble top_per, y, full_range, top_offset, map_range;
+  if (!priv->hover_tracking || !priv->offset_index ||
+      priv->hover_id == get_highlight_id (priv))
+    return 0;
 
-  top_per = top_lat / 180.0;
-  y = 1.25 * log (tan (G_PI_4 + 0.4 * radians (latitude)));
-  full_range = 4.6068250867599998;
-  top_offset = full_range * top_per;
-  map_range = fabs (1.25 * log (tan (G_PI_4 + 0.4 * radians (bottom_lat))) - top_offset);
-  y = fabs (y - top_offset);
-  y = y / map_range;
-  y = y * map_height;
-  return y;
+  return priv->hover_id;
 }
 
+/* Return the mask of an offset id, rebuilding *mask if it is of another id */
+static cairo_pattern_t *
+get_offset_mask (CcTimezoneMapPrivate  *priv,
+                 cairo_pattern_t      **mask,
+                 guint8                *mask_id,
+                 guint8                 id)
+{
+  if (*mask && *mask_id == id)
+    return *mask;
+
+  if (*mask)
+    cairo_pattern_destroy (*mask);
+
+  *mask = tz_render_highlight_mask (priv->offset_index,
+                                    priv->offset_index_width,
+                                    priv->offset_index_height,
+                                    priv->background_scale,
+                                    id);
+  *mask_id = id;
+
+  return *mask;
+}
 
 static gboolean
 cc_timezone_map_draw (GtkWidget *widget,
                       cairo_t   *cr)
 {
   CcTimezoneMapPrivate *priv = CC_TIMEZONE_MAP (widget)->priv;
-  gchar *file;
-  GdkPixbuf *pin;
+  cairo_surface_t *pin;
   GtkAllocation alloc;
-  GError *err = NULL;
   gdouble pointx, pointy;
   gdouble alpha = 1.0;
   GtkStyle *style;
@@ -376,50 +1168,92 @@ G_GNUC_BEGIN_IGNORE_DEPRECATIONS
   gdk_cairo_set_source_color (cr, &style->bg[gtk_widget_get_state (widget)]);
 G_GNUC_END_IGNORE_DEPRECATIONS
   cairo_paint (cr);
-  cairo_set_source (cr, priv->background);
-  cairo_paint_with_alpha (cr, alpha);
 
-  /* paint watermark */
-  if (priv->watermark) {
-    cairo_text_extents_t extent;
-    cairo_select_font_face(cr, "Sans", CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_NORMAL);
-    cairo_set_font_size(cr, 12.0);
-    cairo_set_source_rgba(cr, 1, 1, 1, 0.5);
-    cairo_text_extents(cr, priv->watermark, &extent);
-    cairo_move_to(cr, alloc.width - extent.x_advance + extent.x_bearing - 5,
-                      alloc.height - extent.height - extent.y_bearing - 5);
-    cairo_show_text(cr, priv->watermark);
-    cairo_stroke(cr);
-  }
+  if (priv->background_image)
+    {
+      if (!priv->background)
+        priv->background = create_background (widget);
+
+      cairo_save (cr);
+      cairo_scale (cr, priv->zoom, priv->zoom);
+      cairo_translate (cr,
+                       -priv->view_x * alloc.width,
+                       -priv->view_y * alloc.height);
+
+      /* Stretch the map over the allocation, in case it is still being
+       * rendered at the new size */
+      cairo_save (cr);
+      cairo_scale (cr,
+                   (gdouble) alloc.width / priv->background_width,
+                   (gdouble) alloc.height / priv->background_height);
+
+      cairo_set_source (cr, priv->background);
+      cairo_paint_with_alpha (cr, alpha);
+      cairo_restore (cr);
 
-  if (!priv->location) {
-    return TRUE;
-  }
+      if (priv->zoom > 1.0)
+        draw_tiles (CC_TIMEZONE_MAP (widget), cr, &alloc, alpha);
 
-  /* load pin icon */
-  file = g_strdup_printf ("%s/pin.png", get_datadir ());
-  pin = gdk_pixbuf_new_from_file (file, &err);
-  g_free (file);
+      cairo_scale (cr,
+                   (gdouble) alloc.width / priv->background_width,
+                   (gdouble) alloc.height / priv->background_height);
 
-  if (err)
+      /* paint highlight */
+      if (get_highlight_id (priv) != 0)
+        {
+          cairo_pattern_t *mask = get_offset_mask (priv, &priv->highlight,
+                                                   &priv->highlight_id,
+                                                   get_highlight_id (priv));
+
+          tz_render_highlight (cr, mask, alpha);
+        }
+
+      /* paint hover */
+      if (get_hover_id (priv) != 0)
+        {
+          cairo_pattern_t *mask = get_offset_mask (priv, &priv->hover_highlight,
+                                                   &priv->hover_highlight_id,
+                                                   get_hover_id (priv));
+
+          tz_render_hover (cr, mask, alpha);
+        }
+
+      cairo_restore (cr);
+    }
+
+  /* mark the location under the pointer */
+  if (priv->hover_tracking && priv->hover_location >= 0)
     {
-      g_warning ("Could not load pin icon: %s", err->message);
-      g_clear_error (&err);
+      map_to_widget (priv, &alloc,
+                     priv->location_points[priv->hover_location * 2],
+                     priv->location_points[priv->hover_location * 2 + 1],
+                     &pointx, &pointy);
+
+      cairo_arc (cr, pointx, pointy, HOVER_MARKER_RADIUS, 0, 2 * G_PI);
+      cairo_set_source_rgba (cr, 1, 1, 1, alpha);
+      cairo_fill_preserve (cr);
+      cairo_set_line_width (cr, 1.0);
+      cairo_set_source_rgba (cr, 0, 0, 0, 0.6 * alpha);
+      cairo_stroke (cr);
     }
 
-  pointx = convert_longtitude_to_x (
-          cc_timezone_location_get_longitude(priv->location), alloc.width);
-  pointy = convert_latitude_to_y (
-          cc_timezone_location_get_latitude(priv->location), alloc.height);
+  /* paint watermark */
+  if (priv->watermark)
+    tz_render_watermark (cr, priv->watermark, alloc.width, alloc.height);
+
+  if (!priv->location) {
+    return TRUE;
+  }
 
-  if (pointy > alloc.height)
-    pointy = alloc.height;
+  get_pin_point (CC_TIMEZONE_MAP (widget), &alloc, &pointx, &pointy);
 
+  pin = get_pin_surface (gtk_widget_get_scale_factor (widget));
   if (pin)
     {
-      gdk_cairo_set_source_pixbuf (cr, pin, pointx - 8, pointy - 14);
+      cairo_set_source_surface (cr, pin,
+                                pointx - TZ_PIN_POINT_X,
+                                pointy - TZ_PIN_POINT_Y);
       cairo_paint_with_alpha (cr, alpha);
-      g_object_unref (pin);
     }
 
   return TRUE;
@@ -433,6 +1267,7 @@ cc_timezone_map_class_init (CcTimezoneMapClass *klass)
 
   g_type_class_add_private (klass, sizeof (CcTimezoneMapPrivate));
 
+
   object_class->get_property = cc_timezone_map_get_property;
   object_class->set_property = cc_timezone_map_set_property;
   object_class->dispose = cc_timezone_map_dispose;
@@ -442,6 +1277,7 @@ cc_timezone_map_class_init (CcTimezoneMapClass *klass)
   widget_class->get_preferred_height = cc_timezone_map_get_preferred_height;
   widget_class->size_allocate = cc_timezone_map_size_allocate;
   widget_class->realize = cc_timezone_map_realize;
+  widget_class->unrealize = cc_timezone_map_unrealize;
   widget_class->draw = cc_timezone_map_draw;
 
   g_object_class_install_property(G_OBJECT_CLASS(klass),
@@ -452,6 +1288,14 @@ cc_timezone_map_class_init (CcTimezoneMapClass *klass)
                                       "",
                                       G_PARAM_READWRITE));
 
+  g_object_class_install_property (G_OBJECT_CLASS (klass),
+                                   PROP_HOVER_TRACKING,
+                                   g_param_spec_boolean ("hover-tracking",
+                                                         "Hover tracking",
+                                                         "Whether to show the offset and location under the pointer",
+                                                         FALSE,
+                                                         G_PARAM_READWRITE));
+
   signals[LOCATION_CHANGED] = g_signal_new ("location-changed",
                                             CC_TYPE_TIMEZONE_MAP,
                                             G_SIGNAL_RUN_FIRST,
@@ -474,165 +1318,566 @@ sort_locations (CcTimezoneLocation *a,
   if (dist_a > dist_b)
     return 1;
 
-  if (dist_a < dist_b)
-    return -1;
+  if (dist_a < dist_b)
+    return -1;
+
+  return 0;
+}
+
+/* Invalidate the area covered by the highlight of an offset id */
+static void
+queue_draw_offset (CcTimezoneMap *map, guint8 id)
+{
+  CcTimezoneMapPrivate *priv = map->priv;
+  const cairo_rectangle_int_t *extents = &priv->offset_extents[id];
+  GtkAllocation alloc;
+  gdouble fx1, fy1, fx2, fy2;
+  gint x1, y1, x2, y2;
+
+  if (id == 0 || extents->width == 0)
+    return;
+
+  /* The index may be at a different size than the allocation, in which case
+   * it is stretched to fit when drawn */
+  gtk_widget_get_allocation (GTK_WIDGET (map), &alloc);
+  map_to_widget (priv, &alloc,
+                 (gdouble) extents->x / priv->offset_index_width,
+                 (gdouble) extents->y / priv->offset_index_height,
+                 &fx1, &fy1);
+  map_to_widget (priv, &alloc,
+                 (gdouble) (extents->x + extents->width) / priv->offset_index_width,
+                 (gdouble) (extents->y + extents->height) / priv->offset_index_height,
+                 &fx2, &fy2);
+
+  x1 = floor (fx1) - 1;
+  y1 = floor (fy1) - 1;
+  x2 = ceil (fx2) + 1;
+  y2 = ceil (fy2) + 1;
+
+  gtk_widget_queue_draw_area (GTK_WIDGET (map), x1, y1, x2 - x1, y2 - y1);
+}
+
+/* Invalidate the area covered by the pin */
+static void
+queue_draw_pin (CcTimezoneMap *map)
+{
+  CcTimezoneMapPrivate *priv = map->priv;
+  GtkAllocation alloc;
+  GdkPixbuf *pin;
+  gdouble pointx, pointy;
+
+  if (!priv->location)
+    return;
+
+  pin = get_pin_pixbuf ();
+  if (!pin)
+    return;
+
+  gtk_widget_get_allocation (GTK_WIDGET (map), &alloc);
+  get_pin_point (map, &alloc, &pointx, &pointy);
+
+  gtk_widget_queue_draw_area (GTK_WIDGET (map),
+                              floor (pointx - TZ_PIN_POINT_X) - 1,
+                              floor (pointy - TZ_PIN_POINT_Y) - 1,
+                              gdk_pixbuf_get_width (pin) + 2,
+                              gdk_pixbuf_get_height (pin) + 2);
+}
+
+/* Invalidate the area covered by the watermark text */
+static void
+queue_draw_watermark (CcTimezoneMap *map)
+{
+  CcTimezoneMapPrivate *priv = map->priv;
+  cairo_rectangle_t extents;
+  GtkAllocation alloc;
+
+  if (!priv->watermark)
+    return;
+
+  gtk_widget_get_allocation (GTK_WIDGET (map), &alloc);
+  tz_render_watermark_extents (priv->watermark, alloc.width, alloc.height,
+                               &extents);
+
+  gtk_widget_queue_draw_area (GTK_WIDGET (map),
+                              floor (extents.x) - 1,
+                              floor (extents.y) - 1,
+                              ceil (extents.width) + 3,
+                              ceil (extents.height) + 3);
+}
+
+static void
+set_location (CcTimezoneMap *map,
+              CcTimezoneLocation    *location)
+{
+  CcTimezoneMapPrivate *priv = map->priv;
+  guint8 old_id = get_highlight_id (priv);
+
+  queue_draw_pin (map);
+
+  priv->location = location;
+
+  if (priv->location)
+  {
+    priv->location_point[0] =
+        tz_project_longitude (cc_timezone_location_get_longitude (location));
+    priv->location_point[1] =
+        tz_project_latitude (cc_timezone_location_get_latitude (location));
+
+    priv->selected_offset = tz_location_get_offset (priv->location);
+    priv->show_offset = TRUE;
+    setenv("TZ", cc_timezone_location_get_zone(location), 1);
+  }
+  else
+  {
+    priv->show_offset = FALSE;
+    priv->selected_offset = 0.0;
+    unsetenv("TZ");
+  }
+
+  queue_draw_pin (map);
+
+  if (get_highlight_id (priv) != old_id)
+    {
+      queue_draw_offset (map, old_id);
+      queue_draw_offset (map, get_highlight_id (priv));
+    }
+
+  g_signal_emit (map, signals[LOCATION_CHANGED], 0, priv->location);
+
+}
+
+static CcTimezoneLocation *
+get_loc_for_xy (GtkWidget * widget, gint x, gint y)
+{
+  CcTimezoneMapPrivate *priv = CC_TIMEZONE_MAP (widget)->priv;
+  gint i;
+
+  const GPtrArray *array;
+  GtkAllocation alloc;
+  CcTimezoneLocation* location;
+
+  if ((x - priv->previous_x < 5 && x - priv->previous_x > -5) &&
+      (y - priv->previous_y < 5 && y - priv->previous_y > -5)) {
+    x = priv->previous_x;
+    y = priv->previous_y;
+  }
+
+  /* work out the co-ordinates */
+
+  array = tz_get_locations (priv->tzdb);
+
+  gtk_widget_get_allocation (widget, &alloc);
+
+  if (x == priv->previous_x && y == priv->previous_y) 
+    {
+      priv->distances = g_list_next (priv->distances);
+      if (!priv->distances)
+          priv->distances = priv->distances_head;
+
+      location = (CcTimezoneLocation*) priv->distances->data;
+    } else {
+      GList *node;
+
+      g_list_free (priv->distances_head);
+      priv->distances_head = NULL;
+      for (i = 0; i < array->len; i++)
+        {
+          gdouble pointx, pointy, dx, dy;
+          CcTimezoneLocation *loc = array->pdata[i];
+
+          map_to_widget (priv, &alloc,
+                         priv->location_points[i * 2],
+                         priv->location_points[i * 2 + 1],
+                         &pointx, &pointy);
+
+          dx = pointx - x;
+          dy = pointy - y;
+
+          cc_timezone_location_set_dist(loc, (gdouble) dx * dx + dy * dy);
+          priv->distances_head = g_list_prepend (priv->distances_head, loc);
+        }
+      priv->distances_head = g_list_sort (priv->distances_head, (GCompareFunc) sort_locations);
+
+      /* Remove locations from the list with a distance of greater than 50px,
+       * so that repeated clicks cycle through a smaller area instead of
+       * jumping all over the map. Start with the second element to ensure
+       * that at least one element stays in the list.
+       */
+      node = priv->distances_head->next;
+      while (node != NULL)
+        {
+          if (cc_timezone_location_get_dist(node->data) > (50 * 50))
+            {
+              /* Cut the list off here */
+              node->prev->next = NULL;
+              g_list_free(node);
+              break;
+            }
+
+          node = g_list_next(node);
+        }
+
+      priv->distances = priv->distances_head;
+      location = (CcTimezoneLocation*) priv->distances->data;
+      priv->previous_x = x;
+      priv->previous_y = y;
+    }
+
+    return location;
+}
+
+/* Invalidate the marker of a location shown on hover */
+static void
+queue_draw_hover_marker (CcTimezoneMap *map, gint location)
+{
+  CcTimezoneMapPrivate *priv = map->priv;
+  GtkAllocation alloc;
+  gdouble x, y;
+
+  if (location < 0)
+    return;
+
+  gtk_widget_get_allocation (GTK_WIDGET (map), &alloc);
+  map_to_widget (priv, &alloc,
+                 priv->location_points[location * 2],
+                 priv->location_points[location * 2 + 1],
+                 &x, &y);
+
+  gtk_widget_queue_draw_area (GTK_WIDGET (map),
+                              floor (x - HOVER_MARKER_RADIUS) - 2,
+                              floor (y - HOVER_MARKER_RADIUS) - 2,
+                              2 * HOVER_MARKER_RADIUS + 5,
+                              2 * HOVER_MARKER_RADIUS + 5);
+}
+
+/* Find the location nearest to a point on the map, within HOVER_RADIUS
+ * widget pixels, looking only at the grid cells that can hold it. Returns
+ * the index of the location or -1. */
+static gint
+find_hover_location (CcTimezoneMapPrivate *priv,
+                     const GtkAllocation  *alloc,
+                     gdouble               map_x,
+                     gdouble               map_y)
+{
+  gdouble scale_x = priv->zoom * MAX (alloc->width, 1);
+  gdouble scale_y = priv->zoom * MAX (alloc->height, 1);
+  gdouble best = HOVER_RADIUS * HOVER_RADIUS;
+  gint column1, column2, row1, row2, column, row;
+  gint nearest = -1;
+
+  if (!priv->location_grid_start)
+    return -1;
+
+  column1 = floor ((map_x - HOVER_RADIUS / scale_x) * LOCATION_GRID_COLUMNS);
+  column2 = floor ((map_x + HOVER_RADIUS / scale_x) * LOCATION_GRID_COLUMNS);
+  row1 = floor ((map_y - HOVER_RADIUS / scale_y) * LOCATION_GRID_ROWS);
+  row2 = floor ((map_y + HOVER_RADIUS / scale_y) * LOCATION_GRID_ROWS);
+
+  column1 = MAX (column1, 0);
+  column2 = MIN (column2, LOCATION_GRID_COLUMNS - 1);
+  row1 = MAX (row1, 0);
+  row2 = MIN (row2, LOCATION_GRID_ROWS - 1);
+
+  for (row = row1; row <= row2; row++)
+    {
+      for (column = column1; column <= column2; column++)
+        {
+          guint cell = row * LOCATION_GRID_COLUMNS + column;
+          guint i;
+
+          for (i = priv->location_grid_start[cell];
+               i < priv->location_grid_start[cell + 1];
+               i++)
+            {
+              guint location = priv->location_grid_items[i];
+              gdouble dx = (priv->location_points[location * 2] - map_x) * scale_x;
+              gdouble dy = (priv->location_points[location * 2 + 1] - map_y) * scale_y;
+
+              if (dx * dx + dy * dy < best)
+                {
+                  best = dx * dx + dy * dy;
+                  nearest = location;
+                }
+            }
+        }
+    }
+
+  return nearest;
+}
+
+/* Look up what is under the pointer, and redraw what changed */
+static void
+update_hover (CcTimezoneMap *map)
+{
+  CcTimezoneMapPrivate *priv = map->priv;
+  guint8 old_id = get_hover_id (priv);
+  gint location = -1;
+  guint8 id = 0;
+
+  if (priv->hover_tracking && priv->hover_inside && priv->offset_index)
+    {
+      GtkAllocation alloc;
+      gdouble map_x, map_y;
+      gint x, y;
+
+      gtk_widget_get_allocation (GTK_WIDGET (map), &alloc);
+      widget_to_map (priv, &alloc, priv->hover_x, priv->hover_y, &map_x, &map_y);
+
+      x = floor (map_x * priv->offset_index_width);
+      y = floor (map_y * priv->offset_index_height);
+      if (x >= 0 && x < priv->offset_index_width &&
+          y >= 0 && y < priv->offset_index_height)
+        id = priv->offset_index[y * priv->offset_index_width + x];
+
+      location = find_hover_location (priv, &alloc, map_x, map_y);
+    }
+
+  priv->hover_id = id;
+  if (get_hover_id (priv) != old_id)
+    {
+      queue_draw_offset (map, old_id);
+      queue_draw_offset (map, get_hover_id (priv));
+    }
+
+  if (location != priv->hover_location)
+    {
+      queue_draw_hover_marker (map, priv->hover_location);
+      priv->hover_location = location;
+      queue_draw_hover_marker (map, priv->hover_location);
+
+      if (location >= 0)
+        {
+          CcTimezoneLocation *loc = tz_get_locations (priv->tzdb)->pdata[location];
+
+          gtk_widget_set_tooltip_text (GTK_WIDGET (map),
+                                       cc_timezone_location_get_en_name (loc));
+        }
+      else
+        {
+          gtk_widget_set_tooltip_text (GTK_WIDGET (map), NULL);
+        }
+    }
+}
+
+static gboolean
+hover_tick (GtkWidget     *widget,
+            GdkFrameClock *frame_clock,
+            gpointer       user_data)
+{
+  CcTimezoneMap *map = CC_TIMEZONE_MAP (widget);
+
+  map->priv->hover_tick = 0;
+  update_hover (map);
+
+  return G_SOURCE_REMOVE;
+}
+
+/* Note where the pointer is, and look it up on the next frame. However many
+ * motion events come in before then, only the last one is looked up. */
+static void
+queue_hover (CcTimezoneMap *map)
+{
+  CcTimezoneMapPrivate *priv = map->priv;
+
+  if (!priv->hover_tracking || priv->hover_tick)
+    return;
 
-  return 0;
+  priv->hover_tick = gtk_widget_add_tick_callback (GTK_WIDGET (map), hover_tick,
+                                                   NULL, NULL);
 }
 
-/* Return the UTC offset (in hours) for the standard (winter) time at a location */
-static gdouble
-get_location_offset (CcTimezoneLocation *location)
+/* Change the zoomed view, keeping it within the map */
+static void
+set_view (CcTimezoneMap *map,
+          gdouble        zoom,
+          gdouble        view_x,
+          gdouble        view_y)
 {
-  const gchar *zone_name;
-  GTimeZone *zone;
-  gint interval;
-  gint64 curtime;
-  gint32 offset;
+  CcTimezoneMapPrivate *priv = map->priv;
 
-  g_return_val_if_fail (location != NULL, 0);
-  zone_name = cc_timezone_location_get_zone (location);
-  g_return_val_if_fail (zone_name != NULL, 0);
+  zoom = CLAMP (zoom, 1.0, ZOOM_MAX);
+  view_x = CLAMP (view_x, 0.0, 1.0 - 1.0 / zoom);
+  view_y = CLAMP (view_y, 0.0, 1.0 - 1.0 / zoom);
 
-  zone = g_time_zone_new (zone_name);
+  if (zoom == priv->zoom && view_x == priv->view_x && view_y == priv->view_y)
+    return;
 
-  /* Query the zone based on the current time, since otherwise the data
-   * may not make sense. */
-  curtime = g_get_real_time () / 1000000;    /* convert to seconds */
-  interval = g_time_zone_find_interval (zone, G_TIME_TYPE_UNIVERSAL, curtime);
+  priv->zoom = zoom;
+  priv->view_x = view_x;
+  priv->view_y = view_y;
 
-  offset = g_time_zone_get_offset (zone, interval);
-  if (g_time_zone_is_dst (zone, interval))
-    {
-      /* Subtract an hour's worth of seconds to get the standard time offset */
-      offset -= (60 * 60);
-    }
+  /* Clicks in the same place no longer cycle through the same locations */
+  priv->previous_x = -1;
+  priv->previous_y = -1;
 
-  g_time_zone_unref (zone);
+  /* Something else is under the pointer now */
+  if (priv->hover_inside)
+    queue_hover (map);
 
-  return offset / (60.0 * 60.0);
+  gtk_widget_queue_draw (GTK_WIDGET (map));
 }
 
+/* Zoom, keeping the point of the map under x, y in place */
 static void
-set_location (CcTimezoneMap *map,
-              CcTimezoneLocation    *location)
+zoom_at (CcTimezoneMap *map,
+         gdouble        zoom,
+         gdouble        x,
+         gdouble        y)
 {
-  CcTimezoneMapPrivate *priv = map->priv;
+  GtkAllocation alloc;
+  gdouble map_x, map_y;
 
-  priv->location = location;
+  gtk_widget_get_allocation (GTK_WIDGET (map), &alloc);
+  widget_to_map (map->priv, &alloc, x, y, &map_x, &map_y);
 
-  if (priv->location)
-  {
-    priv->selected_offset = get_location_offset (priv->location);
-    priv->show_offset = TRUE;
-    setenv("TZ", cc_timezone_location_get_zone(location), 1);
-  }
-  else
-  {
-    priv->show_offset = FALSE;
-    priv->selected_offset = 0.0;
-    unsetenv("TZ");
-  }
+  zoom = CLAMP (zoom, 1.0, ZOOM_MAX);
+  set_view (map, zoom,
+            map_x - x / (zoom * MAX (alloc.width, 1)),
+            map_y - y / (zoom * MAX (alloc.height, 1)));
+}
 
-  gtk_widget_queue_draw (GTK_WIDGET (map));
+/* Locations are picked on release, so that a press can also start a drag to
+ * pan the zoomed map */
+static gboolean
+button_press_event (GtkWidget      *widget,
+                    GdkEventButton *event)
+{
+  CcTimezoneMapPrivate *priv = CC_TIMEZONE_MAP (widget)->priv;
 
+  if (event->type != GDK_BUTTON_PRESS)
+    return TRUE;
 
-  g_signal_emit (map, signals[LOCATION_CHANGED], 0, priv->location);
+  priv->button_down = TRUE;
+  priv->dragging = FALSE;
+  priv->press_x = event->x;
+  priv->press_y = event->y;
+  priv->press_view_x = priv->view_x;
+  priv->press_view_y = priv->view_y;
 
+  return TRUE;
 }
 
-static CcTimezoneLocation *
-get_loc_for_xy (GtkWidget * widget, gint x, gint y)
+static gboolean
+motion_notify_event (GtkWidget      *widget,
+                     GdkEventMotion *event)
 {
-  CcTimezoneMapPrivate *priv = CC_TIMEZONE_MAP (widget)->priv;
-  gint i;
-
-  const GPtrArray *array;
-  gint width, height;
+  CcTimezoneMap *map = CC_TIMEZONE_MAP (widget);
+  CcTimezoneMapPrivate *priv = map->priv;
   GtkAllocation alloc;
-  CcTimezoneLocation* location;
 
-  if ((x - priv->previous_x < 5 && x - priv->previous_x > -5) &&
-      (y - priv->previous_y < 5 && y - priv->previous_y > -5)) {
-    x = priv->previous_x;
-    y = priv->previous_y;
-  }
-
-  gtk_widget_queue_draw (widget);
+  if (!priv->button_down)
+    {
+      priv->hover_inside = TRUE;
+      priv->hover_x = event->x;
+      priv->hover_y = event->y;
+      queue_hover (map);
+      return FALSE;
+    }
 
-  /* work out the co-ordinates */
+  if (!priv->dragging)
+    {
+      if (priv->zoom <= 1.0 ||
+          !gtk_drag_check_threshold (widget, priv->press_x, priv->press_y,
+                                     event->x, event->y))
+        return TRUE;
 
-  array = tz_get_locations (priv->tzdb);
+      priv->dragging = TRUE;
+    }
 
   gtk_widget_get_allocation (widget, &alloc);
-  width = alloc.width;
-  height = alloc.height;
+  set_view (map, priv->zoom,
+            priv->press_view_x - (event->x - priv->press_x) / (priv->zoom * alloc.width),
+            priv->press_view_y - (event->y - priv->press_y) / (priv->zoom * alloc.height));
 
-  if (x == priv->previous_x && y == priv->previous_y) 
-    {
-      priv->distances = g_list_next (priv->distances);
-      if (!priv->distances)
-          priv->distances = priv->distances_head;
+  return TRUE;
+}
 
-      location = (CcTimezoneLocation*) priv->distances->data;
-    } else {
-      GList *node;
+static gboolean
+leave_notify_event (GtkWidget        *widget,
+                    GdkEventCrossing *event)
+{
+  CcTimezoneMap *map = CC_TIMEZONE_MAP (widget);
 
-      g_list_free (priv->distances_head);
-      priv->distances_head = NULL;
-      for (i = 0; i < array->len; i++)
-        {
-          gdouble pointx, pointy, dx, dy;
-          CcTimezoneLocation *loc = array->pdata[i];
+  /* Grabs moving the pointer to another window don't mean it has left */
+  if (event->mode != GDK_CROSSING_NORMAL)
+    return FALSE;
 
-          pointx = convert_longtitude_to_x (cc_timezone_location_get_longitude(loc), width);
-          pointy = convert_latitude_to_y (cc_timezone_location_get_latitude(loc), height);
+  map->priv->hover_inside = FALSE;
+  update_hover (map);
 
-          dx = pointx - x;
-          dy = pointy - y;
+  return FALSE;
+}
 
-          cc_timezone_location_set_dist(loc, (gdouble) dx * dx + dy * dy);
-          priv->distances_head = g_list_prepend (priv->distances_head, loc);
-        }
-      priv->distances_head = g_list_sort (priv->distances_head, (GCompareFunc) sort_locations);
+static gboolean
+button_release_event (GtkWidget      *widget,
+                      GdkEventButton *event)
+{
+  CcTimezoneMapPrivate *priv = CC_TIMEZONE_MAP (widget)->priv;
+  CcTimezoneLocation *loc;
 
-      /* Remove locations from the list with a distance of greater than 50px,
-       * so that repeated clicks cycle through a smaller area instead of
-       * jumping all over the map. Start with the second element to ensure
-       * that at least one element stays in the list.
-       */
-      node = priv->distances_head->next;
-      while (node != NULL)
-        {
-          if (cc_timezone_location_get_dist(node->data) > (50 * 50))
-            {
-              /* Cut the list off here */
-              node->prev->next = NULL;
-              g_list_free(node);
-              break;
-            }
+  if (!priv->button_down)
+    return FALSE;
 
-          node = g_list_next(node);
-        }
+  priv->button_down = FALSE;
 
-      priv->distances = priv->distances_head;
-      location = (CcTimezoneLocation*) priv->distances->data;
-      priv->previous_x = x;
-      priv->previous_y = y;
-    }
+  if (priv->dragging)
+    return TRUE;
 
-    return location;
+  loc = get_loc_for_xy (widget, priv->press_x, priv->press_y);
+  set_location (CC_TIMEZONE_MAP (widget), loc);
+  return TRUE;
 }
 
 static gboolean
-button_press_event (GtkWidget      *widget,
-                    GdkEventButton *event)
+scroll_event (GtkWidget      *widget,
+              GdkEventScroll *event)
 {
-  CcTimezoneLocation * loc = get_loc_for_xy (widget, event->x, event->y);
-  set_location (CC_TIMEZONE_MAP (widget), loc);
+  CcTimezoneMap *map = CC_TIMEZONE_MAP (widget);
+  gdouble dx, dy, factor;
+
+  switch (event->direction)
+    {
+    case GDK_SCROLL_UP:
+      factor = ZOOM_STEP;
+      break;
+    case GDK_SCROLL_DOWN:
+      factor = 1.0 / ZOOM_STEP;
+      break;
+    case GDK_SCROLL_SMOOTH:
+      gdk_event_get_scroll_deltas ((GdkEvent *) event, &dx, &dy);
+      factor = pow (ZOOM_STEP, -dy);
+      break;
+    default:
+      return FALSE;
+    }
+
+  zoom_at (map, map->priv->zoom * factor, event->x, event->y);
   return TRUE;
 }
 
+static void
+zoom_gesture_begin (GtkGesture       *gesture,
+                    GdkEventSequence *sequence,
+                    CcTimezoneMap    *map)
+{
+  /* A pinch is not a click */
+  map->priv->button_down = FALSE;
+  map->priv->gesture_zoom = map->priv->zoom;
+}
+
+static void
+zoom_gesture_scale_changed (GtkGestureZoom *gesture,
+                            gdouble         scale,
+                            CcTimezoneMap  *map)
+{
+  gdouble x, y;
+
+  if (!gtk_gesture_get_bounding_box_center (GTK_GESTURE (gesture), &x, &y))
+    return;
+
+  zoom_at (map, map->priv->gesture_zoom * scale, x, y);
+}
+
 static void
 state_flags_changed (GtkWidget *widget)
 {
@@ -640,6 +1885,30 @@ state_flags_changed (GtkWidget *widget)
   gtk_widget_queue_draw (widget);
 }
 
+/* Re-render at the new scale when the widget moves to a monitor with a
+ * different scale factor. The old map is stretched until then. */
+static void
+scale_factor_changed (GtkWidget  *widget,
+                      GParamSpec *pspec,
+                      gpointer    user_data)
+{
+  CcTimezoneMapPrivate *priv = CC_TIMEZONE_MAP (widget)->priv;
+  gint scale = gtk_widget_get_scale_factor (widget);
+
+  if (scale == priv->render_scale)
+    return;
+
+  priv->render_scale = scale;
+
+  if (priv->render_timeout)
+    {
+      g_source_remove (priv->render_timeout);
+      priv->render_timeout = 0;
+    }
+
+  start_render (widget);
+}
+
 static void
 load_backward_tz (CcTimezoneMap *self)
 {
@@ -696,6 +1965,98 @@ load_backward_tz (CcTimezoneMap *self)
   g_strfreev (lines);
 }
 
+/* Hash the map geometry and the location data that the offset index is built from */
+static gchar *
+get_raster_digest (CcTimezoneMap *self)
+{
+  CcTimezoneMapPrivate *priv = self->priv;
+  GChecksum *checksum;
+  const gchar *contents;
+  gchar *digest;
+  gsize length;
+
+  checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  contents = tz_geometry_get_contents (priv->geometry, &length);
+  g_checksum_update (checksum, (const guchar *) contents, length);
+  g_checksum_update (checksum,
+                     (const guchar *) priv->offset_palette->data,
+                     priv->offset_palette->len * sizeof (gdouble));
+
+  if (priv->tzdb)
+    {
+      GPtrArray *locations = tz_get_locations (priv->tzdb);
+
+      g_checksum_update (checksum, priv->location_offset_ids, locations->len);
+      g_checksum_update (checksum, (const guchar *) priv->location_points,
+                         locations->len * 2 * sizeof (gdouble));
+    }
+
+  digest = g_strdup (g_checksum_get_string (checksum));
+  g_checksum_free (checksum);
+
+  return digest;
+}
+
+static guint
+get_location_cell (CcTimezoneMapPrivate *priv, guint location)
+{
+  gint column = priv->location_points[location * 2] * LOCATION_GRID_COLUMNS;
+  gint row = priv->location_points[location * 2 + 1] * LOCATION_GRID_ROWS;
+
+  column = CLAMP (column, 0, LOCATION_GRID_COLUMNS - 1);
+  row = CLAMP (row, 0, LOCATION_GRID_ROWS - 1);
+
+  return row * LOCATION_GRID_COLUMNS + column;
+}
+
+/* Bucket the projected locations by grid cell, counting the locations in
+ * each cell first so that every cell is a slice of one array */
+static void
+build_location_grid (CcTimezoneMap *self)
+{
+  CcTimezoneMapPrivate *priv = self->priv;
+  guint n_cells = LOCATION_GRID_COLUMNS * LOCATION_GRID_ROWS;
+  guint n_locations = tz_get_locations (priv->tzdb)->len;
+  guint *fill;
+  guint i;
+
+  priv->location_grid_start = g_new0 (guint, n_cells + 1);
+  priv->location_grid_items = g_new (guint, MAX (n_locations, 1));
+
+  for (i = 0; i < n_locations; i++)
+    priv->location_grid_start[get_location_cell (priv, i) + 1]++;
+
+  for (i = 0; i < n_cells; i++)
+    priv->location_grid_start[i + 1] += priv->location_grid_start[i];
+
+  fill = g_new (guint, n_cells);
+  memcpy (fill, priv->location_grid_start, n_cells * sizeof (guint));
+  for (i = 0; i < n_locations; i++)
+    priv->location_grid_items[fill[get_location_cell (priv, i)]++] = i;
+  g_free (fill);
+}
+
+/* Project the locations and work out their offsets up front, so the
+ * offset index can be rebuilt for each allocation without any trigonometry
+ * or touching the zone files */
+static void
+load_location_offsets (CcTimezoneMap *self)
+{
+  CcTimezoneMapPrivate *priv = self->priv;
+  GPtrArray *locations;
+
+  priv->offset_palette = g_array_new (FALSE, FALSE, sizeof (gdouble));
+
+  if (!priv->tzdb)
+    return;
+
+  locations = tz_get_locations (priv->tzdb);
+  priv->location_offset_ids = tz_offsets_load (locations, priv->offset_palette);
+  priv->location_points = tz_project_locations (locations);
+
+  build_location_grid (self);
+}
+
 static void
 cc_timezone_map_init (CcTimezoneMap *self)
 {
@@ -707,22 +2068,17 @@ cc_timezone_map_init (CcTimezoneMap *self)
 
   priv->previous_x = -1;
   priv->previous_y = -1;
+  priv->hover_location = -1;
 
-  file = g_strdup_printf ("%s/time_zones_countryInfo-orig.svg", get_datadir ());
-  priv->map_svg = rsvg_handle_new_from_file (file, &err);
-  g_free (file);
-
-  if (!priv->map_svg)
+  file = g_strdup_printf ("%s/time_zones_countryInfo.geom", get_datadir ());
+  priv->geometry = tz_geometry_load (file, &err);
+  if (!priv->geometry)
     {
       g_warning("Could not load map data: %s",
                 (err) ? err->message : "Unknown error");
       g_clear_error (&err);
     }
-
-  priv->highlight_table = g_hash_table_new_full (g_double_hash,
-                                                 g_double_equal,
-                                                 g_free,
-                                                 (GDestroyNotify) cairo_pattern_destroy);
+  g_free (file);
 
   priv->selected_offset = 0.0;
   priv->show_offset = FALSE;
@@ -731,10 +2087,31 @@ cc_timezone_map_init (CcTimezoneMap *self)
 
   g_signal_connect (self, "button-press-event", G_CALLBACK (button_press_event),
                     NULL);
+  g_signal_connect (self, "button-release-event", G_CALLBACK (button_release_event),
+                    NULL);
+  g_signal_connect (self, "motion-notify-event", G_CALLBACK (motion_notify_event),
+                    NULL);
+  g_signal_connect (self, "scroll-event", G_CALLBACK (scroll_event),
+                    NULL);
+  g_signal_connect (self, "leave-notify-event", G_CALLBACK (leave_notify_event),
+                    NULL);
+
+  priv->zoom = 1.0;
+  priv->zoom_gesture = gtk_gesture_zoom_new (GTK_WIDGET (self));
+  g_signal_connect (priv->zoom_gesture, "begin",
+                    G_CALLBACK (zoom_gesture_begin), self);
+  g_signal_connect (priv->zoom_gesture, "scale-changed",
+                    G_CALLBACK (zoom_gesture_scale_changed), self);
   g_signal_connect (self, "state-flags-changed", G_CALLBACK (state_flags_changed),
                     NULL);
+  g_signal_connect (self, "notify::scale-factor", G_CALLBACK (scale_factor_changed),
+                    NULL);
 
   load_backward_tz (self);
+  load_location_offsets (self);
+
+  if (priv->geometry)
+    priv->raster_digest = get_raster_digest (self);
 }
 
 CcTimezoneMap *
@@ -806,7 +2183,7 @@ cc_timezone_map_set_timezone (CcTimezoneMap *map,
       gdouble offset;
 
       cc_timezone_location_set_zone (test_location, real_tz);
-      offset = get_location_offset (test_location);
+      offset = tz_location_get_offset (test_location);
       g_object_unref (test_location);
 
       set_location (map, NULL);
@@ -869,9 +2246,10 @@ cc_timezone_map_set_location (CcTimezoneMap *map,
 			      gdouble lat)
 {
   GtkAllocation alloc;
+  gdouble x, y;
   gtk_widget_get_allocation (GTK_WIDGET(map), &alloc);
-  gdouble x = convert_longtitude_to_x(lon, alloc.width);
-  gdouble y = convert_latitude_to_y(lat, alloc.height);
+  map_to_widget (map->priv, &alloc,
+                 tz_project_longitude (lon), tz_project_latitude (lat), &x, &y);
   CcTimezoneLocation * loc = get_loc_for_xy (GTK_WIDGET(map), x, y);
   set_location (map, loc);
 }
@@ -916,11 +2294,13 @@ cc_timezone_map_get_timezone_at_coords (CcTimezoneMap *map, gdouble lon, gdouble
 void
 cc_timezone_map_set_watermark (CcTimezoneMap *map, const gchar * watermark)
 {
+  queue_draw_watermark (map);
+
   if (map->priv->watermark)
     g_free (map->priv->watermark);
 
   map->priv->watermark = g_strdup (watermark);
-  gtk_widget_queue_draw (GTK_WIDGET (map));
+  queue_draw_watermark (map);
 }
 
 /**
@@ -951,6 +2331,49 @@ cc_timezone_map_clear_location (CcTimezoneMap *map)
   set_location(map, NULL);
 }
 
+/**
+ * cc_timezone_map_get_offset_at:
+ * @map: A #CcTimezoneMap
+ * @x: X coordinate within the widget
+ * @y: Y coordinate within the widget
+ * @offset: (out): return location for the offset from GMT in hours
+ *
+ * Look up the standard time offset of the time zone under a point of the map.
+ *
+ * Returns: %TRUE if the point is over land covered by a known offset.
+ */
+gboolean
+cc_timezone_map_get_offset_at (CcTimezoneMap *map, gint x, gint y, gdouble *offset)
+{
+  CcTimezoneMapPrivate *priv = map->priv;
+  GtkAllocation alloc;
+  gdouble map_x, map_y;
+  guint8 id;
+
+  if (!priv->offset_index)
+    return FALSE;
+
+  /* The index covers the whole map, which may be zoomed in on or still at
+   * the size of a previous allocation */
+  gtk_widget_get_allocation (GTK_WIDGET (map), &alloc);
+  widget_to_map (priv, &alloc, x, y, &map_x, &map_y);
+  x = floor (map_x * priv->offset_index_width);
+  y = floor (map_y * priv->offset_index_height);
+
+  if (x < 0 || x >= priv->offset_index_width ||
+      y < 0 || y >= priv->offset_index_height)
+    return FALSE;
+
+  id = priv->offset_index[y * priv->offset_index_width + x];
+  if (id == 0)
+    return FALSE;
+
+  if (offset)
+    *offset = g_array_index (priv->offset_palette, gdouble, id - 1);
+
+  return TRUE;
+}
+
 /**
  * cc_timezone_map_get_selected_offset:
  * @map: A #CcTimezoneMap
@@ -975,8 +2398,109 @@ gdouble cc_timezone_map_get_selected_offset(CcTimezoneMap *map)
  */
 void cc_timezone_map_set_selected_offset (CcTimezoneMap *map, gdouble offset)
 {
+  guint8 old_id = get_highlight_id (map->priv);
+
   map->priv->selected_offset = offset;
   map->priv->show_offset = TRUE;
   g_object_notify(G_OBJECT(map), "selected-offset");
-  gtk_widget_queue_draw (GTK_WIDGET (map));
+
+  if (get_highlight_id (map->priv) != old_id)
+    {
+      queue_draw_offset (map, old_id);
+      queue_draw_offset (map, get_highlight_id (map->priv));
+    }
+}
+
+/**
+ * cc_timezone_map_project:
+ * @map: A #CcTimezoneMap
+ * @longitudes: (array length=n_points): longitudes in degrees
+ * @latitudes: (array length=n_points): latitudes in degrees
+ * @x: (out caller-allocates) (array length=n_points): return location for the
+ *     x coordinates
+ * @y: (out caller-allocates) (array length=n_points): return location for the
+ *     y coordinates
+ * @n_points: the number of points to convert
+ *
+ * Convert points on the globe to widget coordinates at the map's current
+ * size and zoom, using the same projection as the map and its locations.
+ * This is meant for drawing overlays on top of the map.
+ */
+void
+cc_timezone_map_project (CcTimezoneMap *map,
+                         const gdouble *longitudes,
+                         const gdouble *latitudes,
+                         gdouble       *x,
+                         gdouble       *y,
+                         guint          n_points)
+{
+  GtkAllocation alloc;
+  guint i;
+
+  gtk_widget_get_allocation (GTK_WIDGET (map), &alloc);
+
+  for (i = 0; i < n_points; i++)
+    {
+      map_to_widget (map->priv, &alloc,
+                     tz_project_longitude (longitudes[i]),
+                     tz_project_latitude (latitudes[i]),
+                     &x[i], &y[i]);
+    }
+}
+
+/**
+ * cc_timezone_map_set_hover_tracking:
+ * @map: A #CcTimezoneMap
+ * @hover_tracking: whether to track the pointer
+ *
+ * Sets whether the map lightly highlights the offset under the pointer and
+ * marks the nearest location, naming it in the tooltip. This replaces any
+ * tooltip set on the map.
+ */
+void
+cc_timezone_map_set_hover_tracking (CcTimezoneMap *map,
+                                    gboolean       hover_tracking)
+{
+  CcTimezoneMapPrivate *priv = map->priv;
+  GdkWindow *window;
+
+  hover_tracking = !!hover_tracking;
+  if (hover_tracking == priv->hover_tracking)
+    return;
+
+  if (!hover_tracking)
+    {
+      if (priv->hover_tick)
+        {
+          gtk_widget_remove_tick_callback (GTK_WIDGET (map), priv->hover_tick);
+          priv->hover_tick = 0;
+        }
+
+      /* Clear the hover while it can still be seen */
+      priv->hover_inside = FALSE;
+      update_hover (map);
+    }
+
+  priv->hover_tracking = hover_tracking;
+
+  window = gtk_widget_get_window (GTK_WIDGET (map));
+  if (window)
+    {
+      GdkEventMask events = gdk_window_get_events (window);
+
+      if (hover_tracking)
+        events |= get_hover_events (GTK_WIDGET (map));
+      else
+        events &= ~(GDK_POINTER_MOTION_MASK | GDK_LEAVE_NOTIFY_MASK);
+
+      gdk_window_set_events (window, events);
+    }
+
+  g_object_notify (G_OBJECT (map), "hover-tracking");
+}
+
+gboolean
+cc_timezone_map_get_hover_tracking (CcTimezoneMap *map)
+{
+  return map->priv->hover_tracking;
 }
@@ -85,6 +85,17 @@ CcTimezoneLocation * cc_timezone_map_get_location (CcTimezoneMap *map);
 void cc_timezone_map_clear_location (CcTimezoneMap *map);
 gdouble cc_timezone_map_get_selected_offset(CcTimezoneMap *map);
 void cc_timezone_map_set_selected_offset (CcTimezoneMap *map, gdouble offset);
+gboolean cc_timezone_map_get_offset_at (CcTimezoneMap *map, gint x, gint y,
+                                        gdouble *offset);
+void cc_timezone_map_project (CcTimezoneMap *map,
+                              const gdouble *longitudes,
+                              const gdouble *latitudes,
+                              gdouble *x,
+                              gdouble *y,
+                              guint n_points);
+void cc_timezone_map_set_hover_tracking (CcTimezoneMap *map,
+                                         gboolean hover_tracking);
+gboolean cc_timezone_map_get_hover_tracking (CcTimezoneMap *map);
 
 G_END_DECLS
 
@@ -0,0 +1,669 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+#include "cc-timezone-renderer.h"
+#include "tz.h"
+#include "tz-geometry.h"
+#include "tz-png.h"
+#include "tz-render.h"
+#include <math.h>
+
+/* The renderer draws the same map as CcTimezoneMap, with the selected offset
+ * highlighted, a pin for the location and the watermark, onto any cairo
+ * context or into a PNG stream. It needs no display, so map images can be
+ * made on a server.
+ *
+ * The map data is loaded once when the renderer is created. The map and the
+ * offset regions are also kept for the last size rendered, so a batch of
+ * images of the same size made with one renderer only draws the highlight,
+ * pin and watermark of each image. A renderer may only be used from one
+ * thread at a time. */
+
+G_DEFINE_TYPE (CcTimezoneRenderer, cc_timezone_renderer, G_TYPE_OBJECT)
+
+#define TIMEZONE_RENDERER_PRIVATE(o) \
+  (G_TYPE_INSTANCE_GET_PRIVATE ((o), CC_TYPE_TIMEZONE_RENDERER, CcTimezoneRendererPrivate))
+
+/* Large exports are rendered and encoded this many rows at a time, and the
+ * highlight for them is taken from an offset index no larger than this */
+#define EXPORT_BAND_HEIGHT 256
+#define EXPORT_INDEX_MAX_SIZE 4096
+
+struct _CcTimezoneRendererPrivate
+{
+  TzGeometry *geometry;
+  TzDB *tzdb;
+
+  /* The distinct offsets used by the locations, and the palette id and
+   * projected position of each location in the tzdb location array */
+  GArray *offset_palette;
+  guint8 *location_offset_ids;
+  gdouble *location_points;
+
+  cairo_surface_t *pin;
+
+  /* The map and its offset index at the last size rendered */
+  cairo_surface_t *background;
+  guint8 *offset_index;
+  gint width;
+  gint height;
+
+  /* Mask of the selected offset at that size */
+  cairo_pattern_t *highlight;
+  guint8 highlight_id;
+
+  gdouble selected_offset;
+  gboolean show_offset;
+
+  CcTimezoneLocation *location;
+  gdouble location_point[2];
+
+  gchar *watermark;
+};
+
+enum {
+  PROP_0,
+  PROP_SELECTED_OFFSET,
+  PROP_LOCATION,
+  PROP_WATERMARK,
+};
+
+/* Allow datadir to be overridden in the environment */
+static const gchar *
+get_datadir (void)
+{
+  const gchar *datadir = g_getenv("DATADIR");
+
+  if (datadir)
+    return datadir;
+  else
+    return DATADIR;
+}
+
+static void
+cc_timezone_renderer_get_property (GObject    *object,
+                                   guint       property_id,
+                                   GValue     *value,
+                                   GParamSpec *pspec)
+{
+  CcTimezoneRendererPrivate *priv = CC_TIMEZONE_RENDERER (object)->priv;
+  switch (property_id)
+    {
+    case PROP_SELECTED_OFFSET:
+      g_value_set_double (value, priv->selected_offset);
+      break;
+    case PROP_LOCATION:
+      g_value_set_object (value, priv->location);
+      break;
+    case PROP_WATERMARK:
+      g_value_set_string (value, priv->watermark);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+    }
+}
+
+static void
+cc_timezone_renderer_set_property (GObject      *object,
+                                   guint         property_id,
+                                   const GValue *value,
+                                   GParamSpec   *pspec)
+{
+  CcTimezoneRenderer *renderer = CC_TIMEZONE_RENDERER (object);
+  switch (property_id)
+    {
+    case PROP_SELECTED_OFFSET:
+      cc_timezone_renderer_set_selected_offset (renderer, g_value_get_double (value));
+      break;
+    case PROP_LOCATION:
+      cc_timezone_renderer_set_location (renderer, g_value_get_object (value));
+      break;
+    case PROP_WATERMARK:
+      cc_timezone_renderer_set_watermark (renderer, g_value_get_string (value));
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+    }
+}
+
+/* Drop everything rendered at the last size */
+static void
+clear_background (CcTimezoneRendererPrivate *priv)
+{
+  if (priv->background)
+    {
+      cairo_surface_destroy (priv->background);
+      priv->background = NULL;
+    }
+
+  if (priv->highlight)
+    {
+      cairo_pattern_destroy (priv->highlight);
+      priv->highlight = NULL;
+    }
+  priv->highlight_id = 0;
+
+  g_free (priv->offset_index);
+  priv->offset_index = NULL;
+}
+
+static void
+cc_timezone_renderer_dispose (GObject *object)
+{
+  CcTimezoneRendererPrivate *priv = CC_TIMEZONE_RENDERER (object)->priv;
+
+  clear_background (priv);
+  g_clear_object (&priv->location);
+
+  if (priv->pin)
+    {
+      cairo_surface_destroy (priv->pin);
+      priv->pin = NULL;
+    }
+
+  G_OBJECT_CLASS (cc_timezone_renderer_parent_class)->dispose (object);
+}
+
+static void
+cc_timezone_renderer_finalize (GObject *object)
+{
+  CcTimezoneRendererPrivate *priv = CC_TIMEZONE_RENDERER (object)->priv;
+
+  if (priv->tzdb)
+    {
+      tz_db_free (priv->tzdb);
+      priv->tzdb = NULL;
+    }
+
+  if (priv->geometry)
+    {
+      tz_geometry_free (priv->geometry);
+      priv->geometry = NULL;
+    }
+
+  g_array_free (priv->offset_palette, TRUE);
+  g_free (priv->location_offset_ids);
+  g_free (priv->location_points);
+  g_free (priv->watermark);
+
+  G_OBJECT_CLASS (cc_timezone_renderer_parent_class)->finalize (object);
+}
+
+static void
+cc_timezone_renderer_class_init (CcTimezoneRendererClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  g_type_class_add_private (klass, sizeof (CcTimezoneRendererPrivate));
+
+  object_class->get_property = cc_timezone_renderer_get_property;
+  object_class->set_property = cc_timezone_renderer_set_property;
+  object_class->dispose = cc_timezone_renderer_dispose;
+  object_class->finalize = cc_timezone_renderer_finalize;
+
+  g_object_class_install_property (object_class,
+                                   PROP_SELECTED_OFFSET,
+                                   g_param_spec_double ("selected-offset",
+                                                        "Selected offset",
+                                                        "The selected offset from GMT in hours",
+                                                        -G_MAXDOUBLE, G_MAXDOUBLE, 0.0,
+                                                        G_PARAM_READWRITE));
+  g_object_class_install_property (object_class,
+                                   PROP_LOCATION,
+                                   g_param_spec_object ("location",
+                                                        "Location",
+                                                        "The location the pin is drawn at",
+                                                        CC_TYPE_TIMEZONE_LOCATION,
+                                                        G_PARAM_READWRITE));
+  g_object_class_install_property (object_class,
+                                   PROP_WATERMARK,
+                                   g_param_spec_string ("watermark",
+                                                        "Watermark",
+                                                        "Text drawn in the bottom right corner",
+                                                        NULL,
+                                                        G_PARAM_READWRITE));
+}
+
+static void
+cc_timezone_renderer_init (CcTimezoneRenderer *self)
+{
+  CcTimezoneRendererPrivate *priv;
+  GError *err = NULL;
+  gchar *file;
+
+  priv = self->priv = TIMEZONE_RENDERER_PRIVATE (self);
+
+  file = g_strdup_printf ("%s/time_zones_countryInfo.geom", get_datadir ());
+  priv->geometry = tz_geometry_load (file, &err);
+  if (!priv->geometry)
+    {
+      g_warning ("Could not load map data: %s",
+                 (err) ? err->message : "Unknown error");
+      g_clear_error (&err);
+    }
+  g_free (file);
+
+  file = g_strdup_printf ("%s/pin.png", get_datadir ());
+  priv->pin = cairo_image_surface_create_from_png (file);
+  if (cairo_surface_status (priv->pin) != CAIRO_STATUS_SUCCESS)
+    {
+      g_warning ("Could not load pin icon: %s",
+                 cairo_status_to_string (cairo_surface_status (priv->pin)));
+      cairo_surface_destroy (priv->pin);
+      priv->pin = NULL;
+    }
+  g_free (file);
+
+  priv->offset_palette = g_array_new (FALSE, FALSE, sizeof (gdouble));
+
+  priv->tzdb = tz_load_db ();
+  if (priv->tzdb)
+    {
+      GPtrArray *locations = tz_get_locations (priv->tzdb);
+
+      priv->location_offset_ids = tz_offsets_load (locations, priv->offset_palette);
+      priv->location_points = tz_project_locations (locations);
+    }
+}
+
+/**
+ * cc_timezone_renderer_new:
+ *
+ * Creates a renderer, loading the map and location data.
+ *
+ * Returns: (transfer full): a new #CcTimezoneRenderer
+ */
+CcTimezoneRenderer *
+cc_timezone_renderer_new (void)
+{
+  return g_object_new (CC_TYPE_TIMEZONE_RENDERER, NULL);
+}
+
+/**
+ * cc_timezone_renderer_set_location:
+ * @renderer: A #CcTimezoneRenderer
+ * @location: (allow-none): the location to draw the pin at, or %NULL
+ *
+ * Draws the pin at @location and highlights its offset, or draws neither if
+ * @location is %NULL.
+ */
+void
+cc_timezone_renderer_set_location (CcTimezoneRenderer *renderer,
+                                   CcTimezoneLocation *location)
+{
+  CcTimezoneRendererPrivate *priv = renderer->priv;
+
+  if (location)
+    g_object_ref (location);
+  if (priv->location)
+    g_object_unref (priv->location);
+  priv->location = location;
+
+  if (location)
+    {
+      priv->location_point[0] =
+          tz_project_longitude (cc_timezone_location_get_longitude (location));
+      priv->location_point[1] =
+          tz_project_latitude (cc_timezone_location_get_latitude (location));
+
+      priv->selected_offset = tz_location_get_offset (location);
+      priv->show_offset = TRUE;
+    }
+  else
+    {
+      priv->selected_offset = 0.0;
+      priv->show_offset = FALSE;
+    }
+
+  g_object_notify (G_OBJECT (renderer), "location");
+  g_object_notify (G_OBJECT (renderer), "selected-offset");
+}
+
+/**
+ * cc_timezone_renderer_get_location:
+ * @renderer: A #CcTimezoneRenderer
+ *
+ * Returns the location the pin is drawn at.
+ *
+ * Returns: (transfer none): the location, or %NULL.
+ */
+CcTimezoneLocation *
+cc_timezone_renderer_get_location (CcTimezoneRenderer *renderer)
+{
+  return renderer->priv->location;
+}
+
+/**
+ * cc_timezone_renderer_set_selected_offset:
+ * @renderer: A #CcTimezoneRenderer
+ * @offset: the offset from GMT in hours
+ *
+ * Highlights the areas of the map at @offset.
+ */
+void
+cc_timezone_renderer_set_selected_offset (CcTimezoneRenderer *renderer,
+                                          gdouble             offset)
+{
+  renderer->priv->selected_offset = offset;
+  renderer->priv->show_offset = TRUE;
+  g_object_notify (G_OBJECT (renderer), "selected-offset");
+}
+
+gdouble
+cc_timezone_renderer_get_selected_offset (CcTimezoneRenderer *renderer)
+{
+  return renderer->priv->selected_offset;
+}
+
+/**
+ * cc_timezone_renderer_set_watermark:
+ * @renderer: A #CcTimezoneRenderer
+ * @watermark: (allow-none): text to draw in the corner of the map, or %NULL
+ */
+void
+cc_timezone_renderer_set_watermark (CcTimezoneRenderer *renderer,
+                                    const gchar        *watermark)
+{
+  g_free (renderer->priv->watermark);
+  renderer->priv->watermark = g_strdup (watermark);
+  g_object_notify (G_OBJECT (renderer), "watermark");
+}
+
+/* Render the map and its offset index at a new size */
+static void
+render_background (CcTimezoneRendererPrivate *priv,
+                   gint                       width,
+                   gint                       height)
+{
+  cairo_t *cr;
+
+  clear_background (priv);
+
+  priv->width = width;
+  priv->height = height;
+  priv->background = cairo_image_surface_create (CAIRO_FORMAT_ARGB32,
+                                                 width, height);
+
+  cr = cairo_create (priv->background);
+  tz_render_map (priv->geometry, cr, width, height);
+  cairo_destroy (cr);
+
+  cairo_surface_flush (priv->background);
+
+  priv->offset_index = tz_render_offset_index (priv->tzdb ? tz_get_locations (priv->tzdb)->len : 0,
+                                               priv->location_points,
+                                               priv->location_offset_ids,
+                                               priv->background);
+}
+
+/* Draw the highlight, watermark and pin over a width by height map. The
+ * highlight is stretched from the offset index at the size last rendered. */
+static void
+draw_overlays (CcTimezoneRendererPrivate *priv,
+               cairo_t                   *cr,
+               gint                       width,
+               gint                       height)
+{
+  if (priv->show_offset && priv->offset_index)
+    {
+      guint8 id = tz_offsets_find (priv->offset_palette, priv->selected_offset);
+
+      if (id != priv->highlight_id)
+        {
+          if (priv->highlight)
+            cairo_pattern_destroy (priv->highlight);
+
+          priv->highlight = (id != 0) ?
+              tz_render_highlight_mask (priv->offset_index,
+                                        priv->width, priv->height, 1, id) :
+              NULL;
+          priv->highlight_id = id;
+        }
+
+      if (priv->highlight)
+        {
+          cairo_save (cr);
+          cairo_scale (cr,
+                       (gdouble) width / priv->width,
+                       (gdouble) height / priv->height);
+          tz_render_highlight (cr, priv->highlight, 1.0);
+          cairo_restore (cr);
+        }
+    }
+
+  if (priv->watermark)
+    tz_render_watermark (cr, priv->watermark, width, height);
+
+  if (priv->location && priv->pin)
+    {
+      cairo_set_source_surface (cr, priv->pin,
+                                priv->location_point[0] * width - TZ_PIN_POINT_X,
+                                MIN (priv->location_point[1], 1.0) * height - TZ_PIN_POINT_Y);
+      cairo_paint (cr);
+    }
+}
+
+/**
+ * cc_timezone_renderer_render:
+ * @renderer: A #CcTimezoneRenderer
+ * @cr: the cairo context to draw on
+ * @width: the width of the map in pixels
+ * @height: the height of the map in pixels
+ *
+ * Draws the map, with the highlight, pin and watermark, at the origin of @cr
+ * and one pixel to a unit. The map is drawn at the same size as the
+ * previous image without being rendered again.
+ */
+void
+cc_timezone_renderer_render (CcTimezoneRenderer *renderer,
+                             cairo_t            *cr,
+                             gint                width,
+                             gint                height)
+{
+  CcTimezoneRendererPrivate *priv = renderer->priv;
+
+  g_return_if_fail (width > 0 && height > 0);
+
+  if (!priv->geometry)
+    return;
+
+  if (!priv->background || width != priv->width || height != priv->height)
+    render_background (priv, width, height);
+
+  cairo_save (cr);
+
+  cairo_set_source_surface (cr, priv->background, 0, 0);
+  cairo_paint (cr);
+
+  draw_overlays (priv, cr, width, height);
+
+  cairo_restore (cr);
+}
+
+typedef struct
+{
+  GOutputStream *stream;
+  GCancellable *cancellable;
+  GError *error;
+} PngWriter;
+
+static cairo_status_t
+write_png_data (gpointer             user_data,
+                const unsigned char *data,
+                unsigned int         length)
+{
+  PngWriter *writer = user_data;
+
+  if (!g_output_stream_write_all (writer->stream, data, length, NULL,
+                                  writer->cancellable, &writer->error))
+    return CAIRO_STATUS_WRITE_ERROR;
+
+  return CAIRO_STATUS_SUCCESS;
+}
+
+/**
+ * cc_timezone_renderer_write_png:
+ * @renderer: A #CcTimezoneRenderer
+ * @stream: the stream to write the image to
+ * @width: the width of the image in pixels
+ * @height: the height of the image in pixels
+ * @cancellable: (allow-none): a #GCancellable, or %NULL
+ * @error: return location for a #GError, or %NULL
+ *
+ * Draws the map as in cc_timezone_renderer_render() and writes it to
+ * @stream as a PNG image. The stream is not closed.
+ *
+ * Returns: %TRUE on success, %FALSE if writing failed.
+ */
+gboolean
+cc_timezone_renderer_write_png (CcTimezoneRenderer *renderer,
+                                GOutputStream      *stream,
+                                gint                width,
+                                gint                height,
+                                GCancellable       *cancellable,
+                                GError            **error)
+{
+  PngWriter writer = { stream, cancellable, NULL };
+  cairo_surface_t *surface;
+  cairo_status_t status;
+  cairo_t *cr;
+
+  g_return_val_if_fail (width > 0 && height > 0, FALSE);
+
+  surface = cairo_image_surface_create (CAIRO_FORMAT_ARGB32, width, height);
+  cr = cairo_create (surface);
+  cc_timezone_renderer_render (renderer, cr, width, height);
+  cairo_destroy (cr);
+
+  status = cairo_surface_write_to_png_stream (surface, write_png_data, &writer);
+  cairo_surface_destroy (surface);
+
+  if (writer.error)
+    {
+      g_propagate_error (error, writer.error);
+      return FALSE;
+    }
+
+  if (status != CAIRO_STATUS_SUCCESS)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Could not write map image: %s",
+                   cairo_status_to_string (status));
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/**
+ * cc_timezone_renderer_export_png:
+ * @renderer: A #CcTimezoneRenderer
+ * @stream: the stream to write the image to
+ * @width: the width of the image in pixels
+ * @height: the height of the image in pixels
+ * @cancellable: (allow-none): a #GCancellable, or %NULL
+ * @error: return location for a #GError, or %NULL
+ *
+ * Writes the map to @stream as a PNG image, like
+ * cc_timezone_renderer_write_png(), but renders and encodes it a band of
+ * rows at a time. Memory use depends on the width of the image rather than
+ * its area, so this can make images far larger than would fit in memory,
+ * for print. The highlight is stretched from a map of at most a few
+ * thousand pixels across. The stream is not closed.
+ *
+ * Returns: %TRUE on success, %FALSE if writing failed or was cancelled.
+ */
+gboolean
+cc_timezone_renderer_export_png (CcTimezoneRenderer *renderer,
+                                 GOutputStream      *stream,
+                                 gint                width,
+                                 gint                height,
+                                 GCancellable       *cancellable,
+                                 GError            **error)
+{
+  CcTimezoneRendererPrivate *priv = renderer->priv;
+  cairo_surface_t *band;
+  TzPngWriter *png;
+  gdouble index_scale;
+  gint index_width, index_height;
+  gboolean ok = TRUE;
+  gint y;
+
+  g_return_val_if_fail (width > 0 && height > 0, FALSE);
+
+  if (!priv->geometry)
+    {
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                           "Could not write map image: no map data");
+      return FALSE;
+    }
+
+  /* The offset index needs the whole map at once, so it is made at a size
+   * that fits in memory */
+  index_scale = MIN (1.0, (gdouble) EXPORT_INDEX_MAX_SIZE / MAX (width, height));
+  index_width = MAX (1, (gint) ceil (width * index_scale));
+  index_height = MAX (1, (gint) ceil (height * index_scale));
+
+  if (!priv->background || index_width != priv->width || index_height != priv->height)
+    render_background (priv, index_width, index_height);
+
+  band = cairo_image_surface_create (CAIRO_FORMAT_ARGB32, width,
+                                     MIN (height, EXPORT_BAND_HEIGHT));
+  if (cairo_surface_status (band) != CAIRO_STATUS_SUCCESS)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Could not write map image: %s",
+                   cairo_status_to_string (cairo_surface_status (band)));
+      cairo_surface_destroy (band);
+      return FALSE;
+    }
+
+  png = tz_png_writer_new (stream, width, height);
+
+  for (y = 0; ok && y < height; y += EXPORT_BAND_HEIGHT)
+    {
+      gint n_rows = MIN (EXPORT_BAND_HEIGHT, height - y);
+      cairo_t *cr;
+
+      if (g_cancellable_set_error_if_cancelled (cancellable, error))
+        {
+          ok = FALSE;
+          break;
+        }
+
+      cr = cairo_create (band);
+      cairo_set_operator (cr, CAIRO_OPERATOR_CLEAR);
+      cairo_paint (cr);
+      cairo_set_operator (cr, CAIRO_OPERATOR_OVER);
+
+      /* Only the shapes crossing the band are drawn */
+      cairo_translate (cr, 0, -y);
+      tz_render_map (priv->geometry, cr, width, height);
+      draw_overlays (priv, cr, width, height);
+      cairo_destroy (cr);
+
+      ok = tz_png_writer_write_rows (png, band, n_rows, cancellable, error);
+    }
+
+  if (ok)
+    ok = tz_png_writer_finish (png, cancellable, error);
+
+  tz_png_writer_free (png);
+  cairo_surface_destroy (band);
+
+  return ok;
+}
@@ -0,0 +1,97 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+
+#ifndef _CC_TIMEZONE_RENDERER_H
+#define _CC_TIMEZONE_RENDERER_H
+
+#include <gio/gio.h>
+#include <cairo.h>
+#include "cc-timezone-location.h"
+
+G_BEGIN_DECLS
+
+#define CC_TYPE_TIMEZONE_RENDERER cc_timezone_renderer_get_type()
+
+#define CC_TIMEZONE_RENDERER(obj) \
+  (G_TYPE_CHECK_INSTANCE_CAST ((obj), \
+  CC_TYPE_TIMEZONE_RENDERER, CcTimezoneRenderer))
+
+#define CC_TIMEZONE_RENDERER_CLASS(klass) \
+  (G_TYPE_CHECK_CLASS_CAST ((klass), \
+  CC_TYPE_TIMEZONE_RENDERER, CcTimezoneRendererClass))
+
+#define CC_IS_TIMEZONE_RENDERER(obj) \
+  (G_TYPE_CHECK_INSTANCE_TYPE ((obj), \
+  CC_TYPE_TIMEZONE_RENDERER))
+
+#define CC_IS_TIMEZONE_RENDERER_CLASS(klass) \
+  (G_TYPE_CHECK_CLASS_TYPE ((klass), \
+  CC_TYPE_TIMEZONE_RENDERER))
+
+#define CC_TIMEZONE_RENDERER_GET_CLASS(obj) \
+  (G_TYPE_INSTANCE_GET_CLASS ((obj), \
+  CC_TYPE_TIMEZONE_RENDERER, CcTimezoneRendererClass))
+
+typedef struct _CcTimezoneRenderer CcTimezoneRenderer;
+typedef struct _CcTimezoneRendererClass CcTimezoneRendererClass;
+typedef struct _CcTimezoneRendererPrivate CcTimezoneRendererPrivate;
+
+struct _CcTimezoneRenderer
+{
+  GObject parent;
+
+  CcTimezoneRendererPrivate *priv;
+};
+
+struct _CcTimezoneRendererClass
+{
+  GObjectClass parent_class;
+};
+
+GType cc_timezone_renderer_get_type (void) G_GNUC_CONST;
+
+CcTimezoneRenderer *cc_timezone_renderer_new (void);
+
+void cc_timezone_renderer_set_location (CcTimezoneRenderer *renderer,
+                                        CcTimezoneLocation *location);
+CcTimezoneLocation * cc_timezone_renderer_get_location (CcTimezoneRenderer *renderer);
+void cc_timezone_renderer_set_selected_offset (CcTimezoneRenderer *renderer,
+                                               gdouble offset);
+gdouble cc_timezone_renderer_get_selected_offset (CcTimezoneRenderer *renderer);
+void cc_timezone_renderer_set_watermark (CcTimezoneRenderer *renderer,
+                                         const gchar *watermark);
+void cc_timezone_renderer_render (CcTimezoneRenderer *renderer,
+                                  cairo_t *cr,
+                                  gint width,
+                                  gint height);
+gboolean cc_timezone_renderer_write_png (CcTimezoneRenderer *renderer,
+                                         GOutputStream *stream,
+                                         gint width,
+                                         gint height,
+                                         GCancellable *cancellable,
+                                         GError **error);
+gboolean cc_timezone_renderer_export_png (CcTimezoneRenderer *renderer,
+                                          GOutputStream *stream,
+                                          gint width,
+                                          gint height,
+                                          GCancellable *cancellable,
+                                          GError **error);
+
+G_END_DECLS
+
+#endif /* _CC_TIMEZONE_RENDERER_H */
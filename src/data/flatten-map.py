@@ -0,0 +1,525 @@
+#!/usr/bin/python3
+#
+# Flatten the background layer of the map SVG into the compact geometry file
+# loaded by the map widget.
+#
+# Usage: flatten-map.py time_zones_countryInfo-orig.svg output.geom
+#
+# Every visible shape in the layer becomes one fill or stroke record. Group
+# transforms are applied to the coordinates, arcs and ellipses are converted to
+# cubic curves, and the result is translated so that the layer's bounding box
+# starts at the origin. See tz-geometry.c for the file layout.
+#
+# Besides the full detail shapes, the file holds simplified copies of the map
+# for drawing at small sizes. Each level flattens curves to lines and drops
+# vertices and whole subpaths that stay within its tolerance, in map units.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+
+import math
+import re
+import struct
+import sys
+import xml.etree.ElementTree as ET
+
+SVG_NS = '{http://www.w3.org/2000/svg}'
+LAYER_ID = 'background'
+
+MAGIC = b'TZGEOM\0\0'
+VERSION = 2
+
+LEVEL_TOLERANCES = (0.5, 1.0, 2.0, 4.0, 8.0)
+
+OP_MOVE, OP_LINE, OP_CURVE, OP_CLOSE = range(4)
+
+FLAG_STROKE = 1 << 0
+FLAG_EVEN_ODD = 1 << 1
+CAPS = {'butt': 0, 'round': 1, 'square': 2}
+JOINS = {'miter': 0, 'round': 1, 'bevel': 2}
+
+INHERITED = ('fill', 'fill-opacity', 'fill-rule', 'stroke', 'stroke-opacity',
+             'stroke-width', 'stroke-linecap', 'stroke-linejoin')
+
+IDENTITY = (1.0, 0.0, 0.0, 1.0, 0.0, 0.0)
+
+
+def multiply(a, b):
+    """Return the matrix applying b, then a."""
+    return (a[0] * b[0] + a[2] * b[1],
+            a[1] * b[0] + a[3] * b[1],
+            a[0] * b[2] + a[2] * b[3],
+            a[1] * b[2] + a[3] * b[3],
+            a[0] * b[4] + a[2] * b[5] + a[4],
+            a[1] * b[4] + a[3] * b[5] + a[5])
+
+
+def parse_transform(text):
+    matrix = IDENTITY
+    for name, args in re.findall(r'(\w+)\s*\(([^)]*)\)', text or ''):
+        v = [float(x) for x in re.split(r'[\s,]+', args.strip()) if x]
+        if name == 'matrix':
+            m = tuple(v)
+        elif name == 'translate':
+            m = (1, 0, 0, 1, v[0], v[1] if len(v) > 1 else 0)
+        elif name == 'scale':
+            m = (v[0], 0, 0, v[1] if len(v) > 1 else v[0], 0, 0)
+        elif name == 'rotate':
+            a = math.radians(v[0])
+            m = (math.cos(a), math.sin(a), -math.sin(a), math.cos(a), 0, 0)
+            if len(v) == 3:
+                m = multiply((1, 0, 0, 1, v[1], v[2]),
+                             multiply(m, (1, 0, 0, 1, -v[1], -v[2])))
+        else:
+            raise ValueError('Unsupported transform: %s' % name)
+        matrix = multiply(matrix, m)
+    return matrix
+
+
+def parse_style(element, parent):
+    style = {k: v for k, v in parent.items() if k in INHERITED}
+    style.pop('display', None)
+    for key in INHERITED + ('display', 'visibility', 'opacity'):
+        if element.get(key) is not None:
+            style[key] = element.get(key)
+    for item in (element.get('style') or '').split(';'):
+        if ':' in item:
+            key, value = item.split(':', 1)
+            style[key.strip()] = value.strip()
+    return style
+
+
+def parse_color(value):
+    value = (value or 'none').strip()
+    if value == 'none' or value.startswith('url('):
+        return None
+    if re.fullmatch(r'#[0-9a-fA-F]{6}', value):
+        return tuple(int(value[i:i + 2], 16) for i in (1, 3, 5))
+    if re.fullmatch(r'#[0-9a-fA-F]{3}', value):
+        return tuple(int(c * 2, 16) for c in value[1:])
+    if value == 'black':
+        return (0, 0, 0)
+    if value == 'white':
+        return (255, 255, 255)
+    raise ValueError('Unsupported color: %s' % value)
+
+
+def parse_length(value, default):
+    if value is None:
+        return default
+    return float(re.match(r'[-+0-9.eE]+', value).group(0)) * \
+        (1.25 if value.endswith('pt') else 1.0)
+
+
+NUMBER = re.compile(r'[-+]?(?:\d+\.?\d*|\.\d+)(?:[eE][-+]?\d+)?')
+
+
+def tokenize_path(d):
+    pos = 0
+    while pos < len(d):
+        c = d[pos]
+        if c.isspace() or c == ',':
+            pos += 1
+        elif c.isalpha() and c not in 'eE':
+            yield c
+            pos += 1
+        else:
+            m = NUMBER.match(d, pos)
+            if not m:
+                raise ValueError('Bad path data near: %s' % d[pos:pos + 20])
+            yield float(m.group(0))
+            pos = m.end()
+
+
+def arc_to_curves(x1, y1, rx, ry, phi, large, sweep, x2, y2):
+    """Convert an SVG elliptical arc to a list of cubic control points."""
+    if rx == 0 or ry == 0 or (x1 == x2 and y1 == y2):
+        return [(x1, y1), (x2, y2), (x2, y2)]
+    rx, ry = abs(rx), abs(ry)
+    cos_phi, sin_phi = math.cos(math.radians(phi)), math.sin(math.radians(phi))
+    dx, dy = (x1 - x2) / 2, (y1 - y2) / 2
+    x1p = cos_phi * dx + sin_phi * dy
+    y1p = -sin_phi * dx + cos_phi * dy
+    scale = (x1p / rx) ** 2 + (y1p / ry) ** 2
+    if scale > 1:
+        rx, ry = rx * math.sqrt(scale), ry * math.sqrt(scale)
+    num = rx * rx * ry * ry - rx * rx * y1p * y1p - ry * ry * x1p * x1p
+    den = rx * rx * y1p * y1p + ry * ry * x1p * x1p
+    coef = math.sqrt(max(0.0, num / den))
+    if large == sweep:
+        coef = -coef
+    cxp, cyp = coef * rx * y1p / ry, -coef * ry * x1p / rx
+    cx = cos_phi * cxp - sin_phi * cyp + (x1 + x2) / 2
+    cy = sin_phi * cxp + cos_phi * cyp + (y1 + y2) / 2
+
+    def angle(ux, uy, vx, vy):
+        return math.atan2(ux * vy - uy * vx, ux * vx + uy * vy)
+
+    theta = angle(1, 0, (x1p - cxp) / rx, (y1p - cyp) / ry)
+    delta = angle((x1p - cxp) / rx, (y1p - cyp) / ry,
+                  (-x1p - cxp) / rx, (-y1p - cyp) / ry)
+    if not sweep and delta > 0:
+        delta -= 2 * math.pi
+    elif sweep and delta < 0:
+        delta += 2 * math.pi
+
+    segments = max(1, int(math.ceil(abs(delta) / (math.pi / 2) - 1e-9)))
+    step = delta / segments
+    k = 4 / 3 * math.tan(step / 4)
+    points = []
+
+    def point(t):
+        x, y = rx * math.cos(t), ry * math.sin(t)
+        return (cos_phi * x - sin_phi * y + cx, sin_phi * x + cos_phi * y + cy)
+
+    def tangent(t):
+        x, y = -rx * math.sin(t), ry * math.cos(t)
+        return (cos_phi * x - sin_phi * y, sin_phi * x + cos_phi * y)
+
+    t = theta
+    for _ in range(segments):
+        p0, p3 = point(t), point(t + step)
+        d0, d3 = tangent(t), tangent(t + step)
+        points += [(p0[0] + k * d0[0], p0[1] + k * d0[1]),
+                   (p3[0] - k * d3[0], p3[1] - k * d3[1]),
+                   p3]
+        t += step
+    points[-1] = (x2, y2)
+    return points
+
+
+def parse_path(d):
+    """Return a list of (op, points) with absolute coordinates."""
+    ops = []
+    tokens = list(tokenize_path(d))
+    i = 0
+    cmd = None
+    x = y = start_x = start_y = 0.0
+    last_ctrl = None
+
+    def take(n):
+        nonlocal i
+        values = tokens[i:i + n]
+        if len(values) < n or any(isinstance(v, str) for v in values):
+            raise ValueError('Truncated path data')
+        i += n
+        return values
+
+    while i < len(tokens):
+        if isinstance(tokens[i], str):
+            cmd = tokens[i]
+            i += 1
+            if cmd in 'zZ':
+                ops.append((OP_CLOSE, []))
+                x, y = start_x, start_y
+                last_ctrl = None
+                continue
+        elif cmd is None:
+            raise ValueError('Path data does not start with a command')
+
+        rel = cmd.islower()
+        c = cmd.upper()
+        ox, oy = (x, y) if rel else (0.0, 0.0)
+
+        if c == 'M':
+            px, py = take(2)
+            x, y = ox + px, oy + py
+            start_x, start_y = x, y
+            ops.append((OP_MOVE, [(x, y)]))
+            # Further coordinate pairs are implicit line-tos
+            cmd = 'l' if rel else 'L'
+            last_ctrl = None
+        elif c == 'L':
+            px, py = take(2)
+            x, y = ox + px, oy + py
+            ops.append((OP_LINE, [(x, y)]))
+            last_ctrl = None
+        elif c == 'H':
+            x = ox + take(1)[0]
+            ops.append((OP_LINE, [(x, y)]))
+            last_ctrl = None
+        elif c == 'V':
+            y = oy + take(1)[0]
+            ops.append((OP_LINE, [(x, y)]))
+            last_ctrl = None
+        elif c == 'C':
+            v = take(6)
+            p1 = (ox + v[0], oy + v[1])
+            p2 = (ox + v[2], oy + v[3])
+            x, y = ox + v[4], oy + v[5]
+            ops.append((OP_CURVE, [p1, p2, (x, y)]))
+            last_ctrl = p2
+        elif c == 'S':
+            v = take(4)
+            p1 = (2 * x - last_ctrl[0], 2 * y - last_ctrl[1]) \
+                if last_ctrl else (x, y)
+            p2 = (ox + v[0], oy + v[1])
+            x, y = ox + v[2], oy + v[3]
+            ops.append((OP_CURVE, [p1, p2, (x, y)]))
+            last_ctrl = p2
+        elif c == 'Q':
+            v = take(4)
+            q = (ox + v[0], oy + v[1])
+            end = (ox + v[2], oy + v[3])
+            ops.append((OP_CURVE, [(x + 2 / 3 * (q[0] - x), y + 2 / 3 * (q[1] - y)),
+                                   (end[0] + 2 / 3 * (q[0] - end[0]),
+                                    end[1] + 2 / 3 * (q[1] - end[1])),
+                                   end]))
+            x, y = end
+            last_ctrl = None
+        elif c == 'A':
+            v = take(7)
+            end = (ox + v[5], oy + v[6])
+            points = arc_to_curves(x, y, v[0], v[1], v[2], v[3] != 0,
+                                   v[4] != 0, end[0], end[1])
+            for n in range(0, len(points), 3):
+                ops.append((OP_CURVE, points[n:n + 3]))
+            x, y = end
+            last_ctrl = None
+        else:
+            raise ValueError('Unsupported path command: %s' % cmd)
+
+    return ops
+
+
+def ellipse_path(element):
+    cx = float(element.get('cx', 0))
+    cy = float(element.get('cy', 0))
+    rx = float(element.get('rx', element.get('r', 0)))
+    ry = float(element.get('ry', element.get('r', 0)))
+    k = 4 / 3 * (math.sqrt(2) - 1)
+    return [(OP_MOVE, [(cx + rx, cy)]),
+            (OP_CURVE, [(cx + rx, cy + k * ry), (cx + k * rx, cy + ry), (cx, cy + ry)]),
+            (OP_CURVE, [(cx - k * rx, cy + ry), (cx - rx, cy + k * ry), (cx - rx, cy)]),
+            (OP_CURVE, [(cx - rx, cy - k * ry), (cx - k * rx, cy - ry), (cx, cy - ry)]),
+            (OP_CURVE, [(cx + k * rx, cy - ry), (cx + rx, cy - k * ry), (cx + rx, cy)]),
+            (OP_CLOSE, [])]
+
+
+def rect_path(element):
+    x = float(element.get('x', 0))
+    y = float(element.get('y', 0))
+    w = float(element.get('width'))
+    h = float(element.get('height'))
+    return [(OP_MOVE, [(x, y)]), (OP_LINE, [(x + w, y)]),
+            (OP_LINE, [(x + w, y + h)]), (OP_LINE, [(x, y + h)]),
+            (OP_CLOSE, [])]
+
+
+def apply(matrix, ops):
+    a, b, c, d, e, f = matrix
+    return [(op, [(a * x + c * y + e, b * x + d * y + f) for x, y in points])
+            for op, points in ops]
+
+
+def collect(element, matrix, parent_style, records):
+    style = parse_style(element, parent_style)
+    if style.get('display') == 'none' or style.get('visibility') == 'hidden':
+        return
+    matrix = multiply(matrix, parse_transform(element.get('transform')))
+    opacity = float(style.get('opacity', 1)) * float(parent_style.get('_opacity', 1))
+    style['_opacity'] = opacity
+
+    tag = element.tag.replace(SVG_NS, '')
+    if tag == 'g':
+        for child in element:
+            collect(child, matrix, style, records)
+        return
+    if tag == 'path':
+        ops = parse_path(element.get('d'))
+    elif tag in ('ellipse', 'circle'):
+        ops = ellipse_path(element)
+    elif tag == 'rect':
+        ops = rect_path(element)
+    else:
+        # Images, text and other content are not part of the map
+        return
+
+    ops = apply(matrix, ops)
+
+    fill = parse_color(style.get('fill', 'black'))
+    if fill:
+        alpha = opacity * float(style.get('fill-opacity', 1))
+        flags = FLAG_EVEN_ODD if style.get('fill-rule') == 'evenodd' else 0
+        records.append((fill, alpha, flags, 0.0, ops))
+
+    stroke = parse_color(style.get('stroke', 'none'))
+    width = parse_length(style.get('stroke-width'), 1.0)
+    if stroke and width > 0:
+        alpha = opacity * float(style.get('stroke-opacity', 1))
+        flags = FLAG_STROKE
+        flags |= CAPS[style.get('stroke-linecap', 'butt')] << 2
+        flags |= JOINS[style.get('stroke-linejoin', 'miter')] << 4
+        # Widths are stored in output units, assuming uniform scaling
+        scale = math.sqrt(abs(matrix[0] * matrix[3] - matrix[1] * matrix[2]))
+        records.append((stroke, alpha, flags, width * scale, ops))
+
+
+def flatten_curve(p0, p1, p2, p3, tolerance):
+    """Return points along a cubic, excluding p0, within tolerance of it."""
+    # Wang's formula for the number of segments
+    dd = max(math.hypot(p0[0] - 2 * p1[0] + p2[0], p0[1] - 2 * p1[1] + p2[1]),
+             math.hypot(p1[0] - 2 * p2[0] + p3[0], p1[1] - 2 * p2[1] + p3[1]))
+    n = max(1, int(math.ceil(math.sqrt(0.75 * dd / tolerance))))
+    points = []
+    for i in range(1, n + 1):
+        t = i / n
+        mt = 1 - t
+        points.append(tuple(mt ** 3 * p0[k] + 3 * mt * mt * t * p1[k] +
+                            3 * mt * t * t * p2[k] + t ** 3 * p3[k]
+                            for k in (0, 1)))
+    return points
+
+
+def subpaths(ops, tolerance):
+    """Split ops into (points, closed) polylines with curves flattened."""
+    points = []
+    start = current = (0.0, 0.0)
+    for op, args in ops:
+        if op == OP_MOVE:
+            if len(points) > 1:
+                yield points, False
+            start = current = args[0]
+            points = [current]
+            continue
+        if not points:
+            points = [current]
+        if op == OP_LINE:
+            current = args[0]
+            points.append(current)
+        elif op == OP_CURVE:
+            points.extend(flatten_curve(current, args[0], args[1], args[2],
+                                        tolerance))
+            current = args[2]
+        elif op == OP_CLOSE:
+            if points[-1] != start:
+                points.append(start)
+            if len(points) > 1:
+                yield points, True
+            points = []
+            current = start
+    if len(points) > 1:
+        yield points, False
+
+
+def segment_distance(p, a, b):
+    dx, dy = b[0] - a[0], b[1] - a[1]
+    length = dx * dx + dy * dy
+    if length == 0:
+        return math.hypot(p[0] - a[0], p[1] - a[1])
+    t = max(0.0, min(1.0, ((p[0] - a[0]) * dx + (p[1] - a[1]) * dy) / length))
+    return math.hypot(p[0] - a[0] - t * dx, p[1] - a[1] - t * dy)
+
+
+def douglas_peucker(points, tolerance):
+    keep = [False] * len(points)
+    keep[0] = keep[-1] = True
+    stack = [(0, len(points) - 1)]
+    while stack:
+        first, last = stack.pop()
+        best, index = 0.0, None
+        for i in range(first + 1, last):
+            d = segment_distance(points[i], points[first], points[last])
+            if d > best:
+                best, index = d, i
+        if index is not None and best > tolerance:
+            keep[index] = True
+            stack.append((first, index))
+            stack.append((index, last))
+    return [p for p, k in zip(points, keep) if k]
+
+
+def simplify(ops, tolerance):
+    result = []
+    for points, closed in subpaths(ops, tolerance):
+        xs = [x for x, _ in points]
+        ys = [y for _, y in points]
+        if max(xs) - min(xs) < tolerance and max(ys) - min(ys) < tolerance:
+            continue
+        points = douglas_peucker(points, tolerance)
+        if closed:
+            # The ring ends where it starts; close_path draws that edge
+            points = points[:-1]
+            if len(points) < 3:
+                continue
+        result.append((OP_MOVE, [points[0]]))
+        result.extend((OP_LINE, [p]) for p in points[1:])
+        if closed:
+            result.append((OP_CLOSE, []))
+    return result
+
+
+def pack_level(tolerance, records, min_x, min_y):
+    record_data = bytearray()
+    op_data = bytearray()
+    point_data = bytearray()
+    n_ops = n_points = 0
+
+    for color, alpha, flags, line_width, ops in records:
+        rgba = (color[0] << 24) | (color[1] << 16) | (color[2] << 8) | \
+            int(round(max(0.0, min(1.0, alpha)) * 255))
+        record_data += struct.pack('<IIHHf', rgba, len(ops), flags, 0, line_width)
+        for op, points in ops:
+            op_data.append(op)
+            for x, y in points:
+                point_data += struct.pack('<ff', x - min_x, y - min_y)
+            n_points += len(points)
+        n_ops += len(ops)
+
+    while len(op_data) % 4:
+        op_data.append(0)
+
+    header = struct.pack('<fIII', tolerance, len(records), n_ops, n_points)
+    return header + record_data + op_data + point_data
+
+
+def write_geometry(records, output):
+    xs = [x for r in records for _, pts in r[4] for x, _ in pts]
+    ys = [y for r in records for _, pts in r[4] for _, y in pts]
+    min_x, min_y = min(xs), min(ys)
+    width, height = max(xs) - min_x, max(ys) - min_y
+
+    levels = [(0.0, records)]
+    for tolerance in LEVEL_TOLERANCES:
+        simplified = []
+        for color, alpha, flags, line_width, ops in records:
+            ops = simplify(ops, tolerance)
+            if ops:
+                simplified.append((color, alpha, flags, line_width, ops))
+        levels.append((tolerance, simplified))
+
+    data = struct.pack('<8sIIff', MAGIC, VERSION, len(levels), width, height)
+    for tolerance, level in levels:
+        data += pack_level(tolerance, level, min_x, min_y)
+
+    with open(output, 'wb') as f:
+        f.write(data)
+
+
+def main():
+    if len(sys.argv) != 3:
+        sys.stderr.write('Usage: %s INPUT.svg OUTPUT.geom\n' % sys.argv[0])
+        sys.exit(1)
+
+    root = ET.parse(sys.argv[1]).getroot()
+    layer = next((g for g in root.iter(SVG_NS + 'g') if g.get('id') == LAYER_ID), None)
+    if layer is None:
+        sys.exit('No layer with id "%s" in %s' % (LAYER_ID, sys.argv[1]))
+
+    # The layer may sit under transformed groups itself
+    parents = {child: parent for parent in root.iter() for child in parent}
+    matrix = IDENTITY
+    node = parents.get(layer)
+    while node is not None:
+        matrix = multiply(parse_transform(node.get('transform')), matrix)
+        node = parents.get(node)
+
+    records = []
+    collect(layer, matrix, {}, records)
+    write_geometry(records, sys.argv[2])
+
+
+if __name__ == '__main__':
+    main()
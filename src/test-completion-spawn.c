@@ -0,0 +1,197 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+/* Checks that looking places up does not run lsb_release, and still tells
+ * the geoname server the release from os-release.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <glib/gstdio.h>
+#include <gtk/gtk.h>
+#include <libsoup/soup.h>
+#include "timezone-completion.h"
+
+/* A stand-in lsb_release goes first on PATH, and leaves a mark if it is ever
+ * run. The completion asks a local server instead of the real one, so the
+ * test can tell when the request has gone out. */
+
+#define TEST_TIMEOUT_MS 10000
+
+static guint n_requests = 0;
+static gchar *release = NULL;
+
+static void
+server_callback (SoupServer *server, SoupMessage *msg, const char *path,
+                 GHashTable *query, SoupClientContext *client,
+                 gpointer user_data)
+{
+  const gchar *value = query ? g_hash_table_lookup (query, "release") : NULL;
+
+  if (n_requests++ == 0)
+    release = g_strdup (value);
+
+  soup_message_set_status (msg, SOUP_STATUS_OK);
+  soup_message_set_response (msg, "application/json", SOUP_MEMORY_STATIC,
+                             "[]", 2);
+}
+
+static gboolean
+test_timed_out (gpointer user_data)
+{
+  g_printerr ("Timed out waiting for the geoname request\n");
+  exit (1);
+  return G_SOURCE_REMOVE;
+}
+
+/* What the completion should find, read the same way */
+static gchar *
+read_os_release (void)
+{
+  const gchar *paths[] = { "/etc/os-release", "/usr/lib/os-release", NULL };
+  gchar *version = NULL;
+  gint i, j;
+
+  for (i = 0; paths[i] != NULL; i++)
+    {
+      gchar *contents;
+      gchar **lines;
+
+      if (!g_file_get_contents (paths[i], &contents, NULL, NULL))
+        continue;
+
+      lines = g_strsplit (contents, "\n", -1);
+      for (j = 0; lines[j] != NULL && version == NULL; j++)
+        if (g_str_has_prefix (lines[j], "VERSION_ID="))
+          version = g_shell_unquote (lines[j] + strlen ("VERSION_ID="), NULL);
+
+      g_strfreev (lines);
+      g_free (contents);
+      break;
+    }
+
+  return version != NULL ? version : g_strdup ("");
+}
+
+static void
+remove_tree (const gchar *path)
+{
+  GDir *dir = g_dir_open (path, 0, NULL);
+  const gchar *name;
+
+  if (dir)
+    {
+      while ((name = g_dir_read_name (dir)) != NULL)
+        {
+          gchar *child = g_build_filename (path, name, NULL);
+
+          remove_tree (child);
+          g_free (child);
+        }
+      g_dir_close (dir);
+    }
+
+  g_remove (path);
+}
+
+int
+main (int argc, char **argv)
+{
+  GtkWidget *window, *entry;
+  CcTimezoneCompletion *completion;
+  SoupServer *server;
+  GError *error = NULL;
+  GSList *uris;
+  gchar *dir, *bin_dir, *cache_dir, *marker, *script, *script_path, *path, *base;
+  gchar *expected;
+  gboolean spawned, release_ok;
+
+  dir = g_dir_make_tmp ("test-completion-spawn-XXXXXX", NULL);
+  bin_dir = g_build_filename (dir, "bin", NULL);
+  cache_dir = g_build_filename (dir, "cache", NULL);
+  marker = g_build_filename (dir, "lsb_release-was-run", NULL);
+  g_mkdir (bin_dir, 0700);
+
+  script = g_strdup_printf ("#!/bin/sh\ntouch '%s'\necho 99.99\n", marker);
+  script_path = g_build_filename (bin_dir, "lsb_release", NULL);
+  g_file_set_contents (script_path, script, -1, NULL);
+  g_chmod (script_path, 0755);
+
+  path = g_strdup_printf ("%s:%s", bin_dir, g_getenv ("PATH"));
+  g_setenv ("PATH", path, TRUE);
+
+  /* Answers from an earlier run must not stand in for the request */
+  g_setenv ("XDG_CACHE_HOME", cache_dir, TRUE);
+
+  if (!gtk_init_check (&argc, &argv))
+    {
+      g_print ("SKIP: no display\n");
+      remove_tree (dir);
+      return 77;
+    }
+
+  server = soup_server_new (NULL);
+  soup_server_add_handler (server, NULL, server_callback, NULL, NULL);
+  if (!soup_server_listen_local (server, 0, SOUP_SERVER_LISTEN_IPV4_ONLY, &error))
+    {
+      g_printerr ("Could not start the geoname server: %s\n", error->message);
+      return 1;
+    }
+
+  uris = soup_server_get_uris (server);
+  base = soup_uri_to_string (uris->data, FALSE);
+  g_slist_free_full (uris, (GDestroyNotify) soup_uri_free);
+  g_setenv ("GEONAME_SERVER", base, TRUE);
+
+  window = gtk_offscreen_window_new ();
+  entry = gtk_entry_new ();
+  gtk_container_add (GTK_CONTAINER (window), entry);
+  gtk_widget_show_all (window);
+
+  completion = cc_timezone_completion_new ();
+  cc_timezone_completion_watch_entry (completion, GTK_ENTRY (entry));
+  gtk_entry_set_text (GTK_ENTRY (entry), "Wellington");
+
+  g_timeout_add (TEST_TIMEOUT_MS, test_timed_out, NULL);
+  while (n_requests == 0)
+    g_main_context_iteration (NULL, TRUE);
+
+  spawned = g_file_test (marker, G_FILE_TEST_EXISTS);
+  expected = read_os_release ();
+  release_ok = g_strcmp0 (release, expected) == 0;
+  g_print ("Asked for release '%s', expected '%s'; lsb_release %s\n",
+           release ? release : "(none)", expected,
+           spawned ? "was run" : "was not run");
+
+  cc_timezone_completion_watch_entry (completion, NULL);
+  g_object_unref (completion);
+  gtk_widget_destroy (window);
+  soup_server_disconnect (server);
+  g_object_unref (server);
+
+  remove_tree (dir);
+  g_free (base);
+  g_free (path);
+  g_free (script_path);
+  g_free (script);
+  g_free (marker);
+  g_free (cache_dir);
+  g_free (bin_dir);
+  g_free (dir);
+  g_free (expected);
+  g_free (release);
+
+  return !spawned && release_ok ? 0 : 1;
+}
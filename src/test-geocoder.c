@@ -0,0 +1,458 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+/* Tests of the shared geocoder, against a stand-in backend, the local
+ * location index and a local HTTP server.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <string.h>
+#include <gio/gio.h>
+#include <libsoup/soup.h>
+#include "tz-geocoder.h"
+
+/* The stand-in answers every query with one place named after it, after
+ * this long */
+#define STUB_DELAY_MS 50
+
+/* Longest any test waits for its answers */
+#define TEST_TIMEOUT_MS 5000
+
+typedef struct {
+  TzGeocoderBackend parent;
+  guint n_lookups;
+  GCancellable *cancellable;
+} StubBackend;
+
+/* One lookup made by a test, and what came of it */
+typedef struct {
+  GMainLoop *loop;
+  guint *n_pending;
+  TzGeocoderResults *results;
+  GError *error;
+} Answer;
+
+static void
+stub_finalize (TzGeocoderBackend *backend)
+{
+  StubBackend *stub = (StubBackend *) backend;
+
+  g_clear_object (&stub->cancellable);
+}
+
+static gboolean
+stub_answer (gpointer user_data)
+{
+  GTask *task = user_data;
+  GPtrArray *places;
+  TzGeoname *place;
+
+  if (g_task_return_error_if_cancelled (task))
+    {
+      g_object_unref (task);
+      return G_SOURCE_REMOVE;
+    }
+
+  places = g_ptr_array_new_with_free_func ((GDestroyNotify) tz_geoname_free);
+  place = g_new0 (TzGeoname, 1);
+  place->name = g_strdup (g_task_get_task_data (task));
+  g_ptr_array_add (places, place);
+
+  g_task_return_pointer (task, tz_geocoder_results_new (places, TRUE),
+                         (GDestroyNotify) tz_geocoder_results_unref);
+
+  g_ptr_array_unref (places);
+  g_object_unref (task);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+stub_lookup (TzGeocoderBackend *backend, SoupSession *session,
+             const gchar *query, GCancellable *cancellable,
+             GAsyncReadyCallback callback, gpointer user_data)
+{
+  StubBackend *stub = (StubBackend *) backend;
+  GTask *task = g_task_new (NULL, cancellable, callback, user_data);
+
+  stub->n_lookups++;
+  g_clear_object (&stub->cancellable);
+  stub->cancellable = g_object_ref (cancellable);
+
+  g_task_set_task_data (task, g_strdup (query), g_free);
+  g_timeout_add (STUB_DELAY_MS, stub_answer, task);
+}
+
+static TzGeocoderResults *
+stub_lookup_finish (TzGeocoderBackend *backend, GAsyncResult *result,
+                    GError **error)
+{
+  return g_task_propagate_pointer (G_TASK (result), error);
+}
+
+static const TzGeocoderBackendVTable stub_vtable = {
+  stub_lookup,
+  stub_lookup_finish,
+  stub_finalize,
+};
+
+/* Each test has its own backend name, so the geocoder's latency for it
+ * starts afresh */
+static StubBackend *
+stub_backend_new (void)
+{
+  static guint n_stubs = 0;
+  StubBackend *stub = g_new0 (StubBackend, 1);
+
+  stub->parent.vtable = &stub_vtable;
+  stub->parent.name = g_strdup_printf ("stub:%u", n_stubs++);
+  stub->parent.ref_count = 1;
+
+  return stub;
+}
+
+static void
+answer_ready (GObject *source, GAsyncResult *result, gpointer user_data)
+{
+  Answer *answer = user_data;
+
+  answer->results = tz_geocoder_lookup_finish (tz_geocoder_get_default (),
+                                               result, &answer->error);
+
+  if (--*answer->n_pending == 0)
+    g_main_loop_quit (answer->loop);
+}
+
+static gboolean
+test_timed_out (gpointer user_data)
+{
+  g_error ("Timed out waiting for the geocoder");
+  return G_SOURCE_REMOVE;
+}
+
+static void
+run_until_answered (GMainLoop *loop, guint *n_pending)
+{
+  guint timeout = g_timeout_add (TEST_TIMEOUT_MS, test_timed_out, NULL);
+
+  if (*n_pending > 0)
+    g_main_loop_run (loop);
+
+  g_source_remove (timeout);
+}
+
+static void
+lookup (TzGeocoderBackend *backend, const gchar *query,
+        GCancellable *cancellable, Answer *answer,
+        GMainLoop *loop, guint *n_pending)
+{
+  answer->loop = loop;
+  answer->n_pending = n_pending;
+  (*n_pending)++;
+
+  tz_geocoder_lookup (tz_geocoder_get_default (), backend, query,
+                      cancellable, answer_ready, answer);
+}
+
+static void
+answer_clear (Answer *answer)
+{
+  if (answer->results)
+    tz_geocoder_results_unref (answer->results);
+  g_clear_error (&answer->error);
+}
+
+static void
+assert_place (Answer *answer, const gchar *name)
+{
+  TzGeoname *place;
+
+  g_assert_no_error (answer->error);
+  g_assert_nonnull (answer->results);
+  g_assert_cmpuint (answer->results->places->len, ==, 1);
+
+  place = g_ptr_array_index (answer->results->places, 0);
+  g_assert_cmpstr (place->name, ==, name);
+}
+
+static void
+test_coalesce (void)
+{
+  StubBackend *stub = stub_backend_new ();
+  GMainLoop *loop = g_main_loop_new (NULL, FALSE);
+  Answer first = { 0, }, second = { 0, }, other = { 0, };
+  guint n_pending = 0;
+
+  lookup (&stub->parent, "London", NULL, &first, loop, &n_pending);
+  lookup (&stub->parent, "London", NULL, &second, loop, &n_pending);
+  lookup (&stub->parent, "Paris", NULL, &other, loop, &n_pending);
+  run_until_answered (loop, &n_pending);
+
+  /* The two Londons share one lookup */
+  g_assert_cmpuint (stub->n_lookups, ==, 2);
+  assert_place (&first, "London");
+  assert_place (&second, "London");
+  assert_place (&other, "Paris");
+  g_assert_true (first.results == second.results);
+
+  /* Once answered, the same query is looked up again */
+  answer_clear (&first);
+  memset (&first, 0, sizeof (first));
+  lookup (&stub->parent, "London", NULL, &first, loop, &n_pending);
+  run_until_answered (loop, &n_pending);
+  g_assert_cmpuint (stub->n_lookups, ==, 3);
+  assert_place (&first, "London");
+
+  answer_clear (&first);
+  answer_clear (&second);
+  answer_clear (&other);
+  g_main_loop_unref (loop);
+  tz_geocoder_backend_unref (&stub->parent);
+}
+
+static void
+test_cancel_one_waiter (void)
+{
+  StubBackend *stub = stub_backend_new ();
+  GMainLoop *loop = g_main_loop_new (NULL, FALSE);
+  GCancellable *cancellable = g_cancellable_new ();
+  Answer cancelled = { 0, }, kept = { 0, };
+  guint n_pending = 0;
+
+  lookup (&stub->parent, "Lima", cancellable, &cancelled, loop, &n_pending);
+  lookup (&stub->parent, "Lima", NULL, &kept, loop, &n_pending);
+  g_cancellable_cancel (cancellable);
+  run_until_answered (loop, &n_pending);
+
+  /* Whoever gave up is told so, and the lookup goes on for the other */
+  g_assert_error (cancelled.error, G_IO_ERROR, G_IO_ERROR_CANCELLED);
+  g_assert_null (cancelled.results);
+  g_assert_cmpuint (stub->n_lookups, ==, 1);
+  g_assert_false (g_cancellable_is_cancelled (stub->cancellable));
+  assert_place (&kept, "Lima");
+
+  answer_clear (&cancelled);
+  answer_clear (&kept);
+  g_object_unref (cancellable);
+  g_main_loop_unref (loop);
+  tz_geocoder_backend_unref (&stub->parent);
+}
+
+static void
+test_cancel_all_waiters (void)
+{
+  StubBackend *stub = stub_backend_new ();
+  GMainLoop *loop = g_main_loop_new (NULL, FALSE);
+  GCancellable *cancellable = g_cancellable_new ();
+  Answer first = { 0, }, second = { 0, }, again = { 0, };
+  guint n_pending = 0;
+
+  lookup (&stub->parent, "Oslo", cancellable, &first, loop, &n_pending);
+  lookup (&stub->parent, "Oslo", cancellable, &second, loop, &n_pending);
+  g_cancellable_cancel (cancellable);
+
+  /* With nobody waiting, the lookup itself is given up, and the same query
+   * starts afresh rather than joining it */
+  g_assert_true (g_cancellable_is_cancelled (stub->cancellable));
+  lookup (&stub->parent, "Oslo", NULL, &again, loop, &n_pending);
+  run_until_answered (loop, &n_pending);
+
+  g_assert_error (first.error, G_IO_ERROR, G_IO_ERROR_CANCELLED);
+  g_assert_error (second.error, G_IO_ERROR, G_IO_ERROR_CANCELLED);
+  g_assert_cmpuint (stub->n_lookups, ==, 2);
+  assert_place (&again, "Oslo");
+
+  answer_clear (&first);
+  answer_clear (&second);
+  answer_clear (&again);
+  g_object_unref (cancellable);
+  g_main_loop_unref (loop);
+  tz_geocoder_backend_unref (&stub->parent);
+}
+
+static void
+test_latency (void)
+{
+  StubBackend *stub = stub_backend_new ();
+  TzGeocoder *geocoder = tz_geocoder_get_default ();
+  GMainLoop *loop = g_main_loop_new (NULL, FALSE);
+  Answer answer = { 0, };
+  guint n_pending = 0;
+
+  g_assert_cmpint (tz_geocoder_get_latency (geocoder, &stub->parent), ==, -1);
+
+  lookup (&stub->parent, "Quito", NULL, &answer, loop, &n_pending);
+  run_until_answered (loop, &n_pending);
+  assert_place (&answer, "Quito");
+
+  g_assert_cmpint (tz_geocoder_get_latency (geocoder, &stub->parent), >=,
+                   STUB_DELAY_MS * G_TIME_SPAN_MILLISECOND);
+
+  answer_clear (&answer);
+  g_main_loop_unref (loop);
+  tz_geocoder_backend_unref (&stub->parent);
+}
+
+static CcTimezoneLocation *
+location_new (const gchar *name, const gchar *state, const gchar *country,
+              gdouble latitude, gdouble longitude)
+{
+  return g_object_new (CC_TYPE_TIMEZONE_LOCATION,
+                       "en_name", name,
+                       "state", state,
+                       "full_country", country,
+                       "latitude", latitude,
+                       "longitude", longitude,
+                       NULL);
+}
+
+static void
+test_local (void)
+{
+  GPtrArray *locations = g_ptr_array_new_with_free_func (g_object_unref);
+  GMainLoop *loop = g_main_loop_new (NULL, FALSE);
+  Answer found = { 0, }, cut = { 0, };
+  TzGeocoderBackend *backend, *short_backend;
+  TzSearch *search;
+  TzGeoname *place;
+  guint n_pending = 0;
+
+  g_ptr_array_add (locations, location_new ("Wellington", "Wellington",
+                                            "New Zealand", -41.3, 174.8));
+  g_ptr_array_add (locations, location_new ("Lima", "Lima", "Peru",
+                                            -12.0, -77.0));
+  g_ptr_array_add (locations, location_new ("Oslo", "Oslo", "Norway",
+                                            59.9, 10.7));
+  search = tz_search_new (locations);
+
+  backend = tz_geocoder_backend_new_local (search, 5);
+  short_backend = tz_geocoder_backend_new_local (search, 1);
+
+  lookup (backend, "welling", NULL, &found, loop, &n_pending);
+  lookup (short_backend, "welling", NULL, &cut, loop, &n_pending);
+  run_until_answered (loop, &n_pending);
+
+  assert_place (&found, "Wellington");
+  place = g_ptr_array_index (found.results->places, 0);
+  g_assert_cmpstr (place->country, ==, "New Zealand");
+  g_assert_cmpfloat (g_ascii_strtod (place->latitude, NULL), ==, -41.3);
+
+  /* Backends with different limits do not share lookups, and one that may
+   * have left places out says so */
+  g_assert_true (found.results->complete);
+  assert_place (&cut, "Wellington");
+  g_assert_false (cut.results->complete);
+
+  answer_clear (&found);
+  answer_clear (&cut);
+  tz_geocoder_backend_unref (short_backend);
+  tz_geocoder_backend_unref (backend);
+  tz_search_free (search);
+  g_ptr_array_unref (locations);
+  g_main_loop_unref (loop);
+}
+
+static void
+server_callback (SoupServer *server, SoupMessage *msg, const char *path,
+                 GHashTable *query, SoupClientContext *client,
+                 gpointer user_data)
+{
+  guint *n_requests = user_data;
+  const gchar *name = query ? g_hash_table_lookup (query, "query") : NULL;
+  gchar *body;
+
+  (*n_requests)++;
+
+  body = g_strdup_printf ("[{\"name\": \"%s\", \"admin1\": \"Somewhere\", "
+                          "\"country\": \"Nowhere\", \"longitude\": \"1.0\", "
+                          "\"latitude\": \"2.0\", \"extra\": [1, {\"a\": 2}]}]",
+                          name ? name : "");
+
+  soup_message_set_status (msg, SOUP_STATUS_OK);
+  soup_message_set_response (msg, "application/json", SOUP_MEMORY_TAKE,
+                             body, strlen (body));
+}
+
+static void
+test_http (void)
+{
+  TzGeocoder *geocoder = tz_geocoder_get_default ();
+  GMainLoop *loop = g_main_loop_new (NULL, FALSE);
+  Answer first = { 0, }, second = { 0, };
+  TzGeocoderBackend *backend;
+  GError *error = NULL;
+  SoupServer *server;
+  GSList *uris;
+  gchar *base, *prefix;
+  guint n_requests = 0, n_pending = 0;
+  TzGeoname *place;
+
+  server = soup_server_new (NULL);
+  soup_server_add_handler (server, NULL, server_callback, &n_requests, NULL);
+  soup_server_listen_local (server, 0, SOUP_SERVER_LISTEN_IPV4_ONLY, &error);
+  g_assert_no_error (error);
+
+  uris = soup_server_get_uris (server);
+  g_assert_nonnull (uris);
+  base = soup_uri_to_string (uris->data, FALSE);
+  g_slist_free_full (uris, (GDestroyNotify) soup_uri_free);
+
+  prefix = g_strdup_printf ("%s?query=", base);
+  backend = tz_geocoder_backend_new_http (prefix, "&release=test", 10);
+
+  g_assert_cmpint (tz_geocoder_get_latency (geocoder, backend), ==, -1);
+
+  lookup (backend, "Tromsø", NULL, &first, loop, &n_pending);
+  lookup (backend, "Tromsø", NULL, &second, loop, &n_pending);
+  run_until_answered (loop, &n_pending);
+
+  /* Both were answered by one request, and the query made it there and
+   * back intact */
+  g_assert_cmpuint (n_requests, ==, 1);
+  assert_place (&first, "Tromsø");
+  assert_place (&second, "Tromsø");
+
+  place = g_ptr_array_index (first.results->places, 0);
+  g_assert_cmpstr (place->admin1, ==, "Somewhere");
+  g_assert_cmpstr (place->country, ==, "Nowhere");
+  g_assert_cmpstr (place->longitude, ==, "1.0");
+  g_assert_cmpstr (place->latitude, ==, "2.0");
+  g_assert_true (first.results->complete);
+
+  g_assert_cmpint (tz_geocoder_get_latency (geocoder, backend), >=, 0);
+
+  answer_clear (&first);
+  answer_clear (&second);
+  tz_geocoder_backend_unref (backend);
+  g_free (prefix);
+  g_free (base);
+  soup_server_disconnect (server);
+  g_object_unref (server);
+  g_main_loop_unref (loop);
+}
+
+int
+main (int argc, char **argv)
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/geocoder/coalesce", test_coalesce);
+  g_test_add_func ("/geocoder/cancel-one-waiter", test_cancel_one_waiter);
+  g_test_add_func ("/geocoder/cancel-all-waiters", test_cancel_all_waiters);
+  g_test_add_func ("/geocoder/latency", test_latency);
+  g_test_add_func ("/geocoder/local", test_local);
+  g_test_add_func ("/geocoder/http", test_http);
+
+  return g_test_run ();
+}
@@ -0,0 +1,333 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+/* Checks that drawing the map does not touch the filesystem once it is up.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* The C library's fortified open() is an inline wrapper, which would clash
+ * with the counting one below */
+#undef _FORTIFY_SOURCE
+#undef _FILE_OFFSET_BITS
+#define _GNU_SOURCE
+
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib/gstdio.h>
+#include <gtk/gtk.h>
+#include "cc-timezone-map.h"
+
+#define N_DRAWS 100
+
+/* Two places with the same offset and no daylight saving time */
+#define PIN_ZONE "Asia/Tokyo"
+#define OTHER_PIN_ZONE "Asia/Seoul"
+
+/* How long to let the main loop run between looks at the map, how many
+ * looks in a row must agree before it counts as rendered, and how long to
+ * wait at most */
+#define SETTLE_MS 200
+#define N_SETTLED_DRAWS 2
+#define TEST_TIMEOUT_MS 30000
+
+/* The program is linked with -export-dynamic, so these stand in for the C
+ * library's own for every library in the process. Only the main thread,
+ * where drawing happens, is counted; the map renders in other threads. */
+static __thread gboolean count_opens = FALSE;
+static guint n_opens = 0;
+
+#ifdef O_TMPFILE
+#define OPEN_HAS_MODE(flags) (((flags) & O_CREAT) || ((flags) & O_TMPFILE) == O_TMPFILE)
+#else
+#define OPEN_HAS_MODE(flags) ((flags) & O_CREAT)
+#endif
+
+#define OPEN_MODE(flags, mode)                  \
+  if (OPEN_HAS_MODE (flags))                    \
+    {                                           \
+      va_list args;                             \
+      va_start (args, flags);                   \
+      mode = va_arg (args, int);                \
+      va_end (args);                            \
+    }
+
+static gpointer
+lookup_real (const gchar *name)
+{
+  if (count_opens)
+    n_opens++;
+
+  return dlsym (RTLD_NEXT, name);
+}
+
+int
+open (const char *path, int flags, ...)
+{
+  int (*real) (const char *, int, ...) = lookup_real ("open");
+  int mode = 0;
+
+  OPEN_MODE (flags, mode);
+  return real (path, flags, mode);
+}
+
+int
+open64 (const char *path, int flags, ...)
+{
+  int (*real) (const char *, int, ...) = lookup_real ("open64");
+  int mode = 0;
+
+  OPEN_MODE (flags, mode);
+  return real (path, flags, mode);
+}
+
+int
+openat (int dirfd, const char *path, int flags, ...)
+{
+  int (*real) (int, const char *, int, ...) = lookup_real ("openat");
+  int mode = 0;
+
+  OPEN_MODE (flags, mode);
+  return real (dirfd, path, flags, mode);
+}
+
+int
+openat64 (int dirfd, const char *path, int flags, ...)
+{
+  int (*real) (int, const char *, int, ...) = lookup_real ("openat64");
+  int mode = 0;
+
+  OPEN_MODE (flags, mode);
+  return real (dirfd, path, flags, mode);
+}
+
+/* What fortified callers use instead of open() */
+int
+__open_2 (const char *path, int flags)
+{
+  int (*real) (const char *, int) = lookup_real ("__open_2");
+
+  return real (path, flags);
+}
+
+int
+__open64_2 (const char *path, int flags)
+{
+  int (*real) (const char *, int) = lookup_real ("__open64_2");
+
+  return real (path, flags);
+}
+
+/* fopen() opens the file inside the C library, out of reach of open() */
+FILE *
+fopen (const char *path, const char *mode)
+{
+  FILE *(*real) (const char *, const char *) = lookup_real ("fopen");
+
+  return real (path, mode);
+}
+
+FILE *
+fopen64 (const char *path, const char *mode)
+{
+  FILE *(*real) (const char *, const char *) = lookup_real ("fopen64");
+
+  return real (path, mode);
+}
+
+static void
+remove_tree (const gchar *path)
+{
+  GDir *dir = g_dir_open (path, 0, NULL);
+  const gchar *name;
+
+  if (dir)
+    {
+      while ((name = g_dir_read_name (dir)) != NULL)
+        {
+          gchar *child = g_build_filename (path, name, NULL);
+
+          remove_tree (child);
+          g_free (child);
+        }
+      g_dir_close (dir);
+    }
+
+  g_remove (path);
+}
+
+static void
+draw_map (GtkWidget *map, cairo_surface_t *surface)
+{
+  cairo_t *cr = cairo_create (surface);
+
+  gtk_widget_draw (map, cr);
+  cairo_destroy (cr);
+  cairo_surface_flush (surface);
+}
+
+static gboolean
+set_flag (gpointer user_data)
+{
+  *(gboolean *) user_data = TRUE;
+  return G_SOURCE_REMOVE;
+}
+
+static void
+run_for (guint ms)
+{
+  gboolean done = FALSE;
+
+  g_timeout_add (ms, set_flag, &done);
+  while (!done)
+    g_main_context_iteration (NULL, TRUE);
+}
+
+/* Whether more of the surface is painted than the background colour and the
+ * pin would cover */
+static gboolean
+shows_map (cairo_surface_t *surface)
+{
+  guchar *data = cairo_image_surface_get_data (surface);
+  gint width = cairo_image_surface_get_width (surface);
+  gint height = cairo_image_surface_get_height (surface);
+  gint stride = cairo_image_surface_get_stride (surface);
+  guint32 background = *(guint32 *) data;
+  guint n_painted = 0;
+  gint x, y;
+
+  for (y = 0; y < height; y++)
+    {
+      guint32 *row = (guint32 *) (data + y * stride);
+
+      for (x = 0; x < width; x++)
+        if (row[x] != background)
+          n_painted++;
+    }
+
+  return n_painted > (guint) (width * height) / 20;
+}
+
+/* The map is rendered in other threads once its size has settled, and each
+ * draw shows as much of it as is ready. It is taken to be done once it is
+ * there and a few draws in a row come out the same. */
+static void
+wait_for_map (GtkWidget *map, cairo_surface_t *surface)
+{
+  gsize size = cairo_image_surface_get_stride (surface) *
+               cairo_image_surface_get_height (surface);
+  gint64 deadline = g_get_monotonic_time () + TEST_TIMEOUT_MS * 1000;
+  guchar *previous = g_malloc0 (size);
+  guint n_same = 0;
+
+  while (n_same < N_SETTLED_DRAWS)
+    {
+      if (g_get_monotonic_time () > deadline)
+        {
+          g_printerr ("Timed out waiting for the map to render\n");
+          exit (1);
+        }
+
+      run_for (SETTLE_MS);
+      draw_map (map, surface);
+
+      if (shows_map (surface) &&
+          memcmp (previous, cairo_image_surface_get_data (surface), size) == 0)
+        n_same++;
+      else
+        n_same = 0;
+
+      memcpy (previous, cairo_image_surface_get_data (surface), size);
+    }
+
+  g_free (previous);
+}
+
+int
+main (int argc, char **argv)
+{
+  GtkWidget *window, *map;
+  cairo_surface_t *surface;
+  guchar *first_pin;
+  gchar *cache_dir;
+  guint first_opens;
+  gboolean pin_moved;
+  gsize size;
+  gint i;
+
+  /* Keep rendered maps out of the user's cache */
+  cache_dir = g_dir_make_tmp ("test-map-opens-XXXXXX", NULL);
+  g_setenv ("XDG_CACHE_HOME", cache_dir, TRUE);
+
+  if (!gtk_init_check (&argc, &argv))
+    {
+      g_print ("SKIP: no display\n");
+      remove_tree (cache_dir);
+      return 77;
+    }
+
+  window = gtk_offscreen_window_new ();
+  gtk_window_set_default_size (GTK_WINDOW (window), 800, 400);
+  map = GTK_WIDGET (cc_timezone_map_new ());
+  gtk_container_add (GTK_CONTAINER (window), map);
+  gtk_widget_show_all (window);
+
+  /* Let the window be laid out, so the map has its size */
+  run_for (SETTLE_MS);
+
+  surface = cairo_image_surface_create (CAIRO_FORMAT_ARGB32,
+                                        gtk_widget_get_allocated_width (map),
+                                        gtk_widget_get_allocated_height (map));
+  size = cairo_image_surface_get_stride (surface) *
+         cairo_image_surface_get_height (surface);
+
+  count_opens = TRUE;
+
+  /* Setting the location and the first draws may load the pin icon, and the
+   * map is rendered meanwhile */
+  cc_timezone_map_set_timezone (CC_TIMEZONE_MAP (map), PIN_ZONE);
+  wait_for_map (map, surface);
+  first_opens = n_opens;
+
+  for (i = 0; i < N_DRAWS; i++)
+    draw_map (map, surface);
+
+  count_opens = FALSE;
+
+  g_print ("%u files opened while the map came up, %u by the next %d draws\n",
+           first_opens, n_opens - first_opens, N_DRAWS);
+
+  /* Both zones have the same offset, so only the pin tells them apart. If
+   * the icon failed to load, nothing moves. */
+  first_pin = g_malloc (size);
+  memcpy (first_pin, cairo_image_surface_get_data (surface), size);
+  cc_timezone_map_set_timezone (CC_TIMEZONE_MAP (map), OTHER_PIN_ZONE);
+  wait_for_map (map, surface);
+  pin_moved = memcmp (first_pin, cairo_image_surface_get_data (surface), size) != 0;
+
+  if (!pin_moved)
+    g_printerr ("The pin was not drawn\n");
+
+  g_free (first_pin);
+  cairo_surface_destroy (surface);
+  gtk_widget_destroy (window);
+  remove_tree (cache_dir);
+  g_free (cache_dir);
+
+  return pin_moved && n_opens == first_opens ? 0 : 1;
+}
@@ -22,18 +22,25 @@ with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "config.h"
 #endif
 
-#include <json-glib/json-glib.h>
 #include <gdk/gdk.h>
 #include <gdk/gdkkeysyms.h>
 #include <glib/gi18n.h>
-#include <libsoup/soup.h>
 #include "timezone-completion.h"
 #include "tz.h"
+#include "tz-cache.h"
+#include "tz-geocoder.h"
+#include "tz-search.h"
 
 enum {
   LAST_SIGNAL
 };
 
+enum {
+  PROP_0,
+  PROP_REMOTE_LOOKUP,
+  PROP_MAX_GEONAME_RESULTS,
+};
+
 /* static guint signals[LAST_SIGNAL] = { }; */
 
 struct _CcTimezoneCompletionPrivate
@@ -46,16 +53,105 @@ struct _CcTimezoneCompletionPrivate
   GCancellable * cancel;
   gchar *        request_text;
   GHashTable *   request_table;
-  SoupSession *  soup_session;
+  GQueue *       request_lru;
+  gsize          request_bytes;
+  TzDB *         tzdb;
+  TzSearch *     search;
+  gboolean       remote_lookup;
+  guint          max_geoname_results;
+  GtkTreeModel * local_model;
+  gchar *        local_text;
+  gboolean       poking;
+  gint64         last_change;
+  gint64         typing_interval;
+  TzGeocoderBackend * geocoder_backend;
 };
 
-#define GEONAME_URL "http://geoname-lookup.ubuntu.com/?query=%s&release=%s&lang=%s"
+#define GEONAME_SERVER "http://geoname-lookup.ubuntu.com/"
+#define GEONAME_URL_QUERY "?query="
+#define GEONAME_URL_SUFFIX "&release=%s&lang=%s"
+
+/* Most places to offer in the popup */
+#define RESULTS_MAX 50
+
+/* The geoname server answers with at most a page of places, so a shorter
+   answer left nothing out */
+#define GEONAME_PAGE_SIZE 10
+
+/* Most places to read from a geoname answer, unless told otherwise */
+#define GEONAME_RESULTS_DEFAULT 100
+
+/* The geoname server is asked once the user seems to have paused, judging
+   by how fast they type, and early by half its usual answer time, within
+   these bounds in milliseconds. Keys further apart than a second are
+   pauses, not typing. */
+#define DEBOUNCE_MIN 150
+#define DEBOUNCE_MAX 600
+#define TYPING_PAUSE G_TIME_SPAN_SECOND
+#define TYPING_INTERVAL_DEFAULT (250 * G_TIME_SPAN_MILLISECOND)
+#define LATENCY_DEFAULT (300 * G_TIME_SPAN_MILLISECOND)
+
+/* Roughly how much memory the cached results may take up */
+#define CACHE_BUDGET (256 * 1024)
+
+/* Roughly what a row of a GtkListStore costs beyond its strings */
+#define CACHE_ROW_SIZE 96
+
+/* Geoname answers are also kept on disk, for a week */
+#define GEONAME_CACHE_DIR "geonames"
+#define GEONAME_CACHE_MAX_SIZE (4 * 1024 * 1024)
+#define GEONAME_CACHE_MAGIC "TZGEONAM"
+#define GEONAME_CACHE_TTL (7 * G_TIME_SPAN_DAY)
+
+/* An entry on disk is this header, then for each place the offsets of its
+   name, admin1, country, longitude and latitude, then the strings they point
+   into, each NUL terminated */
+typedef struct
+{
+  gchar   magic[8];
+  guint32 byte_order;
+  guint32 n_results;
+  gint64  created;
+  guint32 complete;
+  guint32 reserved;
+} GeonameCacheHeader;
+
+#define GEONAME_CACHE_FIELDS 5
+#define GEONAME_CACHE_NULL G_MAXUINT32
+
+/* The places the geoname server gave for some text. They are complete when
+   no place was left out, so that the places for longer text can be picked
+   out of them. Places from the local database are never kept here, as they
+   match in more ways than picking by name could follow; they are searched
+   for afresh and the cached places merged in after them. */
+typedef struct
+{
+  gchar *        text;
+  GtkTreeModel * model;
+  gsize          size;
+  gboolean       complete;
+} CachedModel;
+
+/* A place from the geoname server, with what it sorts by worked out once */
+typedef struct
+{
+  const gchar * name;
+  const gchar * admin1;
+  const gchar * country;
+  const gchar * longitude;
+  const gchar * latitude;
+  gboolean      matches;
+  gchar *       sort_key;
+} GeonameResult;
 
 /* Prototypes */
 static void cc_timezone_completion_class_init (CcTimezoneCompletionClass *klass);
 static void cc_timezone_completion_init       (CcTimezoneCompletion *self);
 static void cc_timezone_completion_dispose    (GObject *object);
 static void cc_timezone_completion_finalize   (GObject *object);
+static gchar * get_locale                     (void);
+static const gchar * get_version              (void);
+static gboolean request_zones                 (CcTimezoneCompletion *completion);
 
 G_DEFINE_TYPE (CcTimezoneCompletion, cc_timezone_completion, GTK_TYPE_ENTRY_COMPLETION);
 
@@ -67,12 +163,194 @@ match_func (GtkEntryCompletion *completion, const gchar *key,
   return TRUE;
 }
 
+static GtkListStore *
+new_store (void)
+{
+  return gtk_list_store_new (CC_TIMEZONE_COMPLETION_LAST,
+                             G_TYPE_STRING,
+                             G_TYPE_STRING,
+                             G_TYPE_STRING,
+                             G_TYPE_STRING,
+                             G_TYPE_STRING,
+                             G_TYPE_STRING);
+}
+
 static void
-save_and_use_model (CcTimezoneCompletion * completion, GtkTreeModel * model)
+cached_model_free (CachedModel * cached)
+{
+  g_free (cached->text);
+  g_object_unref (cached->model);
+  g_slice_free (CachedModel, cached);
+}
+
+static gsize
+get_model_size (GtkTreeModel * model)
+{
+  GtkTreeIter iter;
+  gsize size = 0;
+
+  if (!gtk_tree_model_get_iter_first (model, &iter))
+    return 0;
+
+  do
+    {
+      gint column;
+
+      size += CACHE_ROW_SIZE;
+      for (column = 0; column < CC_TIMEZONE_COMPLETION_LAST; ++column)
+        {
+          gchar * value = NULL;
+          gtk_tree_model_get (model, &iter, column, &value, -1);
+          if (value != NULL)
+            size += strlen (value) + 1;
+          g_free (value);
+        }
+    }
+  while (gtk_tree_model_iter_next (model, &iter));
+
+  return size;
+}
+
+/* Remembers model as the places for text, forgetting the places least
+   recently used to stay within budget */
+static void
+cache_model (CcTimezoneCompletion * completion, const gchar * text,
+             GtkTreeModel * model, gboolean complete)
+{
+  CcTimezoneCompletionPrivate * priv = completion->priv;
+  GList * link = g_hash_table_lookup (priv->request_table, text);
+  CachedModel * cached;
+
+  if (link != NULL)
+    {
+      cached = link->data;
+      priv->request_bytes -= cached->size;
+      g_hash_table_remove (priv->request_table, text);
+      g_queue_delete_link (priv->request_lru, link);
+      cached_model_free (cached);
+    }
+
+  cached = g_slice_new (CachedModel);
+  cached->text = g_strdup (text);
+  cached->model = g_object_ref (model);
+  cached->complete = complete;
+  cached->size = get_model_size (model);
+
+  g_queue_push_head (priv->request_lru, cached);
+  g_hash_table_insert (priv->request_table, cached->text, priv->request_lru->head);
+  priv->request_bytes += cached->size;
+
+  while (priv->request_bytes > CACHE_BUDGET && priv->request_lru->length > 1)
+    {
+      cached = g_queue_pop_tail (priv->request_lru);
+      priv->request_bytes -= cached->size;
+      g_hash_table_remove (priv->request_table, cached->text);
+      cached_model_free (cached);
+    }
+}
+
+static CachedModel *
+lookup_model (CcTimezoneCompletion * completion, const gchar * text)
+{
+  CcTimezoneCompletionPrivate * priv = completion->priv;
+  GList * link = g_hash_table_lookup (priv->request_table, text);
+
+  if (link == NULL)
+    return NULL;
+
+  g_queue_unlink (priv->request_lru, link);
+  g_queue_push_head_link (priv->request_lru, link);
+
+  return link->data;
+}
+
+/* Picks the geoname places for text out of the complete places for the
+   longest text it starts with, if we have them */
+static GtkTreeModel *
+filter_cached_model (CcTimezoneCompletion * completion, const gchar * text)
 {
   CcTimezoneCompletionPrivate * priv = completion->priv;
+  gchar * prefix = g_strdup (text);
+  gchar * end = prefix + strlen (prefix);
+  CachedModel * cached = NULL;
+
+  while (end > prefix)
+    {
+      end = g_utf8_prev_char (end);
+      *end = 0;
+      if (*prefix == 0)
+        break;
+
+      GList * link = g_hash_table_lookup (priv->request_table, prefix);
+      if (link != NULL)
+        {
+          cached = link->data;
+          if (cached->complete)
+            {
+              lookup_model (completion, prefix);
+              break;
+            }
+        }
+      cached = NULL;
+    }
+  g_free (prefix);
+
+  if (cached == NULL)
+    return NULL;
+
+  /* The superset was sorted with its matches first, so whatever still
+     matches stays in order */
+  gchar * casefolded_text = g_utf8_casefold (text, -1);
+  GtkListStore * store = new_store ();
+  GtkTreeIter iter;
+
+  if (gtk_tree_model_get_iter_first (cached->model, &iter))
+    {
+      do
+        {
+          gchar * zone, * name, * admin1, * country, * longitude, * latitude;
+          gtk_tree_model_get (cached->model, &iter,
+                              CC_TIMEZONE_COMPLETION_ZONE, &zone,
+                              CC_TIMEZONE_COMPLETION_NAME, &name,
+                              CC_TIMEZONE_COMPLETION_ADMIN1, &admin1,
+                              CC_TIMEZONE_COMPLETION_COUNTRY, &country,
+                              CC_TIMEZONE_COMPLETION_LONGITUDE, &longitude,
+                              CC_TIMEZONE_COMPLETION_LATITUDE, &latitude,
+                              -1);
+
+          gchar * casefolded_name = g_utf8_casefold (name ? name : "", -1);
+          if (g_str_has_prefix (casefolded_name, casefolded_text))
+            {
+              GtkTreeIter new_iter;
+              gtk_list_store_insert_with_values (store, &new_iter, -1,
+                                                 CC_TIMEZONE_COMPLETION_ZONE, zone,
+                                                 CC_TIMEZONE_COMPLETION_NAME, name,
+                                                 CC_TIMEZONE_COMPLETION_ADMIN1, admin1,
+                                                 CC_TIMEZONE_COMPLETION_COUNTRY, country,
+                                                 CC_TIMEZONE_COMPLETION_LONGITUDE, longitude,
+                                                 CC_TIMEZONE_COMPLETION_LATITUDE, latitude,
+                                                 -1);
+            }
+
+          g_free (casefolded_name);
+          g_free (latitude);
+          g_free (longitude);
+          g_free (country);
+          g_free (admin1);
+          g_free (name);
+          g_free (zone);
+        }
+      while (gtk_tree_model_iter_next (cached->model, &iter));
+    }
+
+  g_free (casefolded_text);
+  return GTK_TREE_MODEL (store);
+}
 
-  g_hash_table_insert (priv->request_table, g_strdup (priv->request_text), g_object_ref_sink (model));
+static void
+use_model (CcTimezoneCompletion * completion, GtkTreeModel * model)
+{
+  CcTimezoneCompletionPrivate * priv = completion->priv;
 
   if (model == priv->initial_model)
     gtk_entry_completion_set_match_func (GTK_ENTRY_COMPLETION (completion), NULL, NULL, NULL);
@@ -80,6 +358,28 @@ save_and_use_model (CcTimezoneCompletion * completion, GtkTreeModel * model)
     gtk_entry_completion_set_match_func (GTK_ENTRY_COMPLETION (completion), match_func, NULL, NULL);
 
   gtk_entry_completion_set_model (GTK_ENTRY_COMPLETION (completion), model);
+}
+
+/* Remembers model, which has the local places for text, as the one that
+   geoname places for text can be added to. Takes the reference. */
+static void
+set_local_model (CcTimezoneCompletion * completion, const gchar * text,
+                 GtkTreeModel * model)
+{
+  CcTimezoneCompletionPrivate * priv = completion->priv;
+
+  g_clear_object (&priv->local_model);
+  g_free (priv->local_text);
+  priv->local_model = model;
+  priv->local_text = g_strdup (text);
+}
+
+static void
+show_model (CcTimezoneCompletion * completion, GtkTreeModel * model)
+{
+  CcTimezoneCompletionPrivate * priv = completion->priv;
+
+  use_model (completion, model);
 
   if (priv->entry != NULL) {
     gtk_entry_completion_complete (GTK_ENTRY_COMPLETION (completion));
@@ -87,121 +387,438 @@ save_and_use_model (CcTimezoneCompletion * completion, GtkTreeModel * model)
     /* By this time, the changed signal has come and gone.  We didn't give a
        model to use, so no popup appeared for user.  Poke the entry again to show
        popup in 300ms. */
+    priv->poking = TRUE;
     g_signal_emit_by_name (priv->entry, "changed");
+    priv->poking = FALSE;
   }
 }
 
-static gint
-sort_zone (GtkTreeModel *model, GtkTreeIter *a, GtkTreeIter *b,
-           gpointer user_data)
-{
-  /* Anything that has text as a prefix goes first, in mostly sorted order.
-     Then everything else goes after, in mostly sorted order. */
-  const gchar *casefolded_text = (const gchar *)user_data;
-
-  const gchar *namea = NULL, *nameb = NULL;
-  gtk_tree_model_get (model, a, CC_TIMEZONE_COMPLETION_NAME, &namea, -1);
-  gtk_tree_model_get (model, b, CC_TIMEZONE_COMPLETION_NAME, &nameb, -1);
-
-  gchar *casefolded_namea = NULL, *casefolded_nameb = NULL;
-  casefolded_namea = g_utf8_casefold (namea, -1);
-  casefolded_nameb = g_utf8_casefold (nameb, -1);
-
-  gboolean amatches = FALSE, bmatches = FALSE;
-  amatches = strncmp (casefolded_text, casefolded_namea, strlen(casefolded_text)) == 0;
-  bmatches = strncmp (casefolded_text, casefolded_nameb, strlen(casefolded_text)) == 0;
-
-  gint rv;
-  if (amatches && !bmatches)
-    rv = -1;
-  else if (bmatches && !amatches)
-    rv = 1;
-  else
-    rv = g_utf8_collate (casefolded_namea, casefolded_nameb);
+static gchar *
+get_place_key (const gchar * name, const gchar * country)
+{
+  gchar * joined = g_strjoin ("\n", name ? name : "", country ? country : "", NULL);
+  gchar * key = g_utf8_casefold (joined, -1);
+  g_free (joined);
+  return key;
+}
+
+/* Appends the places in store that local doesn't have yet to it, leaving
+   the rows the user may be looking at alone. Returns whether local was
+   empty before. */
+static gboolean
+merge_model (GtkTreeModel * local, GtkTreeModel * store)
+{
+  GHashTable * keys = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  GtkTreeIter iter;
+  gint n_rows = 0;
+
+  if (gtk_tree_model_get_iter_first (local, &iter))
+    {
+      do
+        {
+          gchar * name = NULL, * country = NULL;
+          gtk_tree_model_get (local, &iter,
+                              CC_TIMEZONE_COMPLETION_NAME, &name,
+                              CC_TIMEZONE_COMPLETION_COUNTRY, &country,
+                              -1);
+          g_hash_table_add (keys, get_place_key (name, country));
+          g_free (country);
+          g_free (name);
+          n_rows++;
+        }
+      while (gtk_tree_model_iter_next (local, &iter));
+    }
+
+  gboolean was_empty = n_rows == 0;
+
+  if (gtk_tree_model_get_iter_first (store, &iter))
+    {
+      do
+        {
+          gchar * zone, * name, * admin1, * country, * longitude, * latitude;
+          gtk_tree_model_get (store, &iter,
+                              CC_TIMEZONE_COMPLETION_ZONE, &zone,
+                              CC_TIMEZONE_COMPLETION_NAME, &name,
+                              CC_TIMEZONE_COMPLETION_ADMIN1, &admin1,
+                              CC_TIMEZONE_COMPLETION_COUNTRY, &country,
+                              CC_TIMEZONE_COMPLETION_LONGITUDE, &longitude,
+                              CC_TIMEZONE_COMPLETION_LATITUDE, &latitude,
+                              -1);
+
+          gchar * key = get_place_key (name, country);
+          if (!g_hash_table_contains (keys, key))
+            {
+              GtkTreeIter new_iter;
+              gtk_list_store_insert_with_values (GTK_LIST_STORE (local), &new_iter, -1,
+                                                 CC_TIMEZONE_COMPLETION_ZONE, zone,
+                                                 CC_TIMEZONE_COMPLETION_NAME, name,
+                                                 CC_TIMEZONE_COMPLETION_ADMIN1, admin1,
+                                                 CC_TIMEZONE_COMPLETION_COUNTRY, country,
+                                                 CC_TIMEZONE_COMPLETION_LONGITUDE, longitude,
+                                                 CC_TIMEZONE_COMPLETION_LATITUDE, latitude,
+                                                 -1);
+              g_hash_table_add (keys, key);
+              n_rows++;
+            }
+          else
+            {
+              g_free (key);
+            }
+
+          g_free (latitude);
+          g_free (longitude);
+          g_free (country);
+          g_free (admin1);
+          g_free (name);
+          g_free (zone);
+        }
+      while (n_rows < RESULTS_MAX && gtk_tree_model_iter_next (store, &iter));
+    }
 
-  g_free (casefolded_namea);
-  g_free (casefolded_nameb);
-  return rv;
+  g_hash_table_destroy (keys);
+  return was_empty;
 }
 
+/* Offer UTC itself when the user is typing it */
 static void
-json_parse_ready (GObject *object, GAsyncResult *res, gpointer user_data)
+append_utc (GtkListStore * store, const gchar * text)
+{
+  if (strlen (text) < 4)
+    {
+      gchar * lower_text = g_ascii_strdown (text, -1);
+      if (g_strcmp0 (lower_text, "ut") == 0 ||
+          g_strcmp0 (lower_text, "utc") == 0)
+        {
+           GtkTreeIter iter;
+           gtk_list_store_append (store, &iter);
+           gtk_list_store_set (store, &iter,
+                               CC_TIMEZONE_COMPLETION_ZONE, "UTC",
+                                CC_TIMEZONE_COMPLETION_NAME, "UTC",
+                               -1);
+        }
+      g_free (lower_text);
+    }
+}
+
+/* Searches the timezone database, without going to the network */
+static GtkTreeModel *
+search_local (CcTimezoneCompletion * completion, const gchar * text)
 {
-  CcTimezoneCompletion * completion = CC_TIMEZONE_COMPLETION (user_data);
   CcTimezoneCompletionPrivate * priv = completion->priv;
-  GError * error = NULL;
-  const gchar * prev_name = NULL;
-  const gchar * prev_admin1 = NULL;
-  const gchar * prev_country = NULL;
+  GtkListStore * store = new_store ();
+  GPtrArray * results = tz_search_query (priv->search, text, RESULTS_MAX);
+  guint i;
+
+  for (i = 0; i < results->len; ++i)
+    {
+      CcTimezoneLocation * loc = g_ptr_array_index (results, i);
+      GtkTreeIter iter;
 
-  json_parser_load_from_stream_finish (JSON_PARSER (object), res, &error);
+      gchar * longitude_s = g_strdup_printf ("%f", cc_timezone_location_get_longitude (loc));
+      gchar * latitude_s = g_strdup_printf ("%f", cc_timezone_location_get_latitude (loc));
 
-  if (error != NULL) 
+      gtk_list_store_append (store, &iter);
+      gtk_list_store_set (store, &iter,
+                          CC_TIMEZONE_COMPLETION_ZONE, cc_timezone_location_get_zone (loc),
+                          CC_TIMEZONE_COMPLETION_NAME, cc_timezone_location_get_en_name (loc),
+                          CC_TIMEZONE_COMPLETION_ADMIN1, cc_timezone_location_get_state (loc),
+                          CC_TIMEZONE_COMPLETION_COUNTRY, cc_timezone_location_get_full_country (loc),
+                          CC_TIMEZONE_COMPLETION_LONGITUDE, longitude_s,
+                          CC_TIMEZONE_COMPLETION_LATITUDE, latitude_s,
+                          -1);
+
+      g_free (latitude_s);
+      g_free (longitude_s);
+    }
+  g_ptr_array_unref (results);
+
+  append_utc (store, text);
+
+  return GTK_TREE_MODEL (store);
+}
+
+/* When the geoname server can't be used, stay with what the local search
+   found, if anything */
+static void
+show_fallback_model (CcTimezoneCompletion * completion)
+{
+  CcTimezoneCompletionPrivate * priv = completion->priv;
+  GtkTreeModel * local = search_local (completion, priv->request_text);
+
+  if (gtk_tree_model_iter_n_children (local, NULL) > 0)
+    show_model (completion, local);
+  else
+    show_model (completion, priv->initial_model);
+
+  g_object_unref (local);
+}
+
+static void
+clear_result (GeonameResult * result)
+{
+  g_free (result->sort_key);
+}
+
+static gint
+compare_results (gconstpointer a, gconstpointer b)
+{
+  /* Anything that has text as a prefix goes first, in sorted order.
+     Then everything else goes after, in sorted order. */
+  const GeonameResult * ra = a;
+  const GeonameResult * rb = b;
+
+  if (ra->matches != rb->matches)
+    return ra->matches ? -1 : 1;
+
+  return strcmp (ra->sort_key, rb->sort_key);
+}
+
+/* Moves the first k results in sorted order to the front, in any order, so
+   only they need sorting */
+static void
+select_results (GArray * results, guint k)
+{
+  GeonameResult * r = (GeonameResult *) results->data;
+  guint left = 0, right = results->len - 1;
+
+  while (left < right)
     {
-      if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
-        save_and_use_model (completion, priv->initial_model);
-      g_warning ("Could not parse geoname JSON data: %s", error->message);
-      g_error_free (error);
-      return;
+      GeonameResult pivot = r[left + (right - left) / 2];
+      guint i = left, j = right;
+
+      while (i <= j)
+        {
+          while (compare_results (&r[i], &pivot) < 0)
+            i++;
+          while (compare_results (&r[j], &pivot) > 0)
+            j--;
+          if (i <= j)
+            {
+              GeonameResult tmp = r[i];
+              r[i] = r[j];
+              r[j] = tmp;
+              i++;
+              if (j == 0)
+                break;
+              j--;
+            }
+        }
+
+      if (k <= j)
+        right = j;
+      else if (k >= i)
+        left = i;
+      else
+        break;
     }
+}
+
+static gchar *
+get_geoname_cache_key (const gchar * text)
+{
+  gchar * locale = get_locale ();
+  gchar * key_text = g_strjoin ("\n", text, get_version (), locale ? locale : "", NULL);
+  gchar * key = g_compute_checksum_for_string (G_CHECKSUM_SHA1, key_text, -1);
 
-  GtkListStore * store = gtk_list_store_new (CC_TIMEZONE_COMPLETION_LAST,
-                                             G_TYPE_STRING,
-                                             G_TYPE_STRING,
-                                             G_TYPE_STRING,
-                                             G_TYPE_STRING,
-                                             G_TYPE_STRING,
-                                             G_TYPE_STRING);
+  g_free (key_text);
+  g_free (locale);
+  return key;
+}
 
-  JsonReader * reader = json_reader_new (json_parser_get_root (JSON_PARSER (object)));
+/* Returns the places the geoname server gave for text before, if they are
+   on disk and recent enough */
+static GtkTreeModel *
+load_cached_geonames (const gchar * text, gboolean * complete)
+{
+  gchar * key = get_geoname_cache_key (text);
+  GMappedFile * file = tz_cache_open (GEONAME_CACHE_DIR, key);
+  g_free (key);
+
+  if (file == NULL)
+    return NULL;
 
-  if (!json_reader_is_array (reader)) 
+  const gchar * contents = g_mapped_file_get_contents (file);
+  gsize length = g_mapped_file_get_length (file);
+  const GeonameCacheHeader * header = (const GeonameCacheHeader *) contents;
+  gint64 now = g_get_real_time ();
+
+  if (length < sizeof (GeonameCacheHeader) ||
+      memcmp (header->magic, GEONAME_CACHE_MAGIC, sizeof (header->magic)) != 0 ||
+      header->byte_order != G_BYTE_ORDER ||
+      header->created > now || now - header->created > GEONAME_CACHE_TTL ||
+      header->n_results > (length - sizeof (GeonameCacheHeader)) /
+                          (GEONAME_CACHE_FIELDS * sizeof (guint32)))
     {
-      g_warning ("Could not parse geoname JSON data");
-      save_and_use_model (completion, priv->initial_model);
-      g_object_unref (G_OBJECT (reader));
-      return;
+      g_mapped_file_unref (file);
+      return NULL;
     }
 
-  gint i, count = json_reader_count_elements (reader);
-  for (i = 0; i < count; ++i) 
+  const guint32 * offsets = (const guint32 *) (contents + sizeof (GeonameCacheHeader));
+  const gchar * strings = (const gchar *) (offsets + header->n_results * GEONAME_CACHE_FIELDS);
+  gsize strings_length = contents + length - strings;
+
+  /* Every string must end within the file */
+  if (strings_length > 0 && strings[strings_length - 1] != 0)
     {
-      if (!json_reader_read_element (reader, i))
-        continue;
+      g_mapped_file_unref (file);
+      return NULL;
+    }
 
-      if (json_reader_is_object (reader)) 
+  GtkListStore * store = new_store ();
+  guint i, j;
+  for (i = 0; i < header->n_results; ++i)
+    {
+      const gchar * values[GEONAME_CACHE_FIELDS];
+      GtkTreeIter iter;
+
+      for (j = 0; j < GEONAME_CACHE_FIELDS; ++j)
         {
-          const gchar * name = NULL;
-          const gchar * admin1 = NULL;
-          const gchar * country = NULL;
-          const gchar * longitude = NULL;
-          const gchar * latitude = NULL;
-          gboolean skip = FALSE;
-          if (json_reader_read_member (reader, "name"))
-            {
-              name = json_reader_get_string_value (reader);
-              json_reader_end_member (reader);
-            }
-          if (json_reader_read_member (reader, "admin1"))
-            {
-              admin1 = json_reader_get_string_value (reader);
-              json_reader_end_member (reader);
-            }
-          if (json_reader_read_member (reader, "country"))
-            {
-              country = json_reader_get_string_value (reader);
-              json_reader_end_member (reader);
-            }
-          if (json_reader_read_member (reader, "longitude"))
-            {
-              longitude = json_reader_get_string_value (reader);
-              json_reader_end_member (reader);
-            }
-          if (json_reader_read_member (reader, "latitude"))
+          guint32 offset = offsets[i * GEONAME_CACHE_FIELDS + j];
+          if (offset == GEONAME_CACHE_NULL || offset >= strings_length)
+            values[j] = NULL;
+          else
+            values[j] = strings + offset;
+        }
+
+      gtk_list_store_insert_with_values (store, &iter, -1,
+                                         CC_TIMEZONE_COMPLETION_ZONE, NULL,
+                                         CC_TIMEZONE_COMPLETION_NAME, values[0],
+                                         CC_TIMEZONE_COMPLETION_ADMIN1, values[1],
+                                         CC_TIMEZONE_COMPLETION_COUNTRY, values[2],
+                                         CC_TIMEZONE_COMPLETION_LONGITUDE, values[3],
+                                         CC_TIMEZONE_COMPLETION_LATITUDE, values[4],
+                                         -1);
+    }
+
+  *complete = header->complete;
+  g_mapped_file_unref (file);
+
+  append_utc (store, text);
+
+  return GTK_TREE_MODEL (store);
+}
+
+static void
+store_cached_geonames (const gchar * text, GArray * results, gboolean complete)
+{
+  GeonameCacheHeader header = { GEONAME_CACHE_MAGIC, };
+  GArray * offsets = g_array_sized_new (FALSE, FALSE, sizeof (guint32),
+                                        results->len * GEONAME_CACHE_FIELDS);
+  GString * strings = g_string_new (NULL);
+  guint i, j;
+
+  for (i = 0; i < results->len; ++i)
+    {
+      GeonameResult * result = &g_array_index (results, GeonameResult, i);
+      const gchar * values[GEONAME_CACHE_FIELDS] = {
+        result->name, result->admin1, result->country,
+        result->longitude, result->latitude
+      };
+
+      for (j = 0; j < GEONAME_CACHE_FIELDS; ++j)
+        {
+          guint32 offset = GEONAME_CACHE_NULL;
+          if (values[j] != NULL)
             {
-              latitude = json_reader_get_string_value (reader);
-              json_reader_end_member (reader);
+              offset = strings->len;
+              g_string_append_len (strings, values[j], strlen (values[j]) + 1);
             }
+          g_array_append_val (offsets, offset);
+        }
+    }
+
+  header.byte_order = G_BYTE_ORDER;
+  header.n_results = results->len;
+  header.created = g_get_real_time ();
+  header.complete = complete;
+
+  gchar * key = get_geoname_cache_key (text);
+  GOutputStream * stream = tz_cache_create (GEONAME_CACHE_DIR, key);
+
+  if (stream != NULL)
+    {
+      gboolean ok;
+
+      ok = g_output_stream_write_all (stream, &header, sizeof (header), NULL, NULL, NULL) &&
+           g_output_stream_write_all (stream, offsets->data,
+                                      offsets->len * sizeof (guint32), NULL, NULL, NULL) &&
+           g_output_stream_write_all (stream, strings->str, strings->len, NULL, NULL, NULL);
+
+      if (ok)
+        {
+          g_output_stream_close (stream, NULL, NULL);
+        }
+      else
+        {
+          /* Closing with a cancelled cancellable drops the partial entry
+             instead of replacing the old one with it */
+          GCancellable * cancellable = g_cancellable_new ();
+          g_cancellable_cancel (cancellable);
+          g_output_stream_close (stream, cancellable, NULL);
+          g_object_unref (cancellable);
+        }
+
+      g_object_unref (stream);
+      tz_cache_trim (GEONAME_CACHE_DIR, key, GEONAME_CACHE_MAX_SIZE);
+    }
+
+  g_free (key);
+
+  g_string_free (strings, TRUE);
+  g_array_unref (offsets);
+}
+
+/* Returns the geoname places we already have for text, or can pick out of
+   those for shorter text, or were given for text before, maybe in an
+   earlier session */
+static GtkTreeModel *
+get_cached_model (CcTimezoneCompletion * completion, const gchar * text)
+{
+  CachedModel * cached = lookup_model (completion, text);
+  GtkTreeModel * model;
+  gboolean complete;
+
+  if (cached != NULL)
+    return g_object_ref (cached->model);
+
+  model = filter_cached_model (completion, text);
+  if (model != NULL)
+    {
+      cache_model (completion, text, model, TRUE);
+      return model;
+    }
+
+  if (!completion->priv->remote_lookup)
+    return NULL;
+
+  model = load_cached_geonames (text, &complete);
+  if (model != NULL)
+    cache_model (completion, text, model, complete);
+
+  return model;
+}
+
+static void
+use_geonames (CcTimezoneCompletion * completion, TzGeocoderResults * answer)
+{
+  CcTimezoneCompletionPrivate * priv = completion->priv;
+  GPtrArray * geonames = answer->places;
+  const gchar * prev_name = NULL;
+  const gchar * prev_admin1 = NULL;
+  const gchar * prev_country = NULL;
+
+  gchar * casefolded_text = g_utf8_casefold (priv->request_text, -1);
+  GArray * results = g_array_new (FALSE, FALSE, sizeof (GeonameResult));
+  g_array_set_clear_func (results, (GDestroyNotify) clear_result);
+
+  guint i;
+  for (i = 0; i < geonames->len; ++i)
+    {
+      TzGeoname * geoname = g_ptr_array_index (geonames, i);
+      const gchar * name = geoname->name;
+      const gchar * admin1 = geoname->admin1;
+      const gchar * country = geoname->country;
+      gboolean skip = FALSE;
 
       if (g_strcmp0(name, prev_name) == 0 &&
           g_strcmp0(admin1, prev_admin1) == 0 &&
@@ -212,27 +829,17 @@ json_parse_ready (GObject *object, GAsyncResult *res, gpointer user_data)
           skip = TRUE;
         }
 
-      if (!skip) 
+      if (!skip && name != NULL)
         {
-          GtkTreeIter iter;
-          gtk_list_store_append (store, &iter);
-          gtk_list_store_set (store, &iter,
-                              CC_TIMEZONE_COMPLETION_ZONE, NULL,
-                              CC_TIMEZONE_COMPLETION_NAME, name,
-                              CC_TIMEZONE_COMPLETION_ADMIN1, admin1,
-                              CC_TIMEZONE_COMPLETION_COUNTRY, country,
-                              CC_TIMEZONE_COMPLETION_LONGITUDE, longitude,
-                              CC_TIMEZONE_COMPLETION_LATITUDE, latitude,
-                              -1);
-          gtk_tree_sortable_set_sort_func (GTK_TREE_SORTABLE (store),
-                                           CC_TIMEZONE_COMPLETION_NAME,
-                                           sort_zone,
-                                           g_utf8_casefold(priv->request_text,
-                                             -1),
-                                           g_free);
-          gtk_tree_sortable_set_sort_column_id (GTK_TREE_SORTABLE (store),
-                                                CC_TIMEZONE_COMPLETION_NAME,
-                                                GTK_SORT_ASCENDING);
+          GeonameResult result = { name, admin1, country,
+                                   geoname->longitude, geoname->latitude };
+          gchar * casefolded_name = g_utf8_casefold (name, -1);
+
+          result.matches = g_str_has_prefix (casefolded_name, casefolded_text);
+          result.sort_key = g_utf8_collate_key (casefolded_name, -1);
+          g_array_append_val (results, result);
+
+          g_free (casefolded_name);
         }
 
       prev_name = name;
@@ -240,67 +847,78 @@ json_parse_ready (GObject *object, GAsyncResult *res, gpointer user_data)
       prev_country = country;
     }
 
-    json_reader_end_element (reader);
-  }
+  /* Sort once, and only what will be shown */
+  if (results->len > RESULTS_MAX)
+    {
+      select_results (results, RESULTS_MAX);
+      g_array_set_size (results, RESULTS_MAX);
+    }
+  g_array_sort (results, compare_results);
 
-  if (strlen (priv->request_text) < 4)
+  GtkListStore * store = new_store ();
+  for (i = 0; i < results->len; ++i)
     {
-      gchar * lower_text = g_ascii_strdown (priv->request_text, -1);
-      if (g_strcmp0 (lower_text, "ut") == 0 ||
-          g_strcmp0 (lower_text, "utc") == 0)
-        {
-           GtkTreeIter iter;
-           gtk_list_store_append (store, &iter);
-           gtk_list_store_set (store, &iter,
-                               CC_TIMEZONE_COMPLETION_ZONE, "UTC",
-                                CC_TIMEZONE_COMPLETION_NAME, "UTC",
-                               -1);
-        }
-      g_free (lower_text);
+      GeonameResult * result = &g_array_index (results, GeonameResult, i);
+      GtkTreeIter iter;
+      gtk_list_store_insert_with_values (store, &iter, -1,
+                                         CC_TIMEZONE_COMPLETION_ZONE, NULL,
+                                         CC_TIMEZONE_COMPLETION_NAME, result->name,
+                                         CC_TIMEZONE_COMPLETION_ADMIN1, result->admin1,
+                                         CC_TIMEZONE_COMPLETION_COUNTRY, result->country,
+                                         CC_TIMEZONE_COMPLETION_LONGITUDE, result->longitude,
+                                         CC_TIMEZONE_COMPLETION_LATITUDE, result->latitude,
+                                         -1);
     }
 
-  save_and_use_model (completion, GTK_TREE_MODEL (store));
-  g_object_unref (G_OBJECT (reader));
+  append_utc (store, priv->request_text);
+
+  gboolean complete = answer->complete && geonames->len < GEONAME_PAGE_SIZE;
+
+  store_cached_geonames (priv->request_text, results, complete);
+  cache_model (completion, priv->request_text, GTK_TREE_MODEL (store), complete);
+
+  /* If the local results for this text are still up, add to them rather
+     than swap the list from under the user */
+  if (priv->local_model != NULL &&
+      g_strcmp0 (priv->local_text, priv->request_text) == 0 &&
+      gtk_entry_completion_get_model (GTK_ENTRY_COMPLETION (completion)) == priv->local_model)
+    {
+      if (merge_model (priv->local_model, GTK_TREE_MODEL (store)))
+        show_model (completion, priv->local_model);
+    }
+  else
+    {
+      GtkTreeModel * local = search_local (completion, priv->request_text);
+      merge_model (local, GTK_TREE_MODEL (store));
+      show_model (completion, local);
+      set_local_model (completion, priv->request_text, local);
+    }
+  g_object_unref (store);
+  g_array_unref (results);
+  g_free (casefolded_text);
 }
 
 static void
-geonames_data_ready (GObject *object, GAsyncResult *res, gpointer user_data)
+geonames_ready (GObject *object, GAsyncResult *res, gpointer user_data)
 {
-  CcTimezoneCompletion * completion = CC_TIMEZONE_COMPLETION (user_data);
-  CcTimezoneCompletionPrivate * priv = completion->priv;
   GError * error = NULL;
-  GInputStream * stream;
-  SoupMessage *message;
+  TzGeocoderResults * answer;
 
-  stream = soup_request_send_finish (SOUP_REQUEST (object), res, &error);
-  if (stream == NULL)
+  answer = tz_geocoder_lookup_finish (tz_geocoder_get_default (), res, &error);
+  if (answer == NULL)
     {
+      /* A cancelled request may have outlived its completion */
       if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
-        save_and_use_model (completion, priv->initial_model);
-      g_warning ("Could not connect to geoname lookup server: %s",
-          error->message);
+        {
+          show_fallback_model (CC_TIMEZONE_COMPLETION (user_data));
+          g_warning ("Could not look up geonames: %s", error->message);
+        }
       g_error_free (error);
       return;
     }
 
-  message = soup_request_http_get_message (SOUP_REQUEST_HTTP (object));
-  if (message->status_code == SOUP_STATUS_OK)
-    {
-      JsonParser *parser;
-
-      parser = json_parser_new ();
-      json_parser_load_from_stream_async (parser, stream, priv->cancel, json_parse_ready, user_data);
-
-      g_object_unref (parser);
-    }
-  else
-    {
-      g_warning ("Unable to fetch geonames (server responded with: %u %s)",
-                 message->status_code, message->reason_phrase);
-    }
-
-  g_object_unref (message);
-  g_object_unref (stream);
+  use_geonames (CC_TIMEZONE_COMPLETION (user_data), answer);
+  tz_geocoder_results_unref (answer);
 }
 
 /* Returns message locale, with possible country info too like en_US */
@@ -339,31 +957,123 @@ get_locale (void)
   return locale;
 }
 
-static gchar *
-get_version (void)
+/* The release, as VERSION_ID from os-release. It is read in the background
+   when the first completion is made. Requests to the geoname server wait
+   for it, so that neither they nor the answers cached for them go without
+   it. */
+static gchar * os_version = NULL;
+static GSList * version_waiters = NULL;
+
+static const gchar * os_release_paths[] = { "/etc/os-release", "/usr/lib/os-release", NULL };
+
+static void
+set_version (gchar * version)
 {
-  static gchar *version = NULL;
+  os_version = version;
 
-  if (version == NULL)
+  while (version_waiters != NULL)
     {
-      gchar *stdout = NULL;
-      g_spawn_command_line_sync ("lsb_release -rs", &stdout, NULL, NULL, NULL);
+      CcTimezoneCompletion * completion = version_waiters->data;
+      version_waiters = g_slist_delete_link (version_waiters, version_waiters);
+      request_zones (completion);
+    }
+}
+
+static void
+os_release_loaded (GObject *object, GAsyncResult *res, gpointer user_data)
+{
+  const gchar ** path = user_data;
+  GError * error = NULL;
+  gchar * contents = NULL;
 
-      if (stdout != NULL)
-        version = g_strstrip (stdout);
+  if (!g_file_load_contents_finish (G_FILE (object), res, &contents, NULL, NULL, &error))
+    {
+      if (path[1] != NULL)
+        {
+          GFile * file = g_file_new_for_path (path[1]);
+          g_file_load_contents_async (file, NULL, os_release_loaded, path + 1);
+          g_object_unref (file);
+        }
       else
-        version = g_strdup("");
+        {
+          g_warning ("Could not read os-release: %s", error->message);
+          set_version (g_strdup (""));
+        }
+      g_error_free (error);
+      return;
+    }
+
+  gchar ** lines = g_strsplit (contents, "\n", -1);
+  gchar * version = NULL;
+  gint i;
+
+  for (i = 0; lines[i] != NULL && version == NULL; i++)
+    {
+      if (g_str_has_prefix (lines[i], "VERSION_ID="))
+        version = g_shell_unquote (lines[i] + strlen ("VERSION_ID="), NULL);
+    }
+
+  g_strfreev (lines);
+  g_free (contents);
+
+  set_version (version != NULL ? version : g_strdup (""));
+}
+
+static void
+load_version (void)
+{
+  static gboolean loading = FALSE;
+
+  if (!loading)
+    {
+      GFile * file = g_file_new_for_path (os_release_paths[0]);
+      g_file_load_contents_async (file, NULL, os_release_loaded, os_release_paths);
+      g_object_unref (file);
+      loading = TRUE;
+    }
+}
+
+static const gchar *
+get_version (void)
+{
+  return os_version != NULL ? os_version : "";
+}
+
+/* Every completion asking the same server with the same settings ends up
+   with an equal backend, so the geocoder can share their requests */
+static TzGeocoderBackend *
+get_geocoder_backend (CcTimezoneCompletion * completion)
+{
+  CcTimezoneCompletionPrivate * priv = completion->priv;
+
+  if (priv->geocoder_backend == NULL)
+    {
+      /* The documented override, for mirrors and for testing against a
+         local server */
+      const gchar * server = g_getenv ("GEONAME_SERVER");
+      gchar * prefix = g_strconcat (server ? server : GEONAME_SERVER, GEONAME_URL_QUERY, NULL);
+      gchar * version = g_uri_escape_string (get_version (), NULL, FALSE);
+      gchar * locale = get_locale ();
+      gchar * escaped_locale = g_uri_escape_string (locale ? locale : "", NULL, FALSE);
+      gchar * suffix = g_strdup_printf (GEONAME_URL_SUFFIX, version, escaped_locale);
+
+      priv->geocoder_backend = tz_geocoder_backend_new_http (prefix, suffix,
+                                                             priv->max_geoname_results);
+
+      g_free (prefix);
+      g_free (suffix);
+      g_free (escaped_locale);
+      g_free (locale);
+      g_free (version);
     }
 
-  return version;
+  return priv->geocoder_backend;
 }
 
 static gboolean
 request_zones (CcTimezoneCompletion * completion)
 {
   CcTimezoneCompletionPrivate * priv = completion->priv;
-  SoupRequest *req;
-  GError *error = NULL;
 
   priv->queued_request = 0;
 
@@ -372,66 +1082,97 @@ request_zones (CcTimezoneCompletion * completion)
       return FALSE;
     }
 
-  /* Cancel any ongoing request */
-  if (priv->cancel)
+  /* Ask once the release is known, about whatever the text is by then */
+  if (os_version == NULL)
     {
-      g_cancellable_cancel (priv->cancel);
-      g_object_unref (priv->cancel);
-      priv->cancel = g_cancellable_new ();
+      if (g_slist_find (version_waiters, completion) == NULL)
+        version_waiters = g_slist_prepend (version_waiters, completion);
+      return FALSE;
     }
+
   g_free (priv->request_text);
 
   const gchar * text = gtk_entry_get_text (priv->entry);
   priv->request_text = g_strdup (text);
 
-  gchar * escaped = g_uri_escape_string (text, NULL, FALSE);
-  gchar * version = get_version ();
-  gchar * locale = get_locale ();
-  gchar * url = g_strdup_printf (GEONAME_URL, escaped, version, locale);
-  g_free (locale);
-  g_free (escaped);
+  /* Ask before giving up on any ongoing request, so that asking the same
+     again carries on with it */
+  GCancellable * previous = priv->cancel;
+  priv->cancel = g_cancellable_new ();
 
-  req = soup_session_request (priv->soup_session, url, &error);
-  if (req)
-    {
-      soup_request_send_async (req, priv->cancel, geonames_data_ready, completion);
-      g_object_unref (req);
-    }
-  else
+  tz_geocoder_lookup (tz_geocoder_get_default (), get_geocoder_backend (completion),
+                      text, priv->cancel, geonames_ready, completion);
+
+  if (previous)
     {
-      g_warning ("%s", error->message);
-      g_error_free (error);
+      g_cancellable_cancel (previous);
+      g_object_unref (previous);
     }
 
-  g_free (url);
   return FALSE;
 }
 
+static guint
+get_request_delay (CcTimezoneCompletion * completion)
+{
+  CcTimezoneCompletionPrivate * priv = completion->priv;
+  gint64 latency = -1;
+
+  /* Only ever make the backend in request_zones, once the release is known */
+  if (priv->geocoder_backend != NULL)
+    latency = tz_geocoder_get_latency (tz_geocoder_get_default (), priv->geocoder_backend);
+  if (latency < 0)
+    latency = LATENCY_DEFAULT;
+
+  gint64 delay = priv->typing_interval * 3 / 2 - latency / 2;
+
+  return CLAMP (delay / G_TIME_SPAN_MILLISECOND, DEBOUNCE_MIN, DEBOUNCE_MAX);
+}
+
 static void
 entry_changed (GtkEntry * entry, CcTimezoneCompletion * completion)
 {
   CcTimezoneCompletionPrivate * priv = completion->priv;
 
+  /* Poked by show_model to show the popup for the model it has just set, so
+     there is nothing to look up */
+  if (priv->poking)
+    return;
+
   if (priv->queued_request)
     {
       g_source_remove (priv->queued_request);
       priv->queued_request = 0;
     }
-
-  /* See if we've already got this one */
+  version_waiters = g_slist_remove (version_waiters, completion);
+
+  gint64 now = g_get_monotonic_time ();
+  if (priv->last_change != 0 && now - priv->last_change < TYPING_PAUSE)
+    priv->typing_interval = (3 * priv->typing_interval + now - priv->last_change) / 4;
+  priv->last_change = now;
+
+  /* The local database is searched every time, as it matches admin1,
+     country, later words and typos, which no cached places could be
+     filtered by. Answer from it at once, along with any geoname places we
+     already have, and otherwise ask the geoname server for more once the
+     user pauses. */
   const gchar * text = gtk_entry_get_text (priv->entry);
-  gpointer data;
-  if (g_hash_table_lookup_extended (priv->request_table, text, NULL, &data))
+  GtkTreeModel * local = search_local (completion, text);
+  GtkTreeModel * cached = get_cached_model (completion, text);
+
+  if (cached != NULL)
     {
-      gtk_entry_completion_set_model (GTK_ENTRY_COMPLETION (completion),
-          GTK_TREE_MODEL (data));
+      merge_model (local, cached);
+      g_object_unref (cached);
     }
-  else 
+  else if (priv->remote_lookup)
     {
-      priv->queued_request = g_timeout_add (300, (GSourceFunc)request_zones,
-          completion);
-      gtk_entry_completion_set_model (GTK_ENTRY_COMPLETION (completion), NULL);
+      priv->queued_request = g_timeout_add (get_request_delay (completion),
+          (GSourceFunc)request_zones, completion);
     }
+
+  use_model (completion, local);
+  set_local_model (completion, text, local);
   gtk_entry_completion_complete (GTK_ENTRY_COMPLETION (completion));
 }
 
@@ -574,63 +1315,310 @@ cc_timezone_completion_watch_entry (CcTimezoneCompletion * completion, GtkEntry
     }
 }
 
-static GtkListStore *
-get_initial_model (void)
+/**
+ * cc_timezone_completion_set_remote_lookup:
+ * @completion: A #CcTimezoneCompletion
+ * @remote_lookup: whether to query the geoname server
+ *
+ * Sets whether the completion asks the geoname server for places beyond
+ * the timezone database. Places from the database are offered either way.
+ *
+ * The server is http://geoname-lookup.ubuntu.com/, unless the
+ * GEONAME_SERVER environment variable gives the base URL of another one,
+ * such as a mirror or a local server for tests. It is read when the first
+ * request is made.
+ */
+void
+cc_timezone_completion_set_remote_lookup (CcTimezoneCompletion * completion,
+                                          gboolean remote_lookup)
 {
-  TzDB * db = tz_load_db ();
-  GPtrArray * locations = tz_get_locations (db);
+  CcTimezoneCompletionPrivate * priv = completion->priv;
 
-  GtkListStore * store = gtk_list_store_new (CC_TIMEZONE_COMPLETION_LAST,
-                                             G_TYPE_STRING,
-                                             G_TYPE_STRING,
-                                             G_TYPE_STRING,
-                                             G_TYPE_STRING,
-                                             G_TYPE_STRING,
-                                             G_TYPE_STRING);
+  remote_lookup = !!remote_lookup;
+  if (remote_lookup == priv->remote_lookup)
+    return;
 
-  gint i;
-  for (i = 0; i < locations->len; ++i)
+  priv->remote_lookup = remote_lookup;
+
+  if (!remote_lookup)
     {
-      CcTimezoneLocation * loc = g_ptr_array_index (locations, i);
-      GtkTreeIter iter;
-      gtk_list_store_append (store, &iter);
+      if (priv->queued_request)
+        {
+          g_source_remove (priv->queued_request);
+          priv->queued_request = 0;
+        }
+      g_cancellable_cancel (priv->cancel);
+      g_object_unref (priv->cancel);
+      priv->cancel = g_cancellable_new ();
+    }
 
-      gchar * zone;
-      gchar * country;
-      gchar * en_name; // FIXME: need something better for non-English locales 
-      gdouble longitude;
-      gdouble latitude;
-      g_object_get (loc, "zone", &zone, "country", &country, "en_name", &en_name,
-                    "longitude", &longitude, "latitude", &latitude,
-                    NULL);
+  g_object_notify (G_OBJECT (completion), "remote-lookup");
+}
 
-      gchar * longitude_s = g_strdup_printf ("%f", longitude);
-      gchar * latitude_s=  g_strdup_printf ("%f", latitude);
+gboolean
+cc_timezone_completion_get_remote_lookup (CcTimezoneCompletion * completion)
+{
+  return completion->priv->remote_lookup;
+}
 
-      gtk_list_store_set (store, &iter,
-                          CC_TIMEZONE_COMPLETION_ZONE, NULL,
-                          CC_TIMEZONE_COMPLETION_NAME, en_name,
-                          CC_TIMEZONE_COMPLETION_COUNTRY, country,
-                          CC_TIMEZONE_COMPLETION_LONGITUDE, longitude_s,
-                          CC_TIMEZONE_COMPLETION_LATITUDE, latitude_s,
-                          -1);
+/**
+ * cc_timezone_completion_set_max_geoname_results:
+ * @completion: A #CcTimezoneCompletion
+ * @max_results: the most places to read from an answer
+ *
+ * Sets how many places are read from an answer of the geoname server. The
+ * rest of the answer is not read.
+ */
+void
+cc_timezone_completion_set_max_geoname_results (CcTimezoneCompletion * completion,
+                                                guint max_results)
+{
+  CcTimezoneCompletionPrivate * priv = completion->priv;
 
-      g_free (latitude_s);
-      g_free (longitude_s);
-      g_free (en_name);
-      g_free (country);
-      g_free (zone);
+  max_results = MAX (max_results, 1);
+  if (max_results == priv->max_geoname_results)
+    return;
+
+  priv->max_geoname_results = max_results;
+  if (priv->geocoder_backend != NULL)
+    {
+      tz_geocoder_backend_unref (priv->geocoder_backend);
+      priv->geocoder_backend = NULL;
     }
+  g_object_notify (G_OBJECT (completion), "max-geoname-results");
+}
 
-  GtkTreeIter iter;
-  gtk_list_store_append (store, &iter);
-  gtk_list_store_set (store, &iter,
-                      CC_TIMEZONE_COMPLETION_ZONE, "UTC",
-                      CC_TIMEZONE_COMPLETION_NAME, "UTC",
-                      -1);
+guint
+cc_timezone_completion_get_max_geoname_results (CcTimezoneCompletion * completion)
+{
+  return completion->priv->max_geoname_results;
+}
+
+/* A read-only list of every location in the timezone database, plus UTC,
+   in our columns. Nothing is copied: the values are read from the locations
+   as they are asked for. */
+typedef struct
+{
+  GObject     parent;
+  GPtrArray * locations;
+  gint        stamp;
+} CcTimezoneDbModel;
+
+typedef struct
+{
+  GObjectClass parent_class;
+} CcTimezoneDbModelClass;
+
+static GType cc_timezone_db_model_get_type (void);
+static void cc_timezone_db_model_tree_model_init (GtkTreeModelIface *iface);
+
+G_DEFINE_TYPE_WITH_CODE (CcTimezoneDbModel, cc_timezone_db_model, G_TYPE_OBJECT,
+                         G_IMPLEMENT_INTERFACE (GTK_TYPE_TREE_MODEL,
+                                                cc_timezone_db_model_tree_model_init));
+
+#define CC_TIMEZONE_DB_MODEL(obj) \
+  (G_TYPE_CHECK_INSTANCE_CAST ((obj), cc_timezone_db_model_get_type (), CcTimezoneDbModel))
 
-  tz_db_free (db);
-  return store;
+static gint
+db_model_get_n_rows (CcTimezoneDbModel * model)
+{
+  /* The locations go away with the database, whoever still holds us */
+  return model->locations->len + 1;
+}
+
+static gboolean
+db_model_set_iter (CcTimezoneDbModel * model, GtkTreeIter * iter, gint row)
+{
+  if (row < 0 || row >= db_model_get_n_rows (model))
+    {
+      iter->stamp = 0;
+      return FALSE;
+    }
+
+  iter->stamp = model->stamp;
+  iter->user_data = GINT_TO_POINTER (row);
+  return TRUE;
+}
+
+static GtkTreeModelFlags
+db_model_get_flags (GtkTreeModel * tree_model)
+{
+  return GTK_TREE_MODEL_ITERS_PERSIST | GTK_TREE_MODEL_LIST_ONLY;
+}
+
+static gint
+db_model_get_n_columns (GtkTreeModel * tree_model)
+{
+  return CC_TIMEZONE_COMPLETION_LAST;
+}
+
+static GType
+db_model_get_column_type (GtkTreeModel * tree_model, gint column)
+{
+  return G_TYPE_STRING;
+}
+
+static gboolean
+db_model_get_iter (GtkTreeModel * tree_model, GtkTreeIter * iter,
+                   GtkTreePath * path)
+{
+  if (gtk_tree_path_get_depth (path) != 1)
+    return FALSE;
+
+  return db_model_set_iter (CC_TIMEZONE_DB_MODEL (tree_model), iter,
+                            gtk_tree_path_get_indices (path)[0]);
+}
+
+static GtkTreePath *
+db_model_get_path (GtkTreeModel * tree_model, GtkTreeIter * iter)
+{
+  return gtk_tree_path_new_from_indices (GPOINTER_TO_INT (iter->user_data), -1);
+}
+
+static void
+db_model_get_value (GtkTreeModel * tree_model, GtkTreeIter * iter,
+                    gint column, GValue * value)
+{
+  CcTimezoneDbModel * model = CC_TIMEZONE_DB_MODEL (tree_model);
+  gint row = GPOINTER_TO_INT (iter->user_data);
+
+  g_value_init (value, G_TYPE_STRING);
+
+  if (row >= model->locations->len)
+    {
+      if (column == CC_TIMEZONE_COMPLETION_ZONE ||
+          column == CC_TIMEZONE_COMPLETION_NAME)
+        g_value_set_static_string (value, "UTC");
+      return;
+    }
+
+  CcTimezoneLocation * loc = g_ptr_array_index (model->locations, row);
+
+  switch (column)
+    {
+    case CC_TIMEZONE_COMPLETION_NAME:
+      // FIXME: need something better for non-English locales
+      g_value_set_string (value, cc_timezone_location_get_en_name (loc));
+      break;
+    case CC_TIMEZONE_COMPLETION_COUNTRY:
+      g_value_set_string (value, cc_timezone_location_get_country (loc));
+      break;
+    case CC_TIMEZONE_COMPLETION_LONGITUDE:
+      g_value_take_string (value, g_strdup_printf ("%f", cc_timezone_location_get_longitude (loc)));
+      break;
+    case CC_TIMEZONE_COMPLETION_LATITUDE:
+      g_value_take_string (value, g_strdup_printf ("%f", cc_timezone_location_get_latitude (loc)));
+      break;
+    default:
+      break;
+    }
+}
+
+static gboolean
+db_model_iter_next (GtkTreeModel * tree_model, GtkTreeIter * iter)
+{
+  return db_model_set_iter (CC_TIMEZONE_DB_MODEL (tree_model), iter,
+                            GPOINTER_TO_INT (iter->user_data) + 1);
+}
+
+static gboolean
+db_model_iter_previous (GtkTreeModel * tree_model, GtkTreeIter * iter)
+{
+  return db_model_set_iter (CC_TIMEZONE_DB_MODEL (tree_model), iter,
+                            GPOINTER_TO_INT (iter->user_data) - 1);
+}
+
+static gboolean
+db_model_iter_nth_child (GtkTreeModel * tree_model, GtkTreeIter * iter,
+                         GtkTreeIter * parent, gint n)
+{
+  if (parent != NULL)
+    {
+      iter->stamp = 0;
+      return FALSE;
+    }
+
+  return db_model_set_iter (CC_TIMEZONE_DB_MODEL (tree_model), iter, n);
+}
+
+static gboolean
+db_model_iter_children (GtkTreeModel * tree_model, GtkTreeIter * iter,
+                        GtkTreeIter * parent)
+{
+  return db_model_iter_nth_child (tree_model, iter, parent, 0);
+}
+
+static gboolean
+db_model_iter_has_child (GtkTreeModel * tree_model, GtkTreeIter * iter)
+{
+  return FALSE;
+}
+
+static gint
+db_model_iter_n_children (GtkTreeModel * tree_model, GtkTreeIter * iter)
+{
+  if (iter != NULL)
+    return 0;
+
+  return db_model_get_n_rows (CC_TIMEZONE_DB_MODEL (tree_model));
+}
+
+static gboolean
+db_model_iter_parent (GtkTreeModel * tree_model, GtkTreeIter * iter,
+                      GtkTreeIter * child)
+{
+  iter->stamp = 0;
+  return FALSE;
+}
+
+static void
+cc_timezone_db_model_tree_model_init (GtkTreeModelIface *iface)
+{
+  iface->get_flags = db_model_get_flags;
+  iface->get_n_columns = db_model_get_n_columns;
+  iface->get_column_type = db_model_get_column_type;
+  iface->get_iter = db_model_get_iter;
+  iface->get_path = db_model_get_path;
+  iface->get_value = db_model_get_value;
+  iface->iter_next = db_model_iter_next;
+  iface->iter_previous = db_model_iter_previous;
+  iface->iter_children = db_model_iter_children;
+  iface->iter_has_child = db_model_iter_has_child;
+  iface->iter_n_children = db_model_iter_n_children;
+  iface->iter_nth_child = db_model_iter_nth_child;
+  iface->iter_parent = db_model_iter_parent;
+}
+
+static void
+cc_timezone_db_model_finalize (GObject * object)
+{
+  CcTimezoneDbModel * model = CC_TIMEZONE_DB_MODEL (object);
+
+  g_ptr_array_unref (model->locations);
+
+  G_OBJECT_CLASS (cc_timezone_db_model_parent_class)->finalize (object);
+}
+
+static void
+cc_timezone_db_model_class_init (CcTimezoneDbModelClass *klass)
+{
+  G_OBJECT_CLASS (klass)->finalize = cc_timezone_db_model_finalize;
+}
+
+static void
+cc_timezone_db_model_init (CcTimezoneDbModel * model)
+{
+  model->stamp = g_random_int ();
+}
+
+static GtkTreeModel *
+get_initial_model (TzDB * db)
+{
+  CcTimezoneDbModel * model = g_object_new (cc_timezone_db_model_get_type (), NULL);
+
+  model->locations = g_ptr_array_ref (tz_get_locations (db));
+
+  return GTK_TREE_MODEL (model);
 }
 
 static void
@@ -658,6 +1646,46 @@ data_func (GtkCellLayout *cell_layout, GtkCellRenderer *cell,
   g_object_set (G_OBJECT (cell), "markup", user_name, NULL);
 }
 
+static void
+cc_timezone_completion_get_property (GObject    *object,
+                                     guint       property_id,
+                                     GValue     *value,
+                                     GParamSpec *pspec)
+{
+  CcTimezoneCompletion *completion = CC_TIMEZONE_COMPLETION (object);
+  switch (property_id)
+    {
+    case PROP_REMOTE_LOOKUP:
+      g_value_set_boolean (value, completion->priv->remote_lookup);
+      break;
+    case PROP_MAX_GEONAME_RESULTS:
+      g_value_set_uint (value, completion->priv->max_geoname_results);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+    }
+}
+
+static void
+cc_timezone_completion_set_property (GObject      *object,
+                                     guint         property_id,
+                                     const GValue *value,
+                                     GParamSpec   *pspec)
+{
+  CcTimezoneCompletion *completion = CC_TIMEZONE_COMPLETION (object);
+  switch (property_id)
+    {
+    case PROP_REMOTE_LOOKUP:
+      cc_timezone_completion_set_remote_lookup (completion, g_value_get_boolean (value));
+      break;
+    case PROP_MAX_GEONAME_RESULTS:
+      cc_timezone_completion_set_max_geoname_results (completion, g_value_get_uint (value));
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+    }
+}
+
 static void
 cc_timezone_completion_class_init (CcTimezoneCompletionClass *klass)
 {
@@ -665,9 +1693,30 @@ cc_timezone_completion_class_init (CcTimezoneCompletionClass *klass)
 
   g_type_class_add_private (klass, sizeof (CcTimezoneCompletionPrivate));
 
+  object_class->get_property = cc_timezone_completion_get_property;
+  object_class->set_property = cc_timezone_completion_set_property;
   object_class->dispose = cc_timezone_completion_dispose;
   object_class->finalize = cc_timezone_completion_finalize;
 
+  g_object_class_install_property (object_class,
+                                   PROP_REMOTE_LOOKUP,
+                                   g_param_spec_boolean ("remote-lookup",
+                                                         "Remote lookup",
+                                                         "Whether to query the geoname server",
+                                                         TRUE,
+                                                         G_PARAM_READWRITE |
+                                                         G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (object_class,
+                                   PROP_MAX_GEONAME_RESULTS,
+                                   g_param_spec_uint ("max-geoname-results",
+                                                      "Maximum geoname results",
+                                                      "The most places to read from a geoname answer",
+                                                      1, G_MAXUINT,
+                                                      GEONAME_RESULTS_DEFAULT,
+                                                      G_PARAM_READWRITE |
+                                                      G_PARAM_STATIC_STRINGS));
+
   return;
 }
 
@@ -681,7 +1730,15 @@ cc_timezone_completion_init (CcTimezoneCompletion * self)
                                             CcTimezoneCompletionPrivate);
   priv = self->priv;
 
-  priv->initial_model = GTK_TREE_MODEL (get_initial_model ());
+  load_version ();
+
+  priv->tzdb = tz_load_db ();
+  priv->search = tz_search_new (tz_get_locations (priv->tzdb));
+  priv->remote_lookup = TRUE;
+  priv->max_geoname_results = GEONAME_RESULTS_DEFAULT;
+  priv->typing_interval = TYPING_INTERVAL_DEFAULT;
+
+  priv->initial_model = get_initial_model (priv->tzdb);
 
   g_object_set (G_OBJECT (self),
                 "text-column", CC_TIMEZONE_COMPLETION_NAME,
@@ -690,14 +1747,13 @@ cc_timezone_completion_init (CcTimezoneCompletion * self)
 
   priv->cancel = g_cancellable_new ();
 
-  priv->request_table = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_object_unref);
+  priv->request_table = g_hash_table_new (g_str_hash, g_str_equal);
+  priv->request_lru = g_queue_new ();
 
   GtkCellRenderer * cell = gtk_cell_renderer_text_new ();
   gtk_cell_layout_pack_start (GTK_CELL_LAYOUT (self), cell, TRUE);
   gtk_cell_layout_set_cell_data_func (GTK_CELL_LAYOUT (self), cell, data_func, NULL, NULL);
 
-  priv->soup_session = soup_session_new ();
-
   return;
 }
 
@@ -741,6 +1797,7 @@ cc_timezone_completion_dispose (GObject * object)
       g_source_remove (priv->queued_request);
       priv->queued_request = 0;
     }
+  version_waiters = g_slist_remove (version_waiters, completion);
 
   if (priv->cancel != NULL)
     {
@@ -761,7 +1818,34 @@ cc_timezone_completion_dispose (GObject * object)
       priv->request_table = NULL;
     }
 
-  g_clear_object (&priv->soup_session);
+  if (priv->request_lru != NULL)
+    {
+      g_queue_free_full (priv->request_lru, (GDestroyNotify) cached_model_free);
+      priv->request_lru = NULL;
+      priv->request_bytes = 0;
+    }
+
+  if (priv->geocoder_backend != NULL)
+    {
+      tz_geocoder_backend_unref (priv->geocoder_backend);
+      priv->geocoder_backend = NULL;
+    }
+
+  g_clear_object (&priv->local_model);
+  g_free (priv->local_text);
+  priv->local_text = NULL;
+
+  if (priv->search != NULL)
+    {
+      tz_search_free (priv->search);
+      priv->search = NULL;
+    }
+
+  if (priv->tzdb != NULL)
+    {
+      tz_db_free (priv->tzdb);
+      priv->tzdb = NULL;
+    }
 
   return;
 }
@@ -59,6 +59,10 @@ struct _CcTimezoneCompletionClass {
 GType cc_timezone_completion_get_type (void) G_GNUC_CONST;
 CcTimezoneCompletion * cc_timezone_completion_new ();
 void cc_timezone_completion_watch_entry (CcTimezoneCompletion * completion, GtkEntry * entry);
+void cc_timezone_completion_set_remote_lookup (CcTimezoneCompletion * completion, gboolean remote_lookup);
+gboolean cc_timezone_completion_get_remote_lookup (CcTimezoneCompletion * completion);
+void cc_timezone_completion_set_max_geoname_results (CcTimezoneCompletion * completion, guint max_results);
+guint cc_timezone_completion_get_max_geoname_results (CcTimezoneCompletion * completion);
 
 G_END_DECLS
 
@@ -0,0 +1,203 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+/* On-disk cache of generated data.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <stdlib.h>
+#include "tz-cache.h"
+
+/* Entries live in $XDG_CACHE_HOME/libtimezonemap/<subdir>/<key>. Every
+ * lookup touches the entry's modification time, so trimming by oldest
+ * modification time evicts the least recently used entries first. */
+
+typedef struct CacheEntry {
+    gchar *path;
+    goffset size;
+    gint64 mtime;
+} CacheEntry;
+
+
+/* Forward declarations for private functions */
+
+static gchar *cache_get_dir (const gchar *subdir);
+static int compare_entry_mtimes (const void *a, const void *b);
+
+
+/* ---------------- *
+ * Public interface *
+ * ---------------- */
+
+/* Map a cache entry into memory, or return NULL if there is none */
+GMappedFile *
+tz_cache_open (const gchar *subdir, const gchar *key)
+{
+    gchar *dir, *path;
+    GMappedFile *file;
+
+    dir = cache_get_dir (subdir);
+    path = g_build_filename (dir, key, NULL);
+    g_free (dir);
+
+    /* Writable maps are private copies, so callers may hand the contents to
+     * APIs which want mutable buffers without touching the file */
+    file = g_mapped_file_new (path, TRUE, NULL);
+    if (file)
+        g_utime (path, NULL);
+
+    g_free (path);
+
+    return file;
+}
+
+/* Start writing a cache entry. The entry replaces any previous one atomically
+ * when the stream is closed successfully. */
+GOutputStream *
+tz_cache_create (const gchar *subdir, const gchar *key)
+{
+    GError *error = NULL;
+    GFileOutputStream *stream;
+    gchar *dir, *path;
+    GFile *file;
+
+    dir = cache_get_dir (subdir);
+    if (g_mkdir_with_parents (dir, 0700) != 0)
+      {
+        g_free (dir);
+        return NULL;
+      }
+
+    path = g_build_filename (dir, key, NULL);
+    file = g_file_new_for_path (path);
+    g_free (path);
+    g_free (dir);
+
+    stream = g_file_replace (file, NULL, FALSE, G_FILE_CREATE_PRIVATE, NULL,
+            &error);
+    g_object_unref (file);
+
+    /* The cache is optional, and a read-only or full cache directory would
+     * fail every write, so this is not worth a warning */
+    if (!stream)
+      {
+        g_debug ("Could not write cache entry: %s", error->message);
+        g_error_free (error);
+        return NULL;
+      }
+
+    return G_OUTPUT_STREAM (stream);
+}
+
+/* Delete the least recently used entries until the total size of the
+ * directory is at most max_size bytes. The entry named keep, usually the one
+ * just written, is never deleted. */
+void
+tz_cache_trim (const gchar *subdir, const gchar *keep, goffset max_size)
+{
+    gchar *dir;
+    GDir *gdir;
+    const gchar *name;
+    GArray *entries;
+    goffset total = 0;
+    guint i;
+
+    dir = cache_get_dir (subdir);
+    gdir = g_dir_open (dir, 0, NULL);
+    if (!gdir)
+      {
+        g_free (dir);
+        return;
+      }
+
+    entries = g_array_new (FALSE, FALSE, sizeof (CacheEntry));
+
+    while ((name = g_dir_read_name (gdir)) != NULL)
+      {
+        CacheEntry entry;
+        GStatBuf buf;
+
+        if (g_strcmp0 (name, keep) == 0)
+            continue;
+
+        entry.path = g_build_filename (dir, name, NULL);
+        if (g_stat (entry.path, &buf) != 0)
+          {
+            g_free (entry.path);
+            continue;
+          }
+
+        entry.size = buf.st_size;
+        entry.mtime = buf.st_mtime;
+        total += entry.size;
+        g_array_append_val (entries, entry);
+      }
+
+    g_dir_close (gdir);
+
+    /* What is kept still counts towards the total */
+    if (keep != NULL)
+      {
+        gchar *path = g_build_filename (dir, keep, NULL);
+        GStatBuf buf;
+
+        if (g_stat (path, &buf) == 0)
+            total += buf.st_size;
+        g_free (path);
+      }
+
+    g_free (dir);
+
+    qsort (entries->data, entries->len, sizeof (CacheEntry),
+            compare_entry_mtimes);
+
+    for (i = 0; i < entries->len; i++)
+      {
+        CacheEntry *entry = &g_array_index (entries, CacheEntry, i);
+
+        if (total > max_size && g_unlink (entry->path) == 0)
+            total -= entry->size;
+
+        g_free (entry->path);
+      }
+
+    g_array_free (entries, TRUE);
+}
+
+/* ----------------- *
+ * Private functions *
+ * ----------------- */
+
+static gchar *
+cache_get_dir (const gchar *subdir)
+{
+    return g_build_filename (g_get_user_cache_dir (), "libtimezonemap",
+            subdir, NULL);
+}
+
+static int
+compare_entry_mtimes (const void *a, const void *b)
+{
+    const CacheEntry *entry_a = a;
+    const CacheEntry *entry_b = b;
+
+    if (entry_a->mtime < entry_b->mtime)
+        return -1;
+    if (entry_a->mtime > entry_b->mtime)
+        return 1;
+    return 0;
+}
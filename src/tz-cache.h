@@ -0,0 +1,37 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+/* On-disk cache of generated data.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+#ifndef _TZ_CACHE_H
+#define _TZ_CACHE_H
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+GMappedFile   *tz_cache_open              (const gchar *subdir,
+                                           const gchar *key);
+GOutputStream *tz_cache_create            (const gchar *subdir,
+                                           const gchar *key);
+void           tz_cache_trim              (const gchar *subdir,
+                                           const gchar *keep,
+                                           goffset      max_size);
+
+G_END_DECLS
+
+#endif
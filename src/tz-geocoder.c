@@ -0,0 +1,619 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+/* Looking up places by name, through interchangeable backends.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+#include <gio/gio.h>
+#include <libsoup/soup.h>
+#include "tz-geocoder.h"
+
+/* Lookups go through one geocoder for the whole process. It keeps a single
+ * HTTP session, so connections to a server are reused by every entry that
+ * asks it, and while a lookup is under way the same query to the same
+ * backend joins it instead of starting another. The lookup itself is only
+ * cancelled once everyone waiting on it has given up. The geocoder also
+ * keeps track of how long each backend takes to answer.
+ *
+ * It is only meant to be used from the main thread. */
+
+/* HTTP answers are read this much at a time, and no further than the
+ * limit, however many places they hold */
+#define HTTP_READ_SIZE 4096
+#define HTTP_RESPONSE_MAX (256 * 1024)
+
+struct _TzGeocoder {
+    SoupSession *session;
+    GHashTable *lookups;
+    GHashTable *stats;
+};
+
+/* A lookup under way, and the tasks waiting on it */
+typedef struct {
+    TzGeocoder *geocoder;
+    TzGeocoderBackend *backend;
+    gchar *key;
+    GCancellable *cancellable;
+    GList *waiters;
+    gint64 start_time;
+} Lookup;
+
+typedef struct {
+    Lookup *lookup;
+    GTask *task;
+    gulong cancelled_id;
+} Waiter;
+
+typedef struct {
+    guint n_lookups;
+    guint n_failures;
+    gint64 latency;
+} BackendStats;
+
+typedef struct {
+    TzGeocoderBackend parent;
+    gchar *url_prefix;
+    gchar *url_suffix;
+    guint max_results;
+} HttpBackend;
+
+typedef struct {
+    GInputStream *stream;
+    TzGeonameParser *parser;
+    gsize length;
+} HttpRead;
+
+typedef struct {
+    TzGeocoderBackend parent;
+    TzSearch *search;
+    guint max_results;
+} LocalBackend;
+
+/* Forward declarations for private functions */
+
+static void lookup_ready (GObject *source, GAsyncResult *result,
+                          gpointer user_data);
+static void lookup_free (Lookup *lookup);
+static void waiter_cancelled (GCancellable *cancellable, Waiter *waiter);
+static void waiter_free (Waiter *waiter);
+static void record_lookup (TzGeocoder *geocoder, TzGeocoderBackend *backend,
+                           gint64 latency, const GError *error);
+static TzGeocoderResults *task_lookup_finish (TzGeocoderBackend *backend,
+                                              GAsyncResult *result,
+                                              GError **error);
+static void http_lookup (TzGeocoderBackend *backend, SoupSession *session,
+                         const gchar *query, GCancellable *cancellable,
+                         GAsyncReadyCallback callback, gpointer user_data);
+static void http_send_ready (GObject *source, GAsyncResult *result,
+                             gpointer user_data);
+static void http_read_next (GTask *task);
+static void http_read_ready (GObject *source, GAsyncResult *result,
+                             gpointer user_data);
+static void http_read_free (HttpRead *read);
+static void http_finalize (TzGeocoderBackend *backend);
+static void local_lookup (TzGeocoderBackend *backend, SoupSession *session,
+                          const gchar *query, GCancellable *cancellable,
+                          GAsyncReadyCallback callback, gpointer user_data);
+static void local_finalize (TzGeocoderBackend *backend);
+
+static const TzGeocoderBackendVTable http_vtable = {
+    http_lookup,
+    task_lookup_finish,
+    http_finalize,
+};
+
+static const TzGeocoderBackendVTable local_vtable = {
+    local_lookup,
+    task_lookup_finish,
+    local_finalize,
+};
+
+
+/* ---------------- *
+ * Public interface *
+ * ---------------- */
+
+/* Takes a reference on places */
+TzGeocoderResults *
+tz_geocoder_results_new (GPtrArray *places, gboolean complete)
+{
+    TzGeocoderResults *results = g_slice_new (TzGeocoderResults);
+
+    results->places = g_ptr_array_ref (places);
+    results->complete = complete;
+    results->ref_count = 1;
+
+    return results;
+}
+
+TzGeocoderResults *
+tz_geocoder_results_ref (TzGeocoderResults *results)
+{
+    results->ref_count++;
+    return results;
+}
+
+void
+tz_geocoder_results_unref (TzGeocoderResults *results)
+{
+    if (--results->ref_count > 0)
+        return;
+
+    g_ptr_array_unref (results->places);
+    g_slice_free (TzGeocoderResults, results);
+}
+
+/* Asks a geoname server, at url_prefix followed by the escaped query and
+ * url_suffix, for up to max_results places in JSON */
+TzGeocoderBackend *
+tz_geocoder_backend_new_http (const gchar *url_prefix, const gchar *url_suffix,
+                              guint max_results)
+{
+    HttpBackend *http = g_new0 (HttpBackend, 1);
+
+    http->parent.vtable = &http_vtable;
+    http->parent.name = g_strdup_printf ("http:%s\n%s\n%u", url_prefix,
+                                         url_suffix, max_results);
+    http->parent.ref_count = 1;
+    http->url_prefix = g_strdup (url_prefix);
+    http->url_suffix = g_strdup (url_suffix);
+    http->max_results = max_results;
+
+    return &http->parent;
+}
+
+/* Looks in the local location database. The search is not copied, and must
+ * outlive the backend. */
+TzGeocoderBackend *
+tz_geocoder_backend_new_local (TzSearch *search, guint max_results)
+{
+    LocalBackend *local = g_new0 (LocalBackend, 1);
+
+    local->parent.vtable = &local_vtable;
+    local->parent.name = g_strdup_printf ("local:%p\n%u", search, max_results);
+    local->parent.ref_count = 1;
+    local->search = search;
+    local->max_results = max_results;
+
+    return &local->parent;
+}
+
+TzGeocoderBackend *
+tz_geocoder_backend_ref (TzGeocoderBackend *backend)
+{
+    backend->ref_count++;
+    return backend;
+}
+
+void
+tz_geocoder_backend_unref (TzGeocoderBackend *backend)
+{
+    if (--backend->ref_count > 0)
+        return;
+
+    backend->vtable->finalize (backend);
+    g_free (backend->name);
+    g_free (backend);
+}
+
+TzGeocoder *
+tz_geocoder_get_default (void)
+{
+    static TzGeocoder *geocoder = NULL;
+
+    if (geocoder == NULL)
+      {
+        geocoder = g_new0 (TzGeocoder, 1);
+        geocoder->session = soup_session_new ();
+        geocoder->lookups = g_hash_table_new (g_str_hash, g_str_equal);
+        geocoder->stats = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                 g_free, g_free);
+      }
+
+    return geocoder;
+}
+
+/* Looks query up with backend, or waits on the same lookup if it is
+ * already under way. Cancelling only gives up waiting. */
+void
+tz_geocoder_lookup (TzGeocoder *geocoder, TzGeocoderBackend *backend,
+                    const gchar *query, GCancellable *cancellable,
+                    GAsyncReadyCallback callback, gpointer user_data)
+{
+    GTask *task = g_task_new (NULL, cancellable, callback, user_data);
+    Waiter *waiter;
+    Lookup *lookup;
+    gchar *key;
+
+    if (g_task_return_error_if_cancelled (task))
+      {
+        g_object_unref (task);
+        return;
+      }
+
+    key = g_strdup_printf ("%s\n%s", backend->name, query);
+    lookup = g_hash_table_lookup (geocoder->lookups, key);
+
+    if (lookup == NULL)
+      {
+        lookup = g_slice_new0 (Lookup);
+        lookup->geocoder = geocoder;
+        lookup->backend = tz_geocoder_backend_ref (backend);
+        lookup->key = key;
+        lookup->cancellable = g_cancellable_new ();
+        lookup->start_time = g_get_monotonic_time ();
+        g_hash_table_insert (geocoder->lookups, lookup->key, lookup);
+
+        backend->vtable->lookup (backend, geocoder->session, query,
+                                 lookup->cancellable, lookup_ready, lookup);
+      }
+    else
+      {
+        g_free (key);
+      }
+
+    waiter = g_slice_new0 (Waiter);
+    waiter->lookup = lookup;
+    waiter->task = task;
+    lookup->waiters = g_list_prepend (lookup->waiters, waiter);
+
+    if (cancellable != NULL)
+        waiter->cancelled_id = g_cancellable_connect (cancellable,
+                                                      G_CALLBACK (waiter_cancelled),
+                                                      waiter,
+                                                      (GDestroyNotify) waiter_free);
+}
+
+/* Returns a reference to the places found */
+TzGeocoderResults *
+tz_geocoder_lookup_finish (TzGeocoder *geocoder, GAsyncResult *result,
+                           GError **error)
+{
+    return g_task_propagate_pointer (G_TASK (result), error);
+}
+
+/* How long backend usually takes to answer, in microseconds, or -1 if it
+ * has not answered yet */
+gint64
+tz_geocoder_get_latency (TzGeocoder *geocoder, TzGeocoderBackend *backend)
+{
+    BackendStats *stats = g_hash_table_lookup (geocoder->stats, backend->name);
+
+    if (stats == NULL || stats->n_lookups == stats->n_failures)
+        return -1;
+
+    return stats->latency;
+}
+
+
+/* ----------------- *
+ * Private functions *
+ * ----------------- */
+
+static void
+lookup_ready (GObject *source, GAsyncResult *result, gpointer user_data)
+{
+    Lookup *lookup = user_data;
+    TzGeocoderBackend *backend = lookup->backend;
+    TzGeocoderResults *results;
+    GError *error = NULL;
+    GList *waiters, *l;
+
+    results = backend->vtable->lookup_finish (backend, result, &error);
+
+    if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        record_lookup (lookup->geocoder, backend,
+                       g_get_monotonic_time () - lookup->start_time, error);
+
+    if (g_hash_table_lookup (lookup->geocoder->lookups, lookup->key) == lookup)
+        g_hash_table_remove (lookup->geocoder->lookups, lookup->key);
+
+    /* Whoever is still waiting gets the answer, in the order they asked */
+    waiters = g_list_reverse (lookup->waiters);
+    lookup->waiters = NULL;
+
+    for (l = waiters; l != NULL; l = l->next)
+      {
+        Waiter *waiter = l->data;
+        GCancellable *cancellable = g_task_get_cancellable (waiter->task);
+
+        if (error != NULL)
+            g_task_return_error (waiter->task, g_error_copy (error));
+        else
+            g_task_return_pointer (waiter->task,
+                                   tz_geocoder_results_ref (results),
+                                   (GDestroyNotify) tz_geocoder_results_unref);
+
+        waiter->lookup = NULL;
+        if (cancellable != NULL)
+            g_cancellable_disconnect (cancellable, waiter->cancelled_id);
+        else
+            waiter_free (waiter);
+      }
+
+    g_list_free (waiters);
+    g_clear_error (&error);
+    if (results != NULL)
+        tz_geocoder_results_unref (results);
+    lookup_free (lookup);
+}
+
+static void
+lookup_free (Lookup *lookup)
+{
+    tz_geocoder_backend_unref (lookup->backend);
+    g_object_unref (lookup->cancellable);
+    g_free (lookup->key);
+    g_slice_free (Lookup, lookup);
+}
+
+/* Runs when a waiter gives up. The lookup goes on as long as anyone else
+ * wants its answer. */
+static void
+waiter_cancelled (GCancellable *cancellable, Waiter *waiter)
+{
+    Lookup *lookup = waiter->lookup;
+
+    if (lookup == NULL)
+        return;
+
+    lookup->waiters = g_list_remove (lookup->waiters, waiter);
+    waiter->lookup = NULL;
+
+    g_task_return_error_if_cancelled (waiter->task);
+    g_clear_object (&waiter->task);
+
+    if (lookup->waiters == NULL)
+      {
+        /* Let the next query start afresh rather than join this one */
+        if (g_hash_table_lookup (lookup->geocoder->lookups, lookup->key) == lookup)
+            g_hash_table_remove (lookup->geocoder->lookups, lookup->key);
+
+        g_cancellable_cancel (lookup->cancellable);
+      }
+}
+
+/* A waiter with a cancellable is freed when its handler is disconnected,
+ * or, once cancelled, along with the cancellable */
+static void
+waiter_free (Waiter *waiter)
+{
+    g_clear_object (&waiter->task);
+    g_slice_free (Waiter, waiter);
+}
+
+static void
+record_lookup (TzGeocoder *geocoder, TzGeocoderBackend *backend,
+               gint64 latency, const GError *error)
+{
+    BackendStats *stats = g_hash_table_lookup (geocoder->stats, backend->name);
+
+    if (stats == NULL)
+      {
+        stats = g_new0 (BackendStats, 1);
+        g_hash_table_insert (geocoder->stats, g_strdup (backend->name), stats);
+      }
+
+    if (error != NULL)
+        stats->n_failures++;
+    else if (stats->n_lookups == stats->n_failures)
+        stats->latency = latency;
+    else
+        stats->latency = (3 * stats->latency + latency) / 4;
+    stats->n_lookups++;
+
+    g_debug ("Geocoder backend %s: %u lookups, %u failed, %" G_GINT64_FORMAT
+             " ms to answer", backend->name, stats->n_lookups, stats->n_failures,
+             stats->latency / G_TIME_SPAN_MILLISECOND);
+}
+
+static TzGeocoderResults *
+task_lookup_finish (TzGeocoderBackend *backend, GAsyncResult *result,
+                    GError **error)
+{
+    return g_task_propagate_pointer (G_TASK (result), error);
+}
+
+static void
+http_lookup (TzGeocoderBackend *backend, SoupSession *session,
+             const gchar *query, GCancellable *cancellable,
+             GAsyncReadyCallback callback, gpointer user_data)
+{
+    HttpBackend *http = (HttpBackend *) backend;
+    GTask *task = g_task_new (NULL, cancellable, callback, user_data);
+    GError *error = NULL;
+    SoupRequest *req;
+    gchar *escaped, *url;
+
+    escaped = g_uri_escape_string (query, NULL, FALSE);
+    url = g_strconcat (http->url_prefix, escaped, http->url_suffix, NULL);
+    g_free (escaped);
+
+    g_task_set_task_data (task, GUINT_TO_POINTER (http->max_results), NULL);
+
+    req = soup_session_request (session, url, &error);
+    if (req)
+      {
+        soup_request_send_async (req, cancellable, http_send_ready, task);
+        g_object_unref (req);
+      }
+    else
+      {
+        g_task_return_error (task, error);
+        g_object_unref (task);
+      }
+
+    g_free (url);
+}
+
+static void
+http_send_ready (GObject *source, GAsyncResult *result, gpointer user_data)
+{
+    GTask *task = user_data;
+    GError *error = NULL;
+    GInputStream *stream;
+    SoupMessage *message;
+
+    stream = soup_request_send_finish (SOUP_REQUEST (source), result, &error);
+    if (stream == NULL)
+      {
+        g_task_return_error (task, error);
+        g_object_unref (task);
+        return;
+      }
+
+    message = soup_request_http_get_message (SOUP_REQUEST_HTTP (source));
+    if (message->status_code == SOUP_STATUS_OK)
+      {
+        HttpRead *read = g_slice_new0 (HttpRead);
+        guint max_results = GPOINTER_TO_UINT (g_task_get_task_data (task));
+
+        read->stream = g_object_ref (stream);
+        read->parser = tz_geoname_parser_new (max_results);
+        g_task_set_task_data (task, read, (GDestroyNotify) http_read_free);
+        http_read_next (task);
+      }
+    else
+      {
+        g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_FAILED,
+                                 "Server responded with: %u %s",
+                                 message->status_code, message->reason_phrase);
+        g_object_unref (task);
+      }
+
+    g_object_unref (message);
+    g_object_unref (stream);
+}
+
+static void
+http_read_next (GTask *task)
+{
+    HttpRead *read = g_task_get_task_data (task);
+
+    g_input_stream_read_bytes_async (read->stream, HTTP_READ_SIZE,
+                                     G_PRIORITY_DEFAULT,
+                                     g_task_get_cancellable (task),
+                                     http_read_ready, task);
+}
+
+/* Parses the answer as it arrives, and stops reading as soon as there are
+ * enough places */
+static void
+http_read_ready (GObject *source, GAsyncResult *result, gpointer user_data)
+{
+    GTask *task = user_data;
+    HttpRead *read = g_task_get_task_data (task);
+    GError *error = NULL;
+    GBytes *bytes;
+    gsize size;
+
+    bytes = g_input_stream_read_bytes_finish (G_INPUT_STREAM (source), result,
+                                              &error);
+    if (bytes == NULL)
+      {
+        g_task_return_error (task, error);
+        g_object_unref (task);
+        return;
+      }
+
+    size = g_bytes_get_size (bytes);
+    read->length += size;
+
+    if ((size > 0 && !tz_geoname_parser_feed (read->parser,
+                                              g_bytes_get_data (bytes, NULL),
+                                              size, &error)) ||
+        (size == 0 && !tz_geoname_parser_finish (read->parser, &error)))
+      {
+        g_task_return_error (task, error);
+        g_bytes_unref (bytes);
+        g_object_unref (task);
+        return;
+      }
+
+    g_bytes_unref (bytes);
+
+    if (size > 0 && !tz_geoname_parser_is_done (read->parser) &&
+        read->length < HTTP_RESPONSE_MAX)
+      {
+        http_read_next (task);
+        return;
+      }
+
+    g_task_return_pointer (task,
+                           tz_geocoder_results_new (tz_geoname_parser_get_results (read->parser),
+                                                    tz_geoname_parser_is_complete (read->parser)),
+                           (GDestroyNotify) tz_geocoder_results_unref);
+    g_object_unref (task);
+}
+
+static void
+http_read_free (HttpRead *read)
+{
+    tz_geoname_parser_free (read->parser);
+    g_object_unref (read->stream);
+    g_slice_free (HttpRead, read);
+}
+
+static void
+http_finalize (TzGeocoderBackend *backend)
+{
+    HttpBackend *http = (HttpBackend *) backend;
+
+    g_free (http->url_prefix);
+    g_free (http->url_suffix);
+}
+
+static void
+local_lookup (TzGeocoderBackend *backend, SoupSession *session,
+              const gchar *query, GCancellable *cancellable,
+              GAsyncReadyCallback callback, gpointer user_data)
+{
+    LocalBackend *local = (LocalBackend *) backend;
+    GTask *task = g_task_new (NULL, cancellable, callback, user_data);
+    GPtrArray *matches = tz_search_query (local->search, query,
+                                          local->max_results);
+    GPtrArray *places = g_ptr_array_new_full (matches->len,
+                                              (GDestroyNotify) tz_geoname_free);
+    guint i;
+
+    for (i = 0; i < matches->len; ++i)
+      {
+        CcTimezoneLocation *loc = g_ptr_array_index (matches, i);
+        TzGeoname *place = g_new0 (TzGeoname, 1);
+
+        place->name = g_strdup (cc_timezone_location_get_en_name (loc));
+        place->admin1 = g_strdup (cc_timezone_location_get_state (loc));
+        place->country = g_strdup (cc_timezone_location_get_full_country (loc));
+        place->longitude = g_strdup_printf ("%f", cc_timezone_location_get_longitude (loc));
+        place->latitude = g_strdup_printf ("%f", cc_timezone_location_get_latitude (loc));
+        g_ptr_array_add (places, place);
+      }
+
+    /* GTask still answers from the main loop, as a real lookup would */
+    g_task_return_pointer (task,
+                           tz_geocoder_results_new (places,
+                                                    matches->len < local->max_results),
+                           (GDestroyNotify) tz_geocoder_results_unref);
+
+    g_ptr_array_unref (places);
+    g_ptr_array_unref (matches);
+    g_object_unref (task);
+}
+
+static void
+local_finalize (TzGeocoderBackend *backend)
+{
+}
@@ -0,0 +1,94 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+/* Looking up places by name, through interchangeable backends.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+#ifndef _TZ_GEOCODER_H
+#define _TZ_GEOCODER_H
+
+#include <gio/gio.h>
+#include <libsoup/soup.h>
+
+#include "tz-geonames.h"
+#include "tz-search.h"
+
+G_BEGIN_DECLS
+
+typedef struct _TzGeocoder TzGeocoder;
+typedef struct _TzGeocoderBackend TzGeocoderBackend;
+typedef struct _TzGeocoderBackendVTable TzGeocoderBackendVTable;
+
+/* The places found for a query, as TzGeoname. They are complete when the
+ * backend left none out. */
+typedef struct _TzGeocoderResults {
+    GPtrArray *places;
+    gboolean complete;
+    gint ref_count;
+} TzGeocoderResults;
+
+/* What a backend does. A lookup ends with a GTask or any other
+ * GAsyncResult that lookup_finish understands. */
+struct _TzGeocoderBackendVTable {
+    void               (*lookup)        (TzGeocoderBackend   *backend,
+                                         SoupSession         *session,
+                                         const gchar         *query,
+                                         GCancellable        *cancellable,
+                                         GAsyncReadyCallback  callback,
+                                         gpointer             user_data);
+    TzGeocoderResults *(*lookup_finish) (TzGeocoderBackend   *backend,
+                                         GAsyncResult        *result,
+                                         GError             **error);
+    void               (*finalize)      (TzGeocoderBackend   *backend);
+};
+
+/* Backends embed this first. Two backends with the same name are taken to
+ * give the same answers, so their lookups are shared. */
+struct _TzGeocoderBackend {
+    const TzGeocoderBackendVTable *vtable;
+    gchar *name;
+    gint ref_count;
+};
+
+TzGeocoderResults *tz_geocoder_results_new   (GPtrArray         *places,
+                                              gboolean           complete);
+TzGeocoderResults *tz_geocoder_results_ref   (TzGeocoderResults *results);
+void               tz_geocoder_results_unref (TzGeocoderResults *results);
+
+TzGeocoderBackend *tz_geocoder_backend_new_http  (const gchar       *url_prefix,
+                                                  const gchar       *url_suffix,
+                                                  guint              max_results);
+TzGeocoderBackend *tz_geocoder_backend_new_local (TzSearch          *search,
+                                                  guint              max_results);
+TzGeocoderBackend *tz_geocoder_backend_ref       (TzGeocoderBackend *backend);
+void               tz_geocoder_backend_unref     (TzGeocoderBackend *backend);
+
+TzGeocoder        *tz_geocoder_get_default       (void);
+void               tz_geocoder_lookup            (TzGeocoder          *geocoder,
+                                                  TzGeocoderBackend   *backend,
+                                                  const gchar         *query,
+                                                  GCancellable        *cancellable,
+                                                  GAsyncReadyCallback  callback,
+                                                  gpointer             user_data);
+TzGeocoderResults *tz_geocoder_lookup_finish     (TzGeocoder          *geocoder,
+                                                  GAsyncResult        *result,
+                                                  GError             **error);
+gint64             tz_geocoder_get_latency       (TzGeocoder          *geocoder,
+                                                  TzGeocoderBackend   *backend);
+
+G_END_DECLS
+
+#endif
@@ -0,0 +1,469 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+/* Pre-flattened map geometry.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+#include <glib.h>
+#include <gio/gio.h>
+#include <string.h>
+#include <math.h>
+#include "tz-geometry.h"
+
+/* The geometry file is written by data/flatten-map.py from the background
+ * layer of the map SVG. All values are little-endian:
+ *
+ *   header    magic, version, level count, width and height
+ *
+ * followed by each level of detail, from full detail to the coarsest:
+ *
+ *   level     tolerance, record, op and point counts
+ *   records   one per shape: colour, op count, flags and line width
+ *   ops       one byte per path operation, padded to a multiple of four
+ *   points    x and y floats; one per move or line, three per curve
+ *
+ * Coordinates are already transformed into the layer's space with its
+ * bounding box at the origin, so rendering is a straight walk over the ops.
+ * The file is mapped read-only and never modified, so a loaded geometry can
+ * be rendered from any number of threads at once.
+ *
+ * Every level after the first is simplified to within its tolerance, in map
+ * units, with sub-tolerance islands dropped. Rendering picks the coarsest
+ * level whose error stays under half a device pixel, so small maps skip
+ * most of the coastline vertices. */
+
+#define GEOMETRY_MAGIC "TZGEOM\0\0"
+#define GEOMETRY_VERSION 2
+
+/* The largest error allowed when picking a level, in device pixels */
+#define LEVEL_MAX_ERROR 0.5
+
+enum {
+    OP_MOVE,
+    OP_LINE,
+    OP_CURVE,
+    OP_CLOSE,
+    N_OPS
+};
+
+#define FLAG_STROKE (1 << 0)
+#define FLAG_EVEN_ODD (1 << 1)
+#define FLAG_CAP(flags) (((flags) >> 2) & 0x3)
+#define FLAG_JOIN(flags) (((flags) >> 4) & 0x3)
+
+typedef struct GeometryHeader {
+    gchar magic[8];
+    guint32 version;
+    guint32 n_levels;
+    guint32 width;
+    guint32 height;
+} GeometryHeader;
+
+typedef struct GeometryLevelHeader {
+    guint32 tolerance;
+    guint32 n_records;
+    guint32 n_ops;
+    guint32 n_points;
+} GeometryLevelHeader;
+
+typedef struct GeometryRecord {
+    guint32 rgba;
+    guint32 n_ops;
+    guint16 flags;
+    guint16 reserved;
+    guint32 line_width;
+} GeometryRecord;
+
+/* A record decoded at load time, along with where its ops and points start
+ * and its bounding box for skipping shapes outside the clip */
+typedef struct GeometryShape {
+    guint first_op;
+    guint n_ops;
+    guint first_point;
+    guint32 rgba;
+    guint16 flags;
+    gdouble line_width;
+    gdouble x1, y1, x2, y2;
+} GeometryShape;
+
+typedef struct GeometryLevel {
+    gdouble tolerance;
+    const guint8 *ops;
+    const guint32 *points;
+    GeometryShape *shapes;
+    guint n_shapes;
+} GeometryLevel;
+
+struct _TzGeometry {
+    GMappedFile *file;
+    GeometryLevel *levels;
+    guint n_levels;
+    gdouble width;
+    gdouble height;
+};
+
+static const gint points_per_op[N_OPS] = { 1, 1, 3, 0 };
+
+static const cairo_line_cap_t line_caps[] = {
+    CAIRO_LINE_CAP_BUTT,
+    CAIRO_LINE_CAP_ROUND,
+    CAIRO_LINE_CAP_SQUARE,
+    CAIRO_LINE_CAP_BUTT
+};
+
+static const cairo_line_join_t line_joins[] = {
+    CAIRO_LINE_JOIN_MITER,
+    CAIRO_LINE_JOIN_ROUND,
+    CAIRO_LINE_JOIN_BEVEL,
+    CAIRO_LINE_JOIN_MITER
+};
+
+
+/* Forward declarations for private functions */
+
+static gfloat read_float (guint32 bits);
+static gboolean geometry_decode (TzGeometry *geometry, GError **error);
+static gsize level_decode (GeometryLevel *level, const gchar *contents,
+        gsize length);
+static const GeometryLevel *geometry_pick_level (const TzGeometry *geometry,
+        cairo_t *cr);
+static void shape_append_path (const GeometryLevel *level,
+        const GeometryShape *shape, cairo_t *cr);
+
+
+/* ---------------- *
+ * Public interface *
+ * ---------------- */
+
+TzGeometry *
+tz_geometry_load (const gchar *filename, GError **error)
+{
+    TzGeometry *geometry;
+    GMappedFile *file;
+
+    file = g_mapped_file_new (filename, FALSE, error);
+    if (!file)
+        return NULL;
+
+    geometry = g_new0 (TzGeometry, 1);
+    geometry->file = file;
+
+    if (!geometry_decode (geometry, error))
+      {
+        tz_geometry_free (geometry);
+        return NULL;
+      }
+
+    return geometry;
+}
+
+void
+tz_geometry_free (TzGeometry *geometry)
+{
+    guint i;
+
+    g_mapped_file_unref (geometry->file);
+    for (i = 0; i < geometry->n_levels; i++)
+        g_free (geometry->levels[i].shapes);
+    g_free (geometry->levels);
+    g_free (geometry);
+}
+
+gdouble
+tz_geometry_get_width (const TzGeometry *geometry)
+{
+    return geometry->width;
+}
+
+gdouble
+tz_geometry_get_height (const TzGeometry *geometry)
+{
+    return geometry->height;
+}
+
+/* The raw file contents, for identifying the map in caches */
+const gchar *
+tz_geometry_get_contents (const TzGeometry *geometry, gsize *length)
+{
+    *length = g_mapped_file_get_length (geometry->file);
+    return g_mapped_file_get_contents (geometry->file);
+}
+
+/* Draw the map at its natural size into cr. Callers scale cr to fit, and
+ * the level of detail is picked to suit the scale. */
+void
+tz_geometry_render (const TzGeometry *geometry, cairo_t *cr)
+{
+    const GeometryLevel *level;
+    gdouble clip_x1, clip_y1, clip_x2, clip_y2;
+    guint i;
+
+    level = geometry_pick_level (geometry, cr);
+
+    cairo_save (cr);
+    cairo_clip_extents (cr, &clip_x1, &clip_y1, &clip_x2, &clip_y2);
+
+    for (i = 0; i < level->n_shapes; i++)
+      {
+        const GeometryShape *shape = &level->shapes[i];
+
+        if (shape->x2 < clip_x1 || shape->x1 > clip_x2 ||
+            shape->y2 < clip_y1 || shape->y1 > clip_y2)
+            continue;
+
+        cairo_new_path (cr);
+        shape_append_path (level, shape, cr);
+
+        cairo_set_source_rgba (cr,
+                ((shape->rgba >> 24) & 0xff) / 255.0,
+                ((shape->rgba >> 16) & 0xff) / 255.0,
+                ((shape->rgba >> 8) & 0xff) / 255.0,
+                (shape->rgba & 0xff) / 255.0);
+
+        if (shape->flags & FLAG_STROKE)
+          {
+            cairo_set_line_width (cr, shape->line_width);
+            cairo_set_line_cap (cr, line_caps[FLAG_CAP (shape->flags)]);
+            cairo_set_line_join (cr, line_joins[FLAG_JOIN (shape->flags)]);
+            cairo_stroke (cr);
+          }
+        else
+          {
+            cairo_set_fill_rule (cr, (shape->flags & FLAG_EVEN_ODD) ?
+                    CAIRO_FILL_RULE_EVEN_ODD : CAIRO_FILL_RULE_WINDING);
+            cairo_fill (cr);
+          }
+      }
+
+    cairo_restore (cr);
+}
+
+
+/* ----------------- *
+ * Private functions *
+ * ----------------- */
+
+static gfloat
+read_float (guint32 bits)
+{
+    union {
+        guint32 i;
+        gfloat f;
+    } value;
+
+    value.i = GUINT32_FROM_LE (bits);
+    return value.f;
+}
+
+/* Check the file against its header and work out where each level's
+ * shapes, ops and points start, so a damaged or truncated file can't be
+ * read past its end */
+static gboolean
+geometry_decode (TzGeometry *geometry, GError **error)
+{
+    const gchar *contents = g_mapped_file_get_contents (geometry->file);
+    gsize length = g_mapped_file_get_length (geometry->file);
+    const GeometryHeader *header;
+    gsize offset;
+    guint n_levels, i;
+
+    header = (const GeometryHeader *) contents;
+    if (length < sizeof (GeometryHeader) ||
+        memcmp (header->magic, GEOMETRY_MAGIC, sizeof (header->magic)) != 0 ||
+        GUINT32_FROM_LE (header->version) != GEOMETRY_VERSION)
+        goto invalid;
+
+    geometry->width = read_float (header->width);
+    geometry->height = read_float (header->height);
+    n_levels = GUINT32_FROM_LE (header->n_levels);
+    if (n_levels == 0 ||
+        n_levels > (length - sizeof (GeometryHeader)) /
+                   sizeof (GeometryLevelHeader))
+        goto invalid;
+
+    /* Only count the levels once they exist, so tz_geometry_free copes with
+     * a file that fails the checks above */
+    geometry->levels = g_new0 (GeometryLevel, n_levels);
+    geometry->n_levels = n_levels;
+
+    offset = sizeof (GeometryHeader);
+    for (i = 0; i < geometry->n_levels; i++)
+      {
+        gsize size = level_decode (&geometry->levels[i], contents + offset,
+                length - offset);
+
+        if (size == 0)
+            goto invalid;
+        offset += size;
+      }
+
+    if (offset != length)
+        goto invalid;
+
+    return TRUE;
+
+invalid:
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+            "Invalid map geometry file");
+    return FALSE;
+}
+
+/* Decode the level starting at contents, returning its size in bytes or 0 if
+ * it is invalid */
+static gsize
+level_decode (GeometryLevel *level, const gchar *contents, gsize length)
+{
+    const GeometryLevelHeader *header;
+    const GeometryRecord *records;
+    guint64 n_records, n_ops, n_points, size;
+    guint op, point, i, j;
+
+    header = (const GeometryLevelHeader *) contents;
+    if (length < sizeof (GeometryLevelHeader))
+        return 0;
+
+    n_records = GUINT32_FROM_LE (header->n_records);
+    n_ops = GUINT32_FROM_LE (header->n_ops);
+    n_points = GUINT32_FROM_LE (header->n_points);
+
+    size = sizeof (GeometryLevelHeader) +
+           n_records * sizeof (GeometryRecord) +
+           (n_ops + 3) / 4 * 4 +
+           n_points * 2 * sizeof (guint32);
+    if (size > length)
+        return 0;
+
+    records = (const GeometryRecord *) (header + 1);
+    level->tolerance = read_float (header->tolerance);
+    level->ops = (const guint8 *) (records + n_records);
+    level->points = (const guint32 *) (level->ops + (n_ops + 3) / 4 * 4);
+
+    level->n_shapes = n_records;
+    level->shapes = g_new0 (GeometryShape, n_records);
+
+    op = 0;
+    point = 0;
+    for (i = 0; i < n_records; i++)
+      {
+        GeometryShape *shape = &level->shapes[i];
+        gdouble margin;
+
+        shape->first_op = op;
+        shape->first_point = point;
+        shape->n_ops = GUINT32_FROM_LE (records[i].n_ops);
+        shape->rgba = GUINT32_FROM_LE (records[i].rgba);
+        shape->flags = GUINT16_FROM_LE (records[i].flags);
+        shape->line_width = read_float (records[i].line_width);
+
+        if (shape->n_ops > n_ops - op)
+            return 0;
+
+        shape->x1 = shape->y1 = G_MAXDOUBLE;
+        shape->x2 = shape->y2 = -G_MAXDOUBLE;
+
+        for (j = 0; j < shape->n_ops; j++, op++)
+          {
+            gint k;
+
+            if (level->ops[op] >= N_OPS ||
+                points_per_op[level->ops[op]] > n_points - point)
+                return 0;
+
+            for (k = 0; k < points_per_op[level->ops[op]]; k++, point++)
+              {
+                gdouble x = read_float (level->points[point * 2]);
+                gdouble y = read_float (level->points[point * 2 + 1]);
+
+                shape->x1 = MIN (shape->x1, x);
+                shape->y1 = MIN (shape->y1, y);
+                shape->x2 = MAX (shape->x2, x);
+                shape->y2 = MAX (shape->y2, y);
+              }
+          }
+
+        /* Curves stay inside their control points, but strokes spill over
+         * them; by up to five line widths at mitered corners with cairo's
+         * default miter limit */
+        margin = (shape->flags & FLAG_STROKE) ? shape->line_width * 5 : 0;
+        shape->x1 -= margin;
+        shape->y1 -= margin;
+        shape->x2 += margin;
+        shape->y2 += margin;
+      }
+
+    if (op != n_ops || point != n_points)
+        return 0;
+
+    return size;
+}
+
+/* Pick the coarsest level which is still accurate to LEVEL_MAX_ERROR device
+ * pixels at the current transformation of cr */
+static const GeometryLevel *
+geometry_pick_level (const TzGeometry *geometry, cairo_t *cr)
+{
+    const GeometryLevel *best = &geometry->levels[0];
+    gdouble dx = 1.0, dy = 0.0, scale;
+    guint i;
+
+    /* The map is only ever scaled, so one axis is a good enough measure */
+    cairo_user_to_device_distance (cr, &dx, &dy);
+    scale = sqrt (dx * dx + dy * dy);
+    if (scale <= 0)
+        return best;
+
+    for (i = 1; i < geometry->n_levels; i++)
+      {
+        if (geometry->levels[i].tolerance * scale > LEVEL_MAX_ERROR)
+            break;
+        best = &geometry->levels[i];
+      }
+
+    return best;
+}
+
+static void
+shape_append_path (const GeometryLevel *level, const GeometryShape *shape,
+        cairo_t *cr)
+{
+    const guint32 *p = level->points + shape->first_point * 2;
+    guint i;
+
+    for (i = 0; i < shape->n_ops; i++)
+      {
+        switch (level->ops[shape->first_op + i])
+          {
+          case OP_MOVE:
+            cairo_move_to (cr, read_float (p[0]), read_float (p[1]));
+            p += 2;
+            break;
+          case OP_LINE:
+            cairo_line_to (cr, read_float (p[0]), read_float (p[1]));
+            p += 2;
+            break;
+          case OP_CURVE:
+            cairo_curve_to (cr,
+                    read_float (p[0]), read_float (p[1]),
+                    read_float (p[2]), read_float (p[3]),
+                    read_float (p[4]), read_float (p[5]));
+            p += 6;
+            break;
+          case OP_CLOSE:
+            cairo_close_path (cr);
+            break;
+          }
+      }
+}
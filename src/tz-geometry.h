@@ -0,0 +1,42 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+/* Pre-flattened map geometry.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+#ifndef _TZ_GEOMETRY_H
+#define _TZ_GEOMETRY_H
+
+#include <glib.h>
+#include <cairo.h>
+
+G_BEGIN_DECLS
+
+typedef struct _TzGeometry TzGeometry;
+
+TzGeometry  *tz_geometry_load           (const gchar *filename,
+                                         GError     **error);
+void         tz_geometry_free           (TzGeometry *geometry);
+gdouble      tz_geometry_get_width      (const TzGeometry *geometry);
+gdouble      tz_geometry_get_height     (const TzGeometry *geometry);
+const gchar *tz_geometry_get_contents   (const TzGeometry *geometry,
+                                         gsize            *length);
+void         tz_geometry_render         (const TzGeometry *geometry,
+                                         cairo_t          *cr);
+
+G_END_DECLS
+
+#endif
@@ -0,0 +1,529 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+/* Streaming parser for geoname lookup results.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+#include <gio/gio.h>
+#include <string.h>
+#include "tz-geonames.h"
+
+/* The geoname server answers with a JSON array of flat objects. Rather than
+ * building the whole document, the parser takes the response a chunk at a
+ * time, splits it into tokens, and keeps only the members of each object it
+ * wants. Other values, however deeply nested, are skipped by counting
+ * brackets. It stops as soon as it has enough places, so the rest of the
+ * response need not even be read. */
+
+typedef enum {
+    STATE_START,
+    STATE_ARRAY_FIRST,
+    STATE_ARRAY_VALUE,
+    STATE_ARRAY_NEXT,
+    STATE_OBJECT_FIRST,
+    STATE_OBJECT_KEY,
+    STATE_OBJECT_COLON,
+    STATE_OBJECT_VALUE,
+    STATE_OBJECT_NEXT,
+    STATE_SKIP,
+    STATE_DONE
+} ParserState;
+
+typedef enum {
+    TOKEN_NONE,
+    TOKEN_STRING,
+    TOKEN_LITERAL
+} TokenState;
+
+/* Token kinds besides the structural characters themselves */
+#define KIND_STRING 's'
+#define KIND_LITERAL 'l'
+
+/* Longest string or literal accepted, before unescaping */
+#define MAX_TOKEN_LENGTH 1024
+
+struct _TzGeonameParser {
+    guint max_results;
+    GPtrArray *results;
+    gboolean complete;
+
+    ParserState state;
+    TzGeoname *current;
+    gchar **field;
+
+    /* Where to go back to once a skipped value is closed */
+    ParserState skip_return;
+    guint skip_depth;
+
+    TokenState token;
+    gboolean escaped;
+    GString *text;
+};
+
+
+/* Forward declarations for private functions */
+
+static gboolean handle_char (TzGeonameParser *parser, gchar c,
+        GError **error);
+static gboolean handle_token (TzGeonameParser *parser, gchar kind,
+        const gchar *value, GError **error);
+static gboolean end_token (TzGeonameParser *parser, GError **error);
+static void finish_object (TzGeonameParser *parser);
+static void skip_value (TzGeonameParser *parser, ParserState next_state);
+static gchar *decode_string (const gchar *raw, gsize length);
+static gint decode_hex (const gchar *digits);
+static gboolean is_literal_char (gchar c);
+
+
+/* ---------------- *
+ * Public interface *
+ * ---------------- */
+
+/* Start parsing a response, keeping at most max_results places */
+TzGeonameParser *
+tz_geoname_parser_new (guint max_results)
+{
+    TzGeonameParser *parser;
+
+    parser = g_new0 (TzGeonameParser, 1);
+    parser->max_results = MAX (max_results, 1);
+    parser->results = g_ptr_array_new_with_free_func (
+            (GDestroyNotify) tz_geoname_free);
+    parser->text = g_string_new (NULL);
+
+    return parser;
+}
+
+void
+tz_geoname_parser_free (TzGeonameParser *parser)
+{
+    if (parser->current)
+        tz_geoname_free (parser->current);
+    g_ptr_array_unref (parser->results);
+    g_string_free (parser->text, TRUE);
+    g_free (parser);
+}
+
+/* Parse the next length bytes of the response. Anything after the parser is
+ * done is ignored. */
+gboolean
+tz_geoname_parser_feed (TzGeonameParser *parser, const gchar *data,
+        gsize length, GError **error)
+{
+    gsize i;
+
+    for (i = 0; i < length && parser->state != STATE_DONE; i++)
+      {
+        if (!handle_char (parser, data[i], error))
+            return FALSE;
+      }
+
+    return TRUE;
+}
+
+/* Check that the whole response has been parsed, at the end of it */
+gboolean
+tz_geoname_parser_finish (TzGeonameParser *parser, GError **error)
+{
+    if (parser->state != STATE_DONE && parser->token == TOKEN_LITERAL &&
+        !end_token (parser, error))
+        return FALSE;
+
+    if (parser->state != STATE_DONE)
+      {
+        g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                "Truncated geoname data");
+        return FALSE;
+      }
+
+    return TRUE;
+}
+
+/* Whether the parser needs no more of the response */
+gboolean
+tz_geoname_parser_is_done (TzGeonameParser *parser)
+{
+    return parser->state == STATE_DONE;
+}
+
+/* Whether the parser reached the end of the response, rather than stopping
+ * at the most places it keeps */
+gboolean
+tz_geoname_parser_is_complete (TzGeonameParser *parser)
+{
+    return parser->complete;
+}
+
+/* The places parsed so far, as TzGeoname, which belong to the parser */
+GPtrArray *
+tz_geoname_parser_get_results (TzGeonameParser *parser)
+{
+    return parser->results;
+}
+
+void
+tz_geoname_free (TzGeoname *geoname)
+{
+    g_free (geoname->name);
+    g_free (geoname->admin1);
+    g_free (geoname->country);
+    g_free (geoname->longitude);
+    g_free (geoname->latitude);
+    g_free (geoname);
+}
+
+
+/* ----------------- *
+ * Private functions *
+ * ----------------- */
+
+static gboolean
+handle_char (TzGeonameParser *parser, gchar c, GError **error)
+{
+    switch (parser->token)
+      {
+      case TOKEN_STRING:
+        if (!parser->escaped && c == '"')
+            return end_token (parser, error);
+
+        parser->escaped = !parser->escaped && c == '\\';
+        g_string_append_c (parser->text, c);
+        break;
+
+      case TOKEN_LITERAL:
+        if (is_literal_char (c))
+          {
+            g_string_append_c (parser->text, c);
+            break;
+          }
+
+        if (!end_token (parser, error))
+            return FALSE;
+        if (parser->state == STATE_DONE)
+            return TRUE;
+
+        /* The character ending a literal starts the next token */
+        return handle_char (parser, c, error);
+
+      case TOKEN_NONE:
+        if (c == ' ' || c == '\t' || c == '\n' || c == '\r')
+            break;
+
+        if (c == '"' || is_literal_char (c))
+          {
+            g_string_truncate (parser->text, 0);
+            parser->escaped = FALSE;
+            parser->token = c == '"' ? TOKEN_STRING : TOKEN_LITERAL;
+            if (c != '"')
+                g_string_append_c (parser->text, c);
+            break;
+          }
+
+        if (strchr ("[]{}:,", c) == NULL || c == '\0')
+          {
+            g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                    "Unexpected character in geoname data");
+            return FALSE;
+          }
+
+        return handle_token (parser, c, NULL, error);
+      }
+
+    if (parser->text->len > MAX_TOKEN_LENGTH)
+      {
+        g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                "Overlong value in geoname data");
+        return FALSE;
+      }
+
+    return TRUE;
+}
+
+static gboolean
+end_token (TzGeonameParser *parser, GError **error)
+{
+    gboolean ok;
+
+    if (parser->token == TOKEN_STRING)
+      {
+        gchar *value = decode_string (parser->text->str, parser->text->len);
+
+        parser->token = TOKEN_NONE;
+        if (!value)
+          {
+            g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                    "Invalid string in geoname data");
+            return FALSE;
+          }
+
+        ok = handle_token (parser, KIND_STRING, value, error);
+        g_free (value);
+        return ok;
+      }
+
+    parser->token = TOKEN_NONE;
+    return handle_token (parser, KIND_LITERAL, parser->text->str, error);
+}
+
+static gboolean
+handle_token (TzGeonameParser *parser, gchar kind, const gchar *value,
+        GError **error)
+{
+    switch (parser->state)
+      {
+      case STATE_START:
+        if (kind != '[')
+            goto invalid;
+        parser->state = STATE_ARRAY_FIRST;
+        return TRUE;
+
+      case STATE_ARRAY_FIRST:
+      case STATE_ARRAY_VALUE:
+        if (kind == ']' && parser->state == STATE_ARRAY_FIRST)
+          {
+            parser->complete = TRUE;
+            parser->state = STATE_DONE;
+          }
+        else if (kind == '{')
+          {
+            parser->current = g_new0 (TzGeoname, 1);
+            parser->state = STATE_OBJECT_FIRST;
+          }
+        else if (kind == '[')
+          {
+            skip_value (parser, STATE_ARRAY_NEXT);
+          }
+        else if (kind == KIND_STRING || kind == KIND_LITERAL)
+          {
+            parser->state = STATE_ARRAY_NEXT;
+          }
+        else
+          {
+            goto invalid;
+          }
+        return TRUE;
+
+      case STATE_ARRAY_NEXT:
+        if (kind == ',')
+            parser->state = STATE_ARRAY_VALUE;
+        else if (kind == ']')
+          {
+            parser->complete = TRUE;
+            parser->state = STATE_DONE;
+          }
+        else
+            goto invalid;
+        return TRUE;
+
+      case STATE_OBJECT_FIRST:
+      case STATE_OBJECT_KEY:
+        if (kind == '}' && parser->state == STATE_OBJECT_FIRST)
+          {
+            finish_object (parser);
+            return TRUE;
+          }
+        if (kind != KIND_STRING)
+            goto invalid;
+
+        if (strcmp (value, "name") == 0)
+            parser->field = &parser->current->name;
+        else if (strcmp (value, "admin1") == 0)
+            parser->field = &parser->current->admin1;
+        else if (strcmp (value, "country") == 0)
+            parser->field = &parser->current->country;
+        else if (strcmp (value, "longitude") == 0)
+            parser->field = &parser->current->longitude;
+        else if (strcmp (value, "latitude") == 0)
+            parser->field = &parser->current->latitude;
+        else
+            parser->field = NULL;
+
+        parser->state = STATE_OBJECT_COLON;
+        return TRUE;
+
+      case STATE_OBJECT_COLON:
+        if (kind != ':')
+            goto invalid;
+        parser->state = STATE_OBJECT_VALUE;
+        return TRUE;
+
+      case STATE_OBJECT_VALUE:
+        if (kind == '{' || kind == '[')
+          {
+            skip_value (parser, STATE_OBJECT_NEXT);
+            return TRUE;
+          }
+        if (kind != KIND_STRING && kind != KIND_LITERAL)
+            goto invalid;
+
+        /* Numbers are taken as they are written, but true, false and null
+         * leave the member unset */
+        if (parser->field &&
+            (kind == KIND_STRING || value[0] == '-' || g_ascii_isdigit (value[0])))
+          {
+            g_free (*parser->field);
+            *parser->field = g_strdup (value);
+          }
+
+        parser->state = STATE_OBJECT_NEXT;
+        return TRUE;
+
+      case STATE_OBJECT_NEXT:
+        if (kind == ',')
+            parser->state = STATE_OBJECT_KEY;
+        else if (kind == '}')
+            finish_object (parser);
+        else
+            goto invalid;
+        return TRUE;
+
+      case STATE_SKIP:
+        if (kind == '[' || kind == '{')
+            parser->skip_depth++;
+        else if ((kind == ']' || kind == '}') && --parser->skip_depth == 0)
+            parser->state = parser->skip_return;
+        return TRUE;
+
+      case STATE_DONE:
+        return TRUE;
+      }
+
+invalid:
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+            parser->state == STATE_START ? "Geoname data is not an array" :
+                                           "Invalid geoname data");
+    return FALSE;
+}
+
+static void
+finish_object (TzGeonameParser *parser)
+{
+    g_ptr_array_add (parser->results, parser->current);
+    parser->current = NULL;
+    parser->field = NULL;
+
+    if (parser->results->len >= parser->max_results)
+        parser->state = STATE_DONE;
+    else
+        parser->state = STATE_ARRAY_NEXT;
+}
+
+static void
+skip_value (TzGeonameParser *parser, ParserState next_state)
+{
+    parser->state = STATE_SKIP;
+    parser->skip_return = next_state;
+    parser->skip_depth = 1;
+}
+
+/* Unescape the contents of a JSON string, or return NULL if they are
+ * invalid */
+static gchar *
+decode_string (const gchar *raw, gsize length)
+{
+    GString *decoded;
+    gsize i;
+
+    decoded = g_string_sized_new (length);
+
+    for (i = 0; i < length; i++)
+      {
+        gunichar c, low;
+        gint hex;
+
+        if (raw[i] != '\\')
+          {
+            g_string_append_c (decoded, raw[i]);
+            continue;
+          }
+
+        if (++i == length)
+            goto invalid;
+
+        switch (raw[i])
+          {
+          case '"': case '\\': case '/':
+            g_string_append_c (decoded, raw[i]);
+            break;
+          case 'b': g_string_append_c (decoded, '\b'); break;
+          case 'f': g_string_append_c (decoded, '\f'); break;
+          case 'n': g_string_append_c (decoded, '\n'); break;
+          case 'r': g_string_append_c (decoded, '\r'); break;
+          case 't': g_string_append_c (decoded, '\t'); break;
+          case 'u':
+            if (length - i < 5 || (hex = decode_hex (raw + i + 1)) < 0)
+                goto invalid;
+
+            c = hex;
+            i += 4;
+
+            /* Characters outside the BMP are written as surrogate pairs */
+            if (c >= 0xd800 && c < 0xdc00)
+              {
+                if (length - i < 7 || raw[i + 1] != '\\' || raw[i + 2] != 'u' ||
+                    (hex = decode_hex (raw + i + 3)) < 0)
+                    goto invalid;
+
+                low = hex;
+                if (low < 0xdc00 || low >= 0xe000)
+                    goto invalid;
+
+                c = 0x10000 + ((c - 0xd800) << 10) + (low - 0xdc00);
+                i += 6;
+              }
+
+            if (c == 0 || !g_unichar_validate (c))
+                goto invalid;
+
+            g_string_append_unichar (decoded, c);
+            break;
+          default:
+            goto invalid;
+          }
+      }
+
+    if (!g_utf8_validate (decoded->str, decoded->len, NULL))
+        goto invalid;
+
+    return g_string_free (decoded, FALSE);
+
+invalid:
+    g_string_free (decoded, TRUE);
+    return NULL;
+}
+
+/* The value of four hex digits, or -1 if they aren't */
+static gint
+decode_hex (const gchar *digits)
+{
+    gint value = 0;
+    gint i;
+
+    for (i = 0; i < 4; i++)
+      {
+        if (!g_ascii_isxdigit (digits[i]))
+            return -1;
+        value = value * 16 + g_ascii_xdigit_value (digits[i]);
+      }
+
+    return value;
+}
+
+static gboolean
+is_literal_char (gchar c)
+{
+    return g_ascii_isalnum (c) || c == '-' || c == '+' || c == '.';
+}
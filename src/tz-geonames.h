@@ -0,0 +1,52 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+/* Streaming parser for geoname lookup results.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+#ifndef _TZ_GEONAMES_H
+#define _TZ_GEONAMES_H
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+typedef struct _TzGeonameParser TzGeonameParser;
+
+typedef struct _TzGeoname {
+    gchar *name;
+    gchar *admin1;
+    gchar *country;
+    gchar *longitude;
+    gchar *latitude;
+} TzGeoname;
+
+TzGeonameParser *tz_geoname_parser_new         (guint max_results);
+void             tz_geoname_parser_free        (TzGeonameParser *parser);
+gboolean         tz_geoname_parser_feed        (TzGeonameParser *parser,
+                                                const gchar     *data,
+                                                gsize            length,
+                                                GError         **error);
+gboolean         tz_geoname_parser_finish      (TzGeonameParser *parser,
+                                                GError         **error);
+gboolean         tz_geoname_parser_is_done     (TzGeonameParser *parser);
+gboolean         tz_geoname_parser_is_complete (TzGeonameParser *parser);
+GPtrArray       *tz_geoname_parser_get_results (TzGeonameParser *parser);
+void             tz_geoname_free               (TzGeoname       *geoname);
+
+G_END_DECLS
+
+#endif
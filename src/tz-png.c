@@ -0,0 +1,299 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+/* Streaming PNG encoder.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+#include <gio/gio.h>
+#include <string.h>
+#include "tz-png.h"
+
+/* Writes a PNG a few rows at a time, so an image never has to be in memory
+ * all at once. Rows are converted from cairo's premultiplied ARGB to
+ * straight RGBA, deflated as they come in, and written out in IDAT chunks
+ * whenever the compressed buffer fills up. */
+
+#define IDAT_SIZE (64 * 1024)
+
+struct _TzPngWriter {
+    GOutputStream *stream;
+    GConverter *compressor;
+    guint32 width;
+    guint32 height;
+    guint32 rows_written;
+    gboolean started;
+
+    /* One row, with its filter type byte */
+    guchar *row;
+
+    /* Compressed data waiting to go out in an IDAT chunk */
+    guchar *idat;
+    gsize idat_length;
+};
+
+static const guchar png_signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+
+
+/* Forward declarations for private functions */
+
+static guint32 crc_update (guint32 crc, const guchar *data, gsize length);
+static void put_uint32 (guchar *data, guint32 value);
+static gboolean write_chunk (TzPngWriter *writer, const gchar *type,
+        const guchar *data, gsize length, GCancellable *cancellable,
+        GError **error);
+static gboolean write_header (TzPngWriter *writer, GCancellable *cancellable,
+        GError **error);
+static gboolean deflate_data (TzPngWriter *writer, const guchar *data,
+        gsize length, gboolean finish, GCancellable *cancellable,
+        GError **error);
+
+
+/* ---------------- *
+ * Public interface *
+ * ---------------- */
+
+/* Start a width by height RGBA image. Nothing is written until the first
+ * rows come in. */
+TzPngWriter *
+tz_png_writer_new (GOutputStream *stream, guint32 width, guint32 height)
+{
+    TzPngWriter *writer;
+
+    writer = g_new0 (TzPngWriter, 1);
+    writer->stream = g_object_ref (stream);
+    writer->compressor = G_CONVERTER (g_zlib_compressor_new (G_ZLIB_COMPRESSOR_FORMAT_ZLIB, -1));
+    writer->width = width;
+    writer->height = height;
+    writer->row = g_malloc (1 + (gsize) width * 4);
+    writer->idat = g_malloc (IDAT_SIZE);
+
+    return writer;
+}
+
+void
+tz_png_writer_free (TzPngWriter *writer)
+{
+    g_object_unref (writer->stream);
+    g_object_unref (writer->compressor);
+    g_free (writer->row);
+    g_free (writer->idat);
+    g_free (writer);
+}
+
+/* Append the first n_rows rows of an ARGB32 image surface as wide as the
+ * image */
+gboolean
+tz_png_writer_write_rows (TzPngWriter *writer, cairo_surface_t *surface,
+        gint n_rows, GCancellable *cancellable, GError **error)
+{
+    const guchar *data;
+    gint stride, y;
+    guint32 x;
+
+    g_return_val_if_fail ((guint32) cairo_image_surface_get_width (surface) == writer->width, FALSE);
+    g_return_val_if_fail (writer->rows_written + n_rows <= writer->height, FALSE);
+
+    if (!writer->started && !write_header (writer, cancellable, error))
+        return FALSE;
+
+    cairo_surface_flush (surface);
+    data = cairo_image_surface_get_data (surface);
+    stride = cairo_image_surface_get_stride (surface);
+
+    for (y = 0; y < n_rows; y++)
+      {
+        const guint32 *pixels = (const guint32 *) (data + y * stride);
+        guchar *out = writer->row;
+
+        /* No filtering */
+        *out++ = 0;
+
+        for (x = 0; x < writer->width; x++)
+          {
+            guint32 pixel = pixels[x];
+            guint alpha = pixel >> 24;
+
+            if (alpha == 0)
+              {
+                out[0] = out[1] = out[2] = out[3] = 0;
+              }
+            else
+              {
+                out[0] = ((((pixel >> 16) & 0xff) * 255) + alpha / 2) / alpha;
+                out[1] = ((((pixel >> 8) & 0xff) * 255) + alpha / 2) / alpha;
+                out[2] = (((pixel & 0xff) * 255) + alpha / 2) / alpha;
+                out[3] = alpha;
+              }
+
+            out += 4;
+          }
+
+        if (!deflate_data (writer, writer->row, 1 + (gsize) writer->width * 4,
+                           FALSE, cancellable, error))
+            return FALSE;
+      }
+
+    writer->rows_written += n_rows;
+
+    return TRUE;
+}
+
+/* Finish the compressed data and end the image. Every row must have been
+ * written. The stream is left open. */
+gboolean
+tz_png_writer_finish (TzPngWriter *writer, GCancellable *cancellable,
+        GError **error)
+{
+    g_return_val_if_fail (writer->rows_written == writer->height, FALSE);
+
+    if (!writer->started && !write_header (writer, cancellable, error))
+        return FALSE;
+
+    return deflate_data (writer, NULL, 0, TRUE, cancellable, error) &&
+           write_chunk (writer, "IEND", NULL, 0, cancellable, error);
+}
+
+
+/* ----------------- *
+ * Private functions *
+ * ----------------- */
+
+static guint32
+crc_update (guint32 crc, const guchar *data, gsize length)
+{
+    static guint32 table[256];
+    static gsize initialized = 0;
+    gsize i;
+
+    if (g_once_init_enter (&initialized))
+      {
+        guint32 n, k;
+
+        for (n = 0; n < 256; n++)
+          {
+            guint32 c = n;
+
+            for (k = 0; k < 8; k++)
+                c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+
+            table[n] = c;
+          }
+
+        g_once_init_leave (&initialized, 1);
+      }
+
+    for (i = 0; i < length; i++)
+        crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+
+    return crc;
+}
+
+static void
+put_uint32 (guchar *data, guint32 value)
+{
+    data[0] = value >> 24;
+    data[1] = value >> 16;
+    data[2] = value >> 8;
+    data[3] = value;
+}
+
+static gboolean
+write_chunk (TzPngWriter *writer, const gchar *type, const guchar *data,
+        gsize length, GCancellable *cancellable, GError **error)
+{
+    guchar header[8], footer[4];
+    guint32 crc;
+
+    put_uint32 (header, length);
+    memcpy (header + 4, type, 4);
+
+    crc = crc_update (0xffffffff, header + 4, 4);
+    crc = crc_update (crc, data, length);
+    put_uint32 (footer, crc ^ 0xffffffff);
+
+    return g_output_stream_write_all (writer->stream, header, sizeof (header),
+                                      NULL, cancellable, error) &&
+           (length == 0 ||
+            g_output_stream_write_all (writer->stream, data, length,
+                                       NULL, cancellable, error)) &&
+           g_output_stream_write_all (writer->stream, footer, sizeof (footer),
+                                      NULL, cancellable, error);
+}
+
+static gboolean
+write_header (TzPngWriter *writer, GCancellable *cancellable, GError **error)
+{
+    guchar ihdr[13];
+
+    writer->started = TRUE;
+
+    put_uint32 (ihdr, writer->width);
+    put_uint32 (ihdr + 4, writer->height);
+    ihdr[8] = 8;     /* bits per channel */
+    ihdr[9] = 6;     /* RGBA */
+    ihdr[10] = 0;    /* deflate */
+    ihdr[11] = 0;    /* adaptive filtering */
+    ihdr[12] = 0;    /* not interlaced */
+
+    return g_output_stream_write_all (writer->stream, png_signature,
+                                      sizeof (png_signature), NULL,
+                                      cancellable, error) &&
+           write_chunk (writer, "IHDR", ihdr, sizeof (ihdr), cancellable,
+                        error);
+}
+
+/* Compress data into the IDAT buffer, writing out each chunk as it fills */
+static gboolean
+deflate_data (TzPngWriter *writer, const guchar *data, gsize length,
+        gboolean finish, GCancellable *cancellable, GError **error)
+{
+    GConverterResult result = G_CONVERTER_CONVERTED;
+
+    while (length > 0 || (finish && result != G_CONVERTER_FINISHED))
+      {
+        gsize bytes_read = 0, bytes_written = 0;
+
+        if (writer->idat_length == IDAT_SIZE)
+          {
+            if (!write_chunk (writer, "IDAT", writer->idat, writer->idat_length,
+                              cancellable, error))
+                return FALSE;
+            writer->idat_length = 0;
+          }
+
+        result = g_converter_convert (writer->compressor, data, length,
+                                      writer->idat + writer->idat_length,
+                                      IDAT_SIZE - writer->idat_length,
+                                      finish ? G_CONVERTER_INPUT_AT_END : G_CONVERTER_NO_FLAGS,
+                                      &bytes_read, &bytes_written, error);
+        if (result == G_CONVERTER_ERROR)
+            return FALSE;
+
+        data += bytes_read;
+        length -= bytes_read;
+        writer->idat_length += bytes_written;
+      }
+
+    if (finish && writer->idat_length > 0)
+      {
+        if (!write_chunk (writer, "IDAT", writer->idat, writer->idat_length,
+                          cancellable, error))
+            return FALSE;
+        writer->idat_length = 0;
+      }
+
+    return TRUE;
+}
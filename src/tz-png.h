@@ -0,0 +1,45 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+/* Streaming PNG encoder.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+#ifndef _TZ_PNG_H
+#define _TZ_PNG_H
+
+#include <gio/gio.h>
+#include <cairo.h>
+
+G_BEGIN_DECLS
+
+typedef struct _TzPngWriter TzPngWriter;
+
+TzPngWriter *tz_png_writer_new        (GOutputStream *stream,
+                                       guint32        width,
+                                       guint32        height);
+void         tz_png_writer_free       (TzPngWriter *writer);
+gboolean     tz_png_writer_write_rows (TzPngWriter     *writer,
+                                       cairo_surface_t *surface,
+                                       gint             n_rows,
+                                       GCancellable    *cancellable,
+                                       GError         **error);
+gboolean     tz_png_writer_finish     (TzPngWriter   *writer,
+                                       GCancellable  *cancellable,
+                                       GError       **error);
+
+G_END_DECLS
+
+#endif
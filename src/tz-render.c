@@ -0,0 +1,483 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+/* Drawing the map without a display.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+#include <glib.h>
+#include <math.h>
+#include "tz-render.h"
+
+/* The pieces of the map that need nothing but cairo: the projection, the
+ * offset regions and the layers drawn over the map. The widget and the
+ * offscreen renderer are both built from these, so a map image looks the
+ * same wherever it is drawn. */
+
+/* The map is equirectangular in longitude, cut in the Pacific, and a
+ * variant of the Miller projection in latitude, cropped to the latitudes the
+ * map covers. Positions are from 0 to 1 across the map. */
+#define PROJECTION_XDEG_OFFSET -6
+#define PROJECTION_TOP_LAT 81
+#define PROJECTION_BOTTOM_LAT -59
+#define PROJECTION_FULL_RANGE 4.6068250867599998
+
+/* Land is painted white in the background layer, and the sea is blue */
+#define PIXEL_IS_LAND(pixel) ((((pixel) >> 16) & 0xff) > 0xd0)
+
+#define WATERMARK_FONT_SIZE 12.0
+#define WATERMARK_MARGIN 5
+
+/* The constant terms of the latitude projection */
+static gdouble projection_top_offset;
+static gdouble projection_range;
+
+
+/* Forward declarations for private functions */
+
+static gdouble radians (gdouble degrees);
+static gdouble miller (gdouble latitude);
+static void init_projection (void);
+static void watermark_position (cairo_t *cr, const gchar *watermark,
+        gdouble width, gdouble height, cairo_text_extents_t *extent,
+        gdouble *x, gdouble *y);
+
+
+/* ---------------- *
+ * Public interface *
+ * ---------------- */
+
+gdouble
+tz_project_longitude (gdouble longitude)
+{
+    gdouble x;
+
+    x = (180.0 + longitude) / 360.0 + PROJECTION_XDEG_OFFSET / 180.0;
+
+    /* If x is negative, wrap back to the beginning */
+    if (x < 0)
+        x = 1.0 + x;
+
+    return x;
+}
+
+gdouble
+tz_project_latitude (gdouble latitude)
+{
+    init_projection ();
+
+    return fabs (miller (latitude) - projection_top_offset) / projection_range;
+}
+
+/* Project every location up front, so that placing them at a particular size
+ * needs no trigonometry. Returns x and y pairs, in the order of locations. */
+gdouble *
+tz_project_locations (GPtrArray *locations)
+{
+    gdouble *points;
+    guint i;
+
+    points = g_new (gdouble, locations->len * 2);
+
+    for (i = 0; i < locations->len; i++)
+      {
+        CcTimezoneLocation *loc = locations->pdata[i];
+
+        points[i * 2] =
+            tz_project_longitude (cc_timezone_location_get_longitude (loc));
+        points[i * 2 + 1] =
+            tz_project_latitude (cc_timezone_location_get_latitude (loc));
+      }
+
+    return points;
+}
+
+/* Return the UTC offset (in hours) for the standard (winter) time at a location */
+gdouble
+tz_location_get_offset (CcTimezoneLocation *location)
+{
+    const gchar *zone_name;
+    GTimeZone *zone;
+    gint interval;
+    gint64 curtime;
+    gint32 offset;
+
+    g_return_val_if_fail (location != NULL, 0);
+    zone_name = cc_timezone_location_get_zone (location);
+    g_return_val_if_fail (zone_name != NULL, 0);
+
+    zone = g_time_zone_new (zone_name);
+
+    /* Query the zone based on the current time, since otherwise the data
+     * may not make sense. */
+    curtime = g_get_real_time () / 1000000;    /* convert to seconds */
+    interval = g_time_zone_find_interval (zone, G_TIME_TYPE_UNIVERSAL, curtime);
+
+    offset = g_time_zone_get_offset (zone, interval);
+    if (g_time_zone_is_dst (zone, interval))
+      {
+        /* Subtract an hour's worth of seconds to get the standard time offset */
+        offset -= (60 * 60);
+      }
+
+    g_time_zone_unref (zone);
+
+    return offset / (60.0 * 60.0);
+}
+
+/* Work out the offset of every location up front, so the offset index can be
+ * rebuilt for each size without touching the zone files. The distinct
+ * offsets are appended to palette, an array of gdouble, and the palette id
+ * of each location is returned in the order of locations. */
+guint8 *
+tz_offsets_load (GPtrArray *locations, GArray *palette)
+{
+    GHashTable *zone_ids;
+    guint8 *ids;
+    guint i;
+
+    ids = g_new0 (guint8, locations->len);
+
+    /* Many locations share a zone, so only look each zone up once */
+    zone_ids = g_hash_table_new (g_str_hash, g_str_equal);
+
+    for (i = 0; i < locations->len; i++)
+      {
+        CcTimezoneLocation *loc = locations->pdata[i];
+        const gchar *zone = cc_timezone_location_get_zone (loc);
+        gpointer id;
+
+        if (zone == NULL)
+            continue;
+
+        if (!g_hash_table_lookup_extended (zone_ids, zone, NULL, &id))
+          {
+            gdouble offset = tz_location_get_offset (loc);
+            guint8 new_id = tz_offsets_find (palette, offset);
+
+            if (new_id == 0 && palette->len < G_MAXUINT8)
+              {
+                g_array_append_val (palette, offset);
+                new_id = palette->len;
+              }
+
+            id = GUINT_TO_POINTER (new_id);
+            g_hash_table_insert (zone_ids, (gpointer) zone, id);
+          }
+
+        ids[i] = GPOINTER_TO_UINT (id);
+      }
+
+    g_hash_table_destroy (zone_ids);
+
+    return ids;
+}
+
+/* Find the palette id of an offset, or 0 if no location uses it */
+guint8
+tz_offsets_find (GArray *palette, gdouble offset)
+{
+    guint i;
+
+    for (i = 0; i < palette->len; i++)
+      {
+        if (g_array_index (palette, gdouble, i) == offset)
+            return i + 1;
+      }
+
+    return 0;
+}
+
+/* Draw the whole map stretched over width by height user units */
+void
+tz_render_map (const TzGeometry *geometry, cairo_t *cr, gdouble width,
+        gdouble height)
+{
+    cairo_save (cr);
+    cairo_scale (cr,
+                 width / tz_geometry_get_width (geometry),
+                 height / tz_geometry_get_height (geometry));
+    tz_geometry_render (geometry, cr);
+    cairo_restore (cr);
+}
+
+/* Rasterize the offset regions for a rendered background. Each location
+ * claims the land pixel under it, and the claims are then flooded outwards
+ * over the land breadth-first, so every pixel ends up with the offset of the
+ * nearest location on the same land mass. Only reads its arguments, so it is
+ * safe to call from any thread. */
+guint8 *
+tz_render_offset_index (guint n_locations, const gdouble *location_points,
+        const guint8 *location_offset_ids, cairo_surface_t *background)
+{
+    const guchar *data;
+    guint8 *index;
+    guint32 *queue;
+    guint head = 0, tail = 0;
+    gint width, height, stride;
+    guint i;
+
+    width = cairo_image_surface_get_width (background);
+    height = cairo_image_surface_get_height (background);
+    stride = cairo_image_surface_get_stride (background);
+    data = cairo_image_surface_get_data (background);
+
+    if (!data || width <= 0 || height <= 0)
+        return NULL;
+
+    index = g_new0 (guint8, width * height);
+    queue = g_new (guint32, width * height);
+
+    for (i = 0; i < n_locations; i++)
+      {
+        guint8 id = location_offset_ids[i];
+        guint32 pixel;
+        gint x, y;
+
+        if (id == 0)
+            continue;
+
+        x = (gint) (location_points[i * 2] * width);
+        y = (gint) (location_points[i * 2 + 1] * height);
+
+        if (x < 0 || x >= width || y < 0 || y >= height)
+            continue;
+
+        pixel = *(const guint32 *) (data + y * stride + x * 4);
+        if (!PIXEL_IS_LAND (pixel) || index[y * width + x] != 0)
+            continue;
+
+        index[y * width + x] = id;
+        queue[tail++] = y * width + x;
+      }
+
+    while (head < tail)
+      {
+        guint32 p = queue[head++];
+        gint x = p % width;
+        gint y = p / width;
+        gint n;
+        const gint neighbours[4][2] = {
+            { x - 1, y }, { x + 1, y }, { x, y - 1 }, { x, y + 1 }
+        };
+
+        for (n = 0; n < 4; n++)
+          {
+            gint nx = neighbours[n][0];
+            gint ny = neighbours[n][1];
+            guint32 pixel;
+
+            if (ny < 0 || ny >= height)
+                continue;
+
+            /* The map wraps around at the date line */
+            if (nx < 0)
+                nx = width - 1;
+            else if (nx >= width)
+                nx = 0;
+
+            if (index[ny * width + nx] != 0)
+                continue;
+
+            pixel = *(const guint32 *) (data + ny * stride + nx * 4);
+            if (!PIXEL_IS_LAND (pixel))
+                continue;
+
+            index[ny * width + nx] = index[p];
+            queue[tail++] = ny * width + nx;
+          }
+      }
+
+    g_free (queue);
+
+    return index;
+}
+
+/* Find the bounding box of every offset id in an offset index. extents has
+ * room for G_MAXUINT8 + 1 rectangles. */
+void
+tz_render_offset_extents (const guint8 *index, gint width, gint height,
+        cairo_rectangle_int_t *extents)
+{
+    gint x1[G_MAXUINT8 + 1], y1[G_MAXUINT8 + 1];
+    gint x2[G_MAXUINT8 + 1], y2[G_MAXUINT8 + 1];
+    gint x, y, id;
+
+    for (id = 0; id <= G_MAXUINT8; id++)
+      {
+        x1[id] = y1[id] = G_MAXINT;
+        x2[id] = y2[id] = -1;
+      }
+
+    for (y = 0; y < height; y++)
+      {
+        const guint8 *row = index + y * width;
+
+        for (x = 0; x < width; x++)
+          {
+            id = row[x];
+            x1[id] = MIN (x1[id], x);
+            x2[id] = MAX (x2[id], x);
+            y1[id] = MIN (y1[id], y);
+            y2[id] = MAX (y2[id], y);
+          }
+      }
+
+    for (id = 0; id <= G_MAXUINT8; id++)
+      {
+        if (x2[id] < 0)
+          {
+            extents[id].x = extents[id].y = 0;
+            extents[id].width = extents[id].height = 0;
+          }
+        else
+          {
+            extents[id].x = x1[id];
+            extents[id].y = y1[id];
+            extents[id].width = x2[id] - x1[id] + 1;
+            extents[id].height = y2[id] - y1[id] + 1;
+          }
+      }
+}
+
+/* Build an A8 mask covering the pixels of one offset, at the device scale
+ * the index was rendered at */
+cairo_pattern_t *
+tz_render_highlight_mask (const guint8 *index, gint width, gint height,
+        gint scale, guint8 id)
+{
+    cairo_surface_t *mask;
+    cairo_pattern_t *pattern;
+    guchar *data;
+    gint stride, x, y;
+
+    mask = cairo_image_surface_create (CAIRO_FORMAT_A8, width, height);
+    cairo_surface_set_device_scale (mask, scale, scale);
+    cairo_surface_flush (mask);
+    data = cairo_image_surface_get_data (mask);
+    stride = cairo_image_surface_get_stride (mask);
+
+    for (y = 0; y < height; y++)
+      {
+        const guint8 *row = index + y * width;
+
+        for (x = 0; x < width; x++)
+            data[y * stride + x] = (row[x] == id) ? 0xff : 0x00;
+      }
+
+    cairo_surface_mark_dirty (mask);
+
+    pattern = cairo_pattern_create_for_surface (mask);
+    cairo_surface_destroy (mask);
+
+    return pattern;
+}
+
+void
+tz_render_highlight (cairo_t *cr, cairo_pattern_t *mask, gdouble alpha)
+{
+    cairo_set_source_rgba (cr, 0.96, 0.76, 0.07, 0.6 * alpha);
+    cairo_mask (cr, mask);
+}
+
+/* Draw the lighter highlight of the offset under the pointer */
+void
+tz_render_hover (cairo_t *cr, cairo_pattern_t *mask, gdouble alpha)
+{
+    cairo_set_source_rgba (cr, 1.0, 1.0, 1.0, 0.35 * alpha);
+    cairo_mask (cr, mask);
+}
+
+/* Draw the watermark in the bottom right corner of a width by height map */
+void
+tz_render_watermark (cairo_t *cr, const gchar *watermark, gdouble width,
+        gdouble height)
+{
+    cairo_text_extents_t extent;
+    gdouble x, y;
+
+    cairo_save (cr);
+    watermark_position (cr, watermark, width, height, &extent, &x, &y);
+    cairo_set_source_rgba (cr, 1, 1, 1, 0.5);
+    cairo_move_to (cr, x, y);
+    cairo_show_text (cr, watermark);
+    cairo_restore (cr);
+}
+
+/* The area tz_render_watermark() draws over */
+void
+tz_render_watermark_extents (const gchar *watermark, gdouble width,
+        gdouble height, cairo_rectangle_t *extents)
+{
+    cairo_text_extents_t extent;
+    cairo_surface_t *surface;
+    cairo_t *cr;
+    gdouble x, y;
+
+    surface = cairo_image_surface_create (CAIRO_FORMAT_A8, 1, 1);
+    cr = cairo_create (surface);
+    watermark_position (cr, watermark, width, height, &extent, &x, &y);
+    cairo_destroy (cr);
+    cairo_surface_destroy (surface);
+
+    extents->x = x + extent.x_bearing;
+    extents->y = y + extent.y_bearing;
+    extents->width = extent.width;
+    extents->height = extent.height;
+}
+
+
+/* ----------------- *
+ * Private functions *
+ * ----------------- */
+
+static gdouble
+radians (gdouble degrees)
+{
+    return (degrees / 360.0) * G_PI * 2;
+}
+
+static gdouble
+miller (gdouble latitude)
+{
+    return 1.25 * log (tan (G_PI_4 + 0.4 * radians (latitude)));
+}
+
+static void
+init_projection (void)
+{
+    static gsize initialized = 0;
+
+    if (g_once_init_enter (&initialized))
+      {
+        projection_top_offset = PROJECTION_FULL_RANGE * PROJECTION_TOP_LAT / 180.0;
+        projection_range = fabs (miller (PROJECTION_BOTTOM_LAT) - projection_top_offset);
+        g_once_init_leave (&initialized, 1);
+      }
+}
+
+/* Select the watermark font on cr, and find where the text starts */
+static void
+watermark_position (cairo_t *cr, const gchar *watermark, gdouble width,
+        gdouble height, cairo_text_extents_t *extent, gdouble *x, gdouble *y)
+{
+    cairo_select_font_face (cr, "Sans", CAIRO_FONT_SLANT_NORMAL,
+            CAIRO_FONT_WEIGHT_NORMAL);
+    cairo_set_font_size (cr, WATERMARK_FONT_SIZE);
+    cairo_text_extents (cr, watermark, extent);
+
+    *x = width - extent->x_advance + extent->x_bearing - WATERMARK_MARGIN;
+    *y = height - extent->height - extent->y_bearing - WATERMARK_MARGIN;
+}
@@ -0,0 +1,79 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+/* Drawing the map without a display.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+#ifndef _TZ_RENDER_H
+#define _TZ_RENDER_H
+
+#include <glib.h>
+#include <cairo.h>
+
+#include "tz.h"
+#include "tz-geometry.h"
+
+G_BEGIN_DECLS
+
+/* The point of the pin icon, from its top left corner */
+#define TZ_PIN_POINT_X 8
+#define TZ_PIN_POINT_Y 14
+
+gdouble          tz_project_longitude        (gdouble longitude);
+gdouble          tz_project_latitude         (gdouble latitude);
+gdouble         *tz_project_locations        (GPtrArray *locations);
+
+gdouble          tz_location_get_offset      (CcTimezoneLocation *location);
+guint8          *tz_offsets_load             (GPtrArray *locations,
+                                              GArray    *palette);
+guint8           tz_offsets_find             (GArray    *palette,
+                                              gdouble    offset);
+
+void             tz_render_map               (const TzGeometry *geometry,
+                                              cairo_t          *cr,
+                                              gdouble           width,
+                                              gdouble           height);
+guint8          *tz_render_offset_index      (guint            n_locations,
+                                              const gdouble   *location_points,
+                                              const guint8    *location_offset_ids,
+                                              cairo_surface_t *background);
+void             tz_render_offset_extents    (const guint8          *index,
+                                              gint                   width,
+                                              gint                   height,
+                                              cairo_rectangle_int_t *extents);
+cairo_pattern_t *tz_render_highlight_mask    (const guint8 *index,
+                                              gint          width,
+                                              gint          height,
+                                              gint          scale,
+                                              guint8        id);
+void             tz_render_highlight         (cairo_t         *cr,
+                                              cairo_pattern_t *mask,
+                                              gdouble          alpha);
+void             tz_render_hover             (cairo_t         *cr,
+                                              cairo_pattern_t *mask,
+                                              gdouble          alpha);
+void             tz_render_watermark         (cairo_t     *cr,
+                                              const gchar *watermark,
+                                              gdouble      width,
+                                              gdouble      height);
+void             tz_render_watermark_extents (const gchar       *watermark,
+                                              gdouble            width,
+                                              gdouble            height,
+                                              cairo_rectangle_t *extents);
+
+G_END_DECLS
+
+#endif
@@ -0,0 +1,642 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+/* Local search of the location database.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+#include <glib.h>
+#include <string.h>
+#include "tz-search.h"
+
+/* The city, admin1 and country names of every location are casefolded and
+ * stripped of accents into one string pool. Every word of every name is a
+ * key: the rest of the name from the start of that word. The keys are
+ * sorted, so the keys starting with a query are one contiguous run, found by
+ * binary search.
+ *
+ * Each location is ranked by its best matching key: city names before
+ * admin1 names before country names, and whole names before later words.
+ * Ties go to exact matches, then to shorter names.
+ *
+ * Longer queries also match city names with a typo or two. The trigrams of
+ * every city name are indexed, and only names sharing enough trigrams with
+ * the query have their edit distance from it computed. These rank after all
+ * prefix matches, closest first. */
+
+typedef enum {
+    FIELD_NAME,
+    FIELD_ADMIN1,
+    FIELD_COUNTRY,
+    N_FIELDS
+} Field;
+
+typedef struct Key {
+    guint32 offset;
+    guint32 location;
+} Key;
+
+typedef struct Candidate {
+    guint32 location;
+    guint32 rank;
+} Candidate;
+
+typedef struct Gram {
+    guint32 gram;
+    guint32 location;
+} Gram;
+
+struct _TzSearch {
+    GPtrArray *locations;
+
+    /* Folded names, each NUL terminated */
+    gchar *pool;
+
+    /* The folded city name of each location, as an offset into the pool */
+    guint32 *names;
+
+    Key *keys;
+    guint n_keys;
+
+    /* The distinct trigrams of city names, sorted, and for each one the
+     * locations having it, from gram_starts[i] to gram_starts[i + 1] */
+    guint32 *grams;
+    guint32 *gram_starts;
+    guint32 *gram_locations;
+    guint n_grams;
+
+    /* The trigrams each location shares with the current query, and the
+     * locations sharing any */
+    guint8 *gram_counts;
+    GArray *gram_matched;
+
+    /* The best rank of each location in the current query, plus one, and
+     * the locations which have one, so they can be reset afterwards */
+    guint32 *ranks;
+    GArray *matched;
+};
+
+/* Rank components, lowest first */
+#define RANK_WORD 1
+#define RANK_FIELD 2
+#define RANK_INEXACT (RANK_FIELD * N_FIELDS)
+#define RANK_FUZZY (RANK_INEXACT * 2)
+
+/* Shortest query to look for typos in, and the edits allowed in it */
+#define FUZZY_MIN_LENGTH 6
+#define FUZZY_LONG_LENGTH 10
+#define FUZZY_MAX_LENGTH 48
+#define FUZZY_MAX_DISTANCE 2
+
+/* An adjacent transposition changes up to four trigrams */
+#define FUZZY_GRAMS_PER_EDIT 4
+
+
+/* Forward declarations for private functions */
+
+static gchar *fold_text (const gchar *text);
+static void add_keys (GString *pool, GArray *keys, guint32 location,
+        Field field, const gchar *text, guint32 *field_offset);
+static gint compare_keys (gconstpointer a, gconstpointer b,
+        gpointer user_data);
+static gint compare_candidates (gconstpointer a, gconstpointer b,
+        gpointer user_data);
+static guint find_first_key (TzSearch *search, const gchar *prefix);
+static void add_candidate (TzSearch *search, guint32 location, guint32 rank);
+static void match_prefix (TzSearch *search, const gchar *prefix);
+static void index_grams (TzSearch *search);
+static void add_grams (GArray *grams, const gchar *text, guint32 location);
+static gint compare_grams (gconstpointer a, gconstpointer b);
+static void match_fuzzy (TzSearch *search, const gchar *query);
+static guint get_prefix_distance (const gchar *query, gsize query_length,
+        const gchar *name, guint max_distance);
+
+
+/* ---------------- *
+ * Public interface *
+ * ---------------- */
+
+/* Index the names of locations, an array of CcTimezoneLocation. The
+ * locations are referenced, not copied. */
+TzSearch *
+tz_search_new (GPtrArray *locations)
+{
+    TzSearch *search;
+    GString *pool;
+    GArray *keys;
+    guint i;
+
+    search = g_new0 (TzSearch, 1);
+    search->locations = g_ptr_array_ref (locations);
+    search->names = g_new0 (guint32, locations->len);
+    search->ranks = g_new0 (guint32, locations->len);
+    search->matched = g_array_new (FALSE, FALSE, sizeof (Candidate));
+
+    pool = g_string_new (NULL);
+    keys = g_array_new (FALSE, FALSE, sizeof (Key));
+
+    for (i = 0; i < locations->len; i++)
+      {
+        CcTimezoneLocation *loc = locations->pdata[i];
+
+        add_keys (pool, keys, i, FIELD_NAME,
+                  cc_timezone_location_get_en_name (loc), &search->names[i]);
+        add_keys (pool, keys, i, FIELD_ADMIN1,
+                  cc_timezone_location_get_state (loc), NULL);
+        add_keys (pool, keys, i, FIELD_COUNTRY,
+                  cc_timezone_location_get_full_country (loc), NULL);
+      }
+
+    search->pool = g_string_free (pool, FALSE);
+    search->n_keys = keys->len;
+    search->keys = (Key *) g_array_free (keys, FALSE);
+
+    g_qsort_with_data (search->keys, search->n_keys, sizeof (Key),
+                       compare_keys, search->pool);
+
+    index_grams (search);
+
+    return search;
+}
+
+void
+tz_search_free (TzSearch *search)
+{
+    g_ptr_array_unref (search->locations);
+    g_free (search->pool);
+    g_free (search->names);
+    g_free (search->keys);
+    g_free (search->grams);
+    g_free (search->gram_starts);
+    g_free (search->gram_locations);
+    g_free (search->gram_counts);
+    g_array_free (search->gram_matched, TRUE);
+    g_free (search->ranks);
+    g_array_free (search->matched, TRUE);
+    g_free (search);
+}
+
+/* Find the locations with a name starting with text, or with a word in a
+ * name starting with it, or with a city name starting close to it, best
+ * first. Returns up to max_results CcTimezoneLocation, which belong to the
+ * search. */
+GPtrArray *
+tz_search_query (TzSearch *search, const gchar *text, guint max_results)
+{
+    GPtrArray *results;
+    gchar *prefix;
+    guint i;
+
+    results = g_ptr_array_new ();
+
+    prefix = fold_text (text);
+    if (prefix[0] == '\0')
+      {
+        g_free (prefix);
+        return results;
+      }
+
+    match_prefix (search, prefix);
+    match_fuzzy (search, prefix);
+
+    g_free (prefix);
+
+    /* Pick up the best rank of each location, and reset for the next query */
+    for (i = 0; i < search->matched->len; i++)
+      {
+        Candidate *candidate = &g_array_index (search->matched, Candidate, i);
+
+        candidate->rank = search->ranks[candidate->location] - 1;
+        search->ranks[candidate->location] = 0;
+      }
+
+    g_array_sort_with_data (search->matched, compare_candidates, search);
+
+    for (i = 0; i < search->matched->len && i < max_results; i++)
+      {
+        Candidate *candidate = &g_array_index (search->matched, Candidate, i);
+
+        g_ptr_array_add (results, search->locations->pdata[candidate->location]);
+      }
+
+    g_array_set_size (search->matched, 0);
+
+    return results;
+}
+
+
+/* ----------------- *
+ * Private functions *
+ * ----------------- */
+
+/* Casefold text, strip it of accents, and collapse runs of spaces */
+static gchar *
+fold_text (const gchar *text)
+{
+    gchar *casefolded, *decomposed;
+    GString *folded;
+    const gchar *p;
+
+    if (text == NULL)
+        return g_strdup ("");
+
+    casefolded = g_utf8_casefold (text, -1);
+    decomposed = g_utf8_normalize (casefolded, -1, G_NORMALIZE_ALL);
+    g_free (casefolded);
+
+    if (decomposed == NULL)
+        return g_strdup ("");
+
+    folded = g_string_sized_new (strlen (decomposed));
+
+    /* Decomposing leaves accents as combining marks after their letters */
+    for (p = g_strstrip (decomposed); *p; p = g_utf8_next_char (p))
+      {
+        gunichar c = g_utf8_get_char (p);
+
+        if (g_unichar_ismark (c))
+            continue;
+        if (c == ' ' && p[1] == ' ')
+            continue;
+        g_string_append_unichar (folded, c);
+      }
+
+    g_free (decomposed);
+
+    return g_string_free (folded, FALSE);
+}
+
+/* Append a folded field to the pool, tagged with its field, and a key for
+ * every word in it */
+static void
+add_keys (GString *pool, GArray *keys, guint32 location, Field field,
+        const gchar *text, guint32 *field_offset)
+{
+    gchar *folded;
+    guint32 offset;
+    const gchar *p;
+    gboolean word_start = TRUE;
+
+    if (text == NULL || text[0] == '\0')
+        return;
+
+    folded = fold_text (text);
+
+    /* The tag can't be mistaken for text, since it is a control character */
+    g_string_append_c (pool, field + 1);
+    offset = pool->len;
+    g_string_append_len (pool, folded, strlen (folded) + 1);
+
+    if (field_offset)
+        *field_offset = offset;
+
+    for (p = folded; *p; p = g_utf8_next_char (p))
+      {
+        gunichar c = g_utf8_get_char (p);
+
+        if (g_unichar_isalnum (c))
+          {
+            if (word_start)
+              {
+                Key key = { offset + (p - folded), location };
+
+                g_array_append_val (keys, key);
+              }
+            word_start = FALSE;
+          }
+        else
+          {
+            word_start = TRUE;
+          }
+      }
+
+    g_free (folded);
+}
+
+static gint
+compare_keys (gconstpointer a, gconstpointer b, gpointer user_data)
+{
+    const gchar *pool = user_data;
+
+    return strcmp (pool + ((const Key *) a)->offset,
+                   pool + ((const Key *) b)->offset);
+}
+
+static gint
+compare_candidates (gconstpointer a, gconstpointer b, gpointer user_data)
+{
+    const Candidate *ca = a;
+    const Candidate *cb = b;
+    TzSearch *search = user_data;
+    const gchar *name_a, *name_b;
+    gsize length_a, length_b;
+
+    if (ca->rank != cb->rank)
+        return ca->rank < cb->rank ? -1 : 1;
+
+    name_a = search->pool + search->names[ca->location];
+    name_b = search->pool + search->names[cb->location];
+    length_a = strlen (name_a);
+    length_b = strlen (name_b);
+
+    if (length_a != length_b)
+        return length_a < length_b ? -1 : 1;
+
+    return strcmp (name_a, name_b);
+}
+
+/* Binary search for the first key not sorting before prefix */
+static guint
+find_first_key (TzSearch *search, const gchar *prefix)
+{
+    guint low = 0, high = search->n_keys;
+
+    while (low < high)
+      {
+        guint middle = low + (high - low) / 2;
+
+        if (strcmp (search->pool + search->keys[middle].offset, prefix) < 0)
+            low = middle + 1;
+        else
+            high = middle;
+      }
+
+    return low;
+}
+
+/* Note a match of location, keeping its best rank */
+static void
+add_candidate (TzSearch *search, guint32 location, guint32 rank)
+{
+    if (search->ranks[location] == 0)
+      {
+        Candidate candidate = { location, rank };
+
+        g_array_append_val (search->matched, candidate);
+        search->ranks[location] = rank + 1;
+      }
+    else if (rank + 1 < search->ranks[location])
+      {
+        search->ranks[location] = rank + 1;
+      }
+}
+
+static void
+match_prefix (TzSearch *search, const gchar *prefix)
+{
+    gsize length = strlen (prefix);
+    guint i;
+
+    for (i = find_first_key (search, prefix); i < search->n_keys; i++)
+      {
+        const Key *key = &search->keys[i];
+        const gchar *key_text = search->pool + key->offset;
+        const gchar *field_text;
+        guint32 rank;
+
+        if (strncmp (key_text, prefix, length) != 0)
+            break;
+
+        /* The field and word of a key are found from the pool, which holds
+         * a field tag byte before each field */
+        field_text = key_text;
+        while ((guchar) field_text[-1] > N_FIELDS)
+            field_text--;
+
+        rank = ((guchar) field_text[-1] - 1) * RANK_FIELD;
+        if (field_text != key_text)
+            rank += RANK_WORD;
+        if (key_text[length] != '\0')
+            rank += RANK_INEXACT;
+
+        add_candidate (search, key->location, rank);
+      }
+}
+
+/* Build the trigram index of the folded city names */
+static void
+index_grams (TzSearch *search)
+{
+    GArray *grams;
+    Gram *gram;
+    guint i, n;
+
+    grams = g_array_new (FALSE, FALSE, sizeof (Gram));
+    for (i = 0; i < search->locations->len; i++)
+      {
+        if (search->names[i] != 0)
+            add_grams (grams, search->pool + search->names[i], i);
+      }
+
+    g_array_sort (grams, compare_grams);
+
+    search->gram_starts = g_new (guint32, grams->len + 1);
+    search->gram_locations = g_new (guint32, grams->len);
+    search->grams = g_new (guint32, grams->len);
+
+    /* Names repeating a trigram list it twice; keep one */
+    gram = (Gram *) grams->data;
+    for (i = 0, n = 0; i < grams->len; i++)
+      {
+        if (i > 0 && gram[i].gram == gram[i - 1].gram &&
+            gram[i].location == gram[i - 1].location)
+            continue;
+
+        if (search->n_grams == 0 ||
+            search->grams[search->n_grams - 1] != gram[i].gram)
+          {
+            search->grams[search->n_grams] = gram[i].gram;
+            search->gram_starts[search->n_grams] = n;
+            search->n_grams++;
+          }
+        search->gram_locations[n++] = gram[i].location;
+      }
+    search->gram_starts[search->n_grams] = n;
+
+    g_array_free (grams, TRUE);
+
+    search->gram_counts = g_new0 (guint8, search->locations->len);
+    search->gram_matched = g_array_new (FALSE, FALSE, sizeof (guint32));
+}
+
+/* Append the byte trigrams of text, starting with a space so the first
+ * letters count as well */
+static void
+add_grams (GArray *grams, const gchar *text, guint32 location)
+{
+    guint32 gram = ' ';
+    const guchar *p;
+
+    for (p = (const guchar *) text; *p; p++)
+      {
+        gram = ((gram << 8) | *p) & 0xffffff;
+        if (p - (const guchar *) text >= 1)
+          {
+            Gram entry = { gram, location };
+
+            g_array_append_val (grams, entry);
+          }
+      }
+}
+
+static gint
+compare_grams (gconstpointer a, gconstpointer b)
+{
+    const Gram *ga = a;
+    const Gram *gb = b;
+
+    if (ga->gram != gb->gram)
+        return ga->gram < gb->gram ? -1 : 1;
+    if (ga->location != gb->location)
+        return ga->location < gb->location ? -1 : 1;
+    return 0;
+}
+
+/* Match the city names starting within a few edits of query */
+static void
+match_fuzzy (TzSearch *search, const gchar *query)
+{
+    gsize length = strlen (query);
+    guint max_distance;
+    GArray *grams;
+    guint n_grams, min_count, i, j;
+
+    if (length < FUZZY_MIN_LENGTH || length > FUZZY_MAX_LENGTH)
+        return;
+
+    max_distance = length < FUZZY_LONG_LENGTH ? 1 : FUZZY_MAX_DISTANCE;
+
+    grams = g_array_new (FALSE, FALSE, sizeof (Gram));
+    add_grams (grams, query, 0);
+    g_array_sort (grams, compare_grams);
+
+    /* Each edit can take away a few of the trigrams the query shares with
+     * a close name, but no more */
+    for (i = 0, n_grams = 0; i < grams->len; i++)
+      {
+        if (i == 0 || g_array_index (grams, Gram, i).gram !=
+                      g_array_index (grams, Gram, i - 1).gram)
+            g_array_index (grams, Gram, n_grams++) =
+                g_array_index (grams, Gram, i);
+      }
+    if (n_grams <= max_distance * FUZZY_GRAMS_PER_EDIT)
+      {
+        g_array_free (grams, TRUE);
+        return;
+      }
+    min_count = n_grams - max_distance * FUZZY_GRAMS_PER_EDIT;
+
+    for (i = 0; i < n_grams; i++)
+      {
+        guint32 gram = g_array_index (grams, Gram, i).gram;
+        guint low = 0, high = search->n_grams;
+
+        while (low < high)
+          {
+            guint middle = low + (high - low) / 2;
+
+            if (search->grams[middle] < gram)
+                low = middle + 1;
+            else
+                high = middle;
+          }
+
+        if (low == search->n_grams || search->grams[low] != gram)
+            continue;
+
+        for (j = search->gram_starts[low]; j < search->gram_starts[low + 1]; j++)
+          {
+            guint32 location = search->gram_locations[j];
+
+            if (search->gram_counts[location]++ == 0)
+                g_array_append_val (search->gram_matched, location);
+          }
+      }
+
+    g_array_free (grams, TRUE);
+
+    for (i = 0; i < search->gram_matched->len; i++)
+      {
+        guint32 location = g_array_index (search->gram_matched, guint32, i);
+        guint distance;
+
+        if (search->gram_counts[location] >= min_count)
+          {
+            distance = get_prefix_distance (query, length,
+                                            search->pool + search->names[location],
+                                            max_distance);
+            if (distance > 0 && distance <= max_distance)
+                add_candidate (search, location, RANK_FUZZY + distance);
+          }
+
+        search->gram_counts[location] = 0;
+      }
+
+    g_array_set_size (search->gram_matched, 0);
+}
+
+/* The fewest insertions, deletions, substitutions and swaps of adjacent
+ * bytes turning query into the start of name, or more than max_distance if
+ * that is too many */
+static guint
+get_prefix_distance (const gchar *query, gsize query_length,
+        const gchar *name, guint max_distance)
+{
+    guint rows[3][FUZZY_MAX_LENGTH + FUZZY_MAX_DISTANCE + 1];
+    guint *previous = rows[0], *row = rows[1], *next = rows[2], *swap;
+    gsize name_length, i, j;
+    guint best;
+
+    /* Only the start of name as long as query, give or take the edits, can
+     * be the closest */
+    name_length = MIN (strlen (name), query_length + max_distance);
+
+    for (j = 0; j <= name_length; j++)
+        row[j] = j;
+
+    for (i = 1; i <= query_length; i++)
+      {
+        guint row_best;
+
+        next[0] = row_best = i;
+        for (j = 1; j <= name_length; j++)
+          {
+            guint cost = query[i - 1] == name[j - 1] ? 0 : 1;
+            guint distance = MIN (row[j] + 1, next[j - 1] + 1);
+
+            distance = MIN (distance, row[j - 1] + cost);
+            if (i > 1 && j > 1 && query[i - 1] == name[j - 2] &&
+                query[i - 2] == name[j - 1])
+                distance = MIN (distance, previous[j - 2] + 1);
+
+            next[j] = distance;
+            row_best = MIN (row_best, distance);
+          }
+
+        if (row_best > max_distance)
+            return max_distance + 1;
+
+        swap = previous;
+        previous = row;
+        row = next;
+        next = swap;
+      }
+
+    best = row[0];
+    for (j = 1; j <= name_length; j++)
+        best = MIN (best, row[j]);
+
+    return best;
+}
@@ -0,0 +1,39 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+/* Local search of the location database.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+#ifndef _TZ_SEARCH_H
+#define _TZ_SEARCH_H
+
+#include <glib.h>
+
+#include "cc-timezone-location.h"
+
+G_BEGIN_DECLS
+
+typedef struct _TzSearch TzSearch;
+
+TzSearch  *tz_search_new   (GPtrArray *locations);
+void       tz_search_free  (TzSearch *search);
+GPtrArray *tz_search_query (TzSearch    *search,
+                            const gchar *text,
+                            guint        max_results);
+
+G_END_DECLS
+
+#endif
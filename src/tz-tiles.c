@@ -0,0 +1,346 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+/* Tiled rendering of the map for zoomed views.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+#include <glib.h>
+#include <math.h>
+#include "tz-render.h"
+#include "tz-tiles.h"
+
+/* The map is cut into a pyramid of TZ_TILE_SIZE square tiles. At level n the
+ * whole map is TZ_TILE_SIZE << n pixels wide, so each level doubles the
+ * resolution of the one before. Tiles are rendered from the geometry in a
+ * pool of worker threads and kept in memory, most recently used first, until
+ * the cache goes over its size limit.
+ *
+ * Everything except rendering happens on the main thread. Workers only read
+ * the geometry, which never changes, and the visible area, which is guarded
+ * by a lock so that tiles scrolled out of view before a worker gets to them
+ * are skipped. */
+
+#define MAX_LEVEL 12
+#define TILE_BYTES (TZ_TILE_SIZE * TZ_TILE_SIZE * 4)
+
+struct _TzTileCache {
+    volatile gint ref_count;
+    gboolean freed;
+
+    const TzGeometry *geometry;
+    GThreadPool *pool;
+    TzTileReadyFunc ready;
+    gpointer user_data;
+
+    /* Tile keys to tiles, both rendered and still rendering */
+    GHashTable *tiles;
+
+    /* Rendered tiles, most recently used first */
+    GQueue lru;
+    gsize size;
+    gsize max_size;
+
+    GMutex lock;
+    guint visible_level;
+    gint visible_x1, visible_y1, visible_x2, visible_y2;
+};
+
+typedef struct Tile {
+    gint64 key;
+    guint level;
+    gint x;
+    gint y;
+
+    /* NULL while the tile is being rendered */
+    cairo_surface_t *surface;
+    GList link;
+} Tile;
+
+/* A tile on its way to and back from a worker */
+typedef struct TileJob {
+    TzTileCache *cache;
+    gint64 key;
+    guint level;
+    gint x;
+    gint y;
+    cairo_surface_t *surface;
+} TileJob;
+
+
+/* Forward declarations for private functions */
+
+static gint64 tile_key (guint level, gint x, gint y);
+static void tile_free (Tile *tile);
+static gboolean tile_is_visible (TzTileCache *cache, guint level, gint x,
+        gint y);
+static void cache_unref (TzTileCache *cache);
+static void cache_trim (TzTileCache *cache);
+static void render_tile (gpointer data, gpointer user_data);
+static gboolean tile_ready (gpointer user_data);
+
+
+/* ---------------- *
+ * Public interface *
+ * ---------------- */
+
+/* Create a cache of tiles rendered from geometry, holding up to max_size
+ * bytes of tiles besides the visible ones. ready is called on the main
+ * thread whenever a tile finishes rendering. */
+TzTileCache *
+tz_tile_cache_new (const TzGeometry *geometry, gsize max_size,
+        TzTileReadyFunc ready, gpointer user_data)
+{
+    TzTileCache *cache;
+
+    cache = g_new0 (TzTileCache, 1);
+    cache->ref_count = 1;
+    cache->geometry = geometry;
+    cache->max_size = max_size;
+    cache->ready = ready;
+    cache->user_data = user_data;
+    cache->tiles = g_hash_table_new_full (g_int64_hash, g_int64_equal, NULL,
+            (GDestroyNotify) tile_free);
+    g_queue_init (&cache->lru);
+    g_mutex_init (&cache->lock);
+    cache->visible_level = G_MAXUINT;
+
+    cache->pool = g_thread_pool_new (render_tile, cache,
+            g_get_num_processors (), FALSE, NULL);
+
+    return cache;
+}
+
+/* Free the cache. Tiles still queued are skipped, and tiles already rendering
+ * are waited for, so the geometry may be freed once this returns. */
+void
+tz_tile_cache_free (TzTileCache *cache)
+{
+    g_mutex_lock (&cache->lock);
+    cache->visible_level = G_MAXUINT;
+    g_mutex_unlock (&cache->lock);
+
+    g_thread_pool_free (cache->pool, FALSE, TRUE);
+    cache->pool = NULL;
+
+    /* The queue links are part of the tiles, so there is nothing to free */
+    g_queue_init (&cache->lru);
+    g_hash_table_destroy (cache->tiles);
+    cache->tiles = NULL;
+    cache->freed = TRUE;
+
+    /* Results of finished tiles may still be on their way back */
+    cache_unref (cache);
+}
+
+/* The lowest level with at least map_width pixels across the map */
+guint
+tz_tile_cache_pick_level (TzTileCache *cache, gdouble map_width)
+{
+    guint level = 0;
+
+    while (level < MAX_LEVEL && (TZ_TILE_SIZE << level) < map_width)
+        level++;
+
+    return level;
+}
+
+void
+tz_tile_cache_get_level_size (TzTileCache *cache, guint level, gint *width,
+        gint *height)
+{
+    *width = TZ_TILE_SIZE << level;
+    *height = ceil (*width * tz_geometry_get_height (cache->geometry) /
+                    tz_geometry_get_width (cache->geometry));
+}
+
+/* Set the range of tiles in view, from x1, y1 up to but not including x2, y2.
+ * Only tiles in view are rendered, and they are never evicted. */
+void
+tz_tile_cache_set_visible (TzTileCache *cache, guint level, gint x1, gint y1,
+        gint x2, gint y2)
+{
+    g_mutex_lock (&cache->lock);
+    cache->visible_level = level;
+    cache->visible_x1 = x1;
+    cache->visible_y1 = y1;
+    cache->visible_x2 = x2;
+    cache->visible_y2 = y2;
+    g_mutex_unlock (&cache->lock);
+}
+
+/* Return a tile, or NULL if it isn't rendered yet. Missing tiles are queued
+ * for rendering. */
+cairo_surface_t *
+tz_tile_cache_lookup (TzTileCache *cache, guint level, gint x, gint y)
+{
+    gint64 key = tile_key (level, x, y);
+    Tile *tile;
+    TileJob *job;
+
+    tile = g_hash_table_lookup (cache->tiles, &key);
+    if (tile)
+      {
+        if (tile->surface)
+          {
+            g_queue_unlink (&cache->lru, &tile->link);
+            g_queue_push_head_link (&cache->lru, &tile->link);
+          }
+        return tile->surface;
+      }
+
+    tile = g_new0 (Tile, 1);
+    tile->key = key;
+    tile->level = level;
+    tile->x = x;
+    tile->y = y;
+    tile->link.data = tile;
+    g_hash_table_insert (cache->tiles, &tile->key, tile);
+
+    job = g_new0 (TileJob, 1);
+    job->cache = cache;
+    job->key = key;
+    job->level = level;
+    job->x = x;
+    job->y = y;
+
+    g_atomic_int_inc (&cache->ref_count);
+    g_thread_pool_push (cache->pool, job, NULL);
+
+    return NULL;
+}
+
+
+/* ----------------- *
+ * Private functions *
+ * ----------------- */
+
+static gint64
+tile_key (guint level, gint x, gint y)
+{
+    return ((gint64) level << 48) | ((gint64) y << 24) | x;
+}
+
+static void
+tile_free (Tile *tile)
+{
+    if (tile->surface)
+        cairo_surface_destroy (tile->surface);
+    g_free (tile);
+}
+
+static gboolean
+tile_is_visible (TzTileCache *cache, guint level, gint x, gint y)
+{
+    gboolean visible;
+
+    g_mutex_lock (&cache->lock);
+    visible = level == cache->visible_level &&
+              x >= cache->visible_x1 && x < cache->visible_x2 &&
+              y >= cache->visible_y1 && y < cache->visible_y2;
+    g_mutex_unlock (&cache->lock);
+
+    return visible;
+}
+
+static void
+cache_unref (TzTileCache *cache)
+{
+    if (!g_atomic_int_dec_and_test (&cache->ref_count))
+        return;
+
+    g_mutex_clear (&cache->lock);
+    g_free (cache);
+}
+
+/* Evict the least recently used tiles that are out of view until the cache
+ * fits in its size limit */
+static void
+cache_trim (TzTileCache *cache)
+{
+    GList *link = cache->lru.tail;
+
+    while (cache->size > cache->max_size && link)
+      {
+        Tile *tile = link->data;
+
+        link = link->prev;
+
+        if (tile_is_visible (cache, tile->level, tile->x, tile->y))
+            continue;
+
+        g_queue_unlink (&cache->lru, &tile->link);
+        cache->size -= TILE_BYTES;
+        g_hash_table_remove (cache->tiles, &tile->key);
+    }
+}
+
+static void
+render_tile (gpointer data, gpointer user_data)
+{
+    TileJob *job = data;
+    const TzGeometry *geometry = job->cache->geometry;
+    gint width, height;
+    cairo_t *cr;
+
+    if (tile_is_visible (job->cache, job->level, job->x, job->y))
+      {
+        tz_tile_cache_get_level_size (job->cache, job->level, &width, &height);
+
+        job->surface = cairo_image_surface_create (CAIRO_FORMAT_ARGB32,
+                TZ_TILE_SIZE, TZ_TILE_SIZE);
+        cr = cairo_create (job->surface);
+        cairo_translate (cr, -job->x * TZ_TILE_SIZE, -job->y * TZ_TILE_SIZE);
+        tz_render_map (geometry, cr, width, height);
+        cairo_destroy (cr);
+      }
+
+    g_idle_add (tile_ready, job);
+}
+
+static gboolean
+tile_ready (gpointer user_data)
+{
+    TileJob *job = user_data;
+    TzTileCache *cache = job->cache;
+    Tile *tile = NULL;
+
+    if (!cache->freed)
+        tile = g_hash_table_lookup (cache->tiles, &job->key);
+
+    if (tile && job->surface)
+      {
+        tile->surface = job->surface;
+        job->surface = NULL;
+
+        g_queue_push_head_link (&cache->lru, &tile->link);
+        cache->size += TILE_BYTES;
+        cache_trim (cache);
+
+        cache->ready (cache->user_data);
+      }
+    else if (tile)
+      {
+        /* Skipped while out of view, so it can be asked for again */
+        g_hash_table_remove (cache->tiles, &job->key);
+      }
+
+    if (job->surface)
+        cairo_surface_destroy (job->surface);
+    g_free (job);
+    cache_unref (cache);
+
+    return G_SOURCE_REMOVE;
+}
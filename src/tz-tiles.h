@@ -0,0 +1,60 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+/* Tiled rendering of the map for zoomed views.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+#ifndef _TZ_TILES_H
+#define _TZ_TILES_H
+
+#include <glib.h>
+#include <cairo.h>
+
+#include "tz-geometry.h"
+
+G_BEGIN_DECLS
+
+#define TZ_TILE_SIZE 256
+
+typedef struct _TzTileCache TzTileCache;
+
+typedef void (*TzTileReadyFunc) (gpointer user_data);
+
+TzTileCache     *tz_tile_cache_new            (const TzGeometry *geometry,
+                                               gsize             max_size,
+                                               TzTileReadyFunc   ready,
+                                               gpointer          user_data);
+void             tz_tile_cache_free           (TzTileCache *cache);
+guint            tz_tile_cache_pick_level     (TzTileCache *cache,
+                                               gdouble      map_width);
+void             tz_tile_cache_get_level_size (TzTileCache *cache,
+                                               guint        level,
+                                               gint        *width,
+                                               gint        *height);
+void             tz_tile_cache_set_visible    (TzTileCache *cache,
+                                               guint        level,
+                                               gint         x1,
+                                               gint         y1,
+                                               gint         x2,
+                                               gint         y2);
+cairo_surface_t *tz_tile_cache_lookup         (TzTileCache *cache,
+                                               guint        level,
+                                               gint         x,
+                                               gint         y);
+
+G_END_DECLS
+
+#endif